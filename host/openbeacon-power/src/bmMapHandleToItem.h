@@ -28,27 +28,103 @@
 #ifndef __BMMAPHANDLETOITEM_H__
 #define __BMMAPHANDLETOITEM_H__
 
-#define HASH_MAP_INDEX_SIZE 0x100000
+/* items are stored in slabs of BM_SLAB_ITEMS entries each */
+#define BM_SLAB_SHIFT 8
+#define BM_SLAB_ITEMS (1UL<<BM_SLAB_SHIFT)
+#define BM_SLAB_MASK (BM_SLAB_ITEMS-1)
+#define BM_SLAB_COUNT 4096
+#define BM_ITEMS_MAX (BM_SLAB_COUNT*BM_SLAB_ITEMS)
+
+/* one lock protects a stripe of consecutive items */
+#define BM_STRIPE_SHIFT 4
+#define BM_SLAB_STRIPES (BM_SLAB_ITEMS>>BM_STRIPE_SHIFT)
+
+/* hash index is split into independently locked shards,
+ * each starting small and doubling at 50% load */
+#define BM_INDEX_SHARD_BITS 6
+#define BM_INDEX_SHARDS (1UL<<BM_INDEX_SHARD_BITS)
+#define BM_INDEX_SIZE_MIN 16
+/* old index slots moved per Add while a resize is pending */
+#define BM_INDEX_MIGRATE 8
+
+#define BM_ITEM_ALIGN 64
 
 typedef uint64_t bmHandle;
 typedef void (*bmIterationCallback) (void *Item, double timestamp,
 									 bool realtime);
+typedef bool (*bmExpiryCallback) (void *Item, double timestamp);
 
+/* hash index slot - maps a handle to its dense item index */
 typedef struct
 {
 	bmHandle handle;
-	pthread_mutex_t mutex;
-	void *data;
-} bmHandleMap;
+	uint32_t index;
+} bmHandleIndex;
+
+/* open addressing hash index shard with incremental resize */
+typedef struct
+{
+	pthread_mutex_t lock;
+	bmHandleIndex *index;
+	uint32_t size, count;
+	bmHandleIndex *index_old;
+	uint32_t size_old, migrate_pos;
+} __attribute__ ((aligned (BM_ITEM_ALIGN))) bmIndexShard;
+
+/* slab item header, followed by the item payload */
+typedef struct
+{
+	bmHandle handle;
+	uint32_t iterate;
+} bmItemHeader;
 
 class bmMapHandleToItem
 {
   private:
 	int m_ItemSize;
-	int m_MapIteratePos;
-	bmHandleMap m_Map[HASH_MAP_INDEX_SIZE];
-	bmHandleMap *m_MapIterate[HASH_MAP_INDEX_SIZE];
-	bmHandleMap *HashMap (bmHandle handle);
+	uint32_t m_ItemStride;
+	uint32_t m_ItemCount;
+	uint32_t m_ItemAllocated;
+	/* protects item allocation and the iteration list */
+	pthread_mutex_t m_Lock;
+	bmIndexShard m_Shard[BM_INDEX_SHARDS];
+	/* item payload slabs, addressed by dense item index */
+	uint8_t *m_Slab[BM_SLAB_COUNT];
+	pthread_mutex_t *m_Stripe[BM_SLAB_COUNT];
+	/* compact list of live item indices, same slab layout */
+	uint32_t *m_Iterate[BM_SLAB_COUNT];
+	/* released item indices available for reuse */
+	uint32_t *m_Free;
+	uint32_t m_FreeCount, m_FreeSize;
+	/* expiry candidates collected outside of the index lock */
+	uint32_t *m_Expired;
+	uint32_t m_ExpiredSize;
+	bmIterationCallback m_Archive;
+
+	static uint32_t Hash (bmHandle handle);
+	static bmHandleIndex *IndexLookup (bmHandleIndex * index, uint32_t size,
+									   bmHandle handle, uint32_t hash);
+	static void IndexInsert (bmHandleIndex * index, uint32_t size,
+							 bmHandle handle, uint32_t item);
+	static void IndexRemove (bmHandleIndex * index, uint32_t size,
+							 bmHandle handle);
+	static bmHandleIndex *ShardLookup (bmIndexShard * shard,
+									   bmHandle handle, uint32_t hash);
+	static void ShardMigrate (bmIndexShard * shard, uint32_t count);
+	static bool ShardResize (bmIndexShard * shard, uint32_t size);
+	static bool ShardReserve (bmIndexShard * shard);
+	static void ShardInsert (bmIndexShard * shard, bmHandle handle,
+							 uint32_t item);
+	static void ShardRemove (bmIndexShard * shard, bmHandle handle);
+	bmIndexShard *Shard (uint32_t hash);
+	bmItemHeader *Item (uint32_t index);
+	pthread_mutex_t *Stripe (uint32_t index);
+	uint32_t *IterateSlot (uint32_t pos);
+	bool Allocate (bmHandle handle, uint32_t * index);
+	void Release (bmItemHeader * item, uint32_t index);
+	void IterateSort (void);
+	bmItemHeader *Acquire (bmHandle handle, bool add,
+						   pthread_mutex_t ** mutex);
   public:
 	  bmMapHandleToItem (void);
 	 ~bmMapHandleToItem (void);
@@ -59,6 +135,8 @@ class bmMapHandleToItem
 	void *Add (bmHandle handle, pthread_mutex_t ** mutex);
 	int IterateLocked (bmIterationCallback Callback, double timestamp,
 					   bool realtime);
+	void SetArchiveCallback (bmIterationCallback Archive);
+	int Expire (bmExpiryCallback Expired, double timestamp);
 };
 
 #endif/*__BMMAPHANDLETOITEM_H__*/
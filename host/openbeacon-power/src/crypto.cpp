@@ -47,7 +47,11 @@ static const TAES g_default_key = {
 	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
 	0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF
 };
-static TCryptoEngine g_signature, g_encrypt;
+static TAESContext g_context;
+
+/* block cipher used for all context operations, picked at runtime */
+typedef void (*TAESBlocks)(const TAESKey* key, TAES* blocks, int count);
+static TAESBlocks g_aes_blocks;
 
 static const uint8_t g_sbox[256] = {
   0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5,
@@ -90,117 +94,6 @@ static inline uint8_t aes_xtime (uint8_t x)
   return (x & 0x80) ? ((x << 1) ^ 0x1b) : (x << 1);
 }
 
-TAES* aes_sign(const void* data, uint32_t length)
-{
-	uint8_t i, t, *src;
-
-	/* reset signature buffer */
-	memset(g_signature.out, 0xFF, sizeof(g_signature.out));
-
-	/* sign data */
-	src = (uint8_t*)data;
-	while(length)
-	{
-		/* process data block by block */
-		t = (length>=AES_BLOCK_SIZE) ? AES_BLOCK_SIZE : length;
-		length -= t;
-
-		/* XOR previous AES output data in */
-		for(i=0; i<t; i++)
-			g_signature.in[i] = g_signature.out[i] ^ *src++;
-
-		/* pad block if needed */
-		if(t<AES_BLOCK_SIZE)
-			memset(&g_signature.in[t], 0xFF, AES_BLOCK_SIZE-t);
-
-		/* AES hash block, result in 'out' */
-		aes(&g_signature);
-	}
-
-	/* return full AES signature */
-	return &g_signature.out;
-}
-
-static void aes_process(const uint8_t *src, uint8_t *dst, uint32_t length)
-{
-	uint8_t t, i;
-
-	/* encrypt data */
-	while(length)
-	{
-		/* process data block by block */
-		t = (length>=AES_BLOCK_SIZE) ? AES_BLOCK_SIZE : length;
-		length -= t;
-
-		/* AES encrypt block, result in 'out' */
-		aes(&g_encrypt);
-		/* make AES output the IV of the next encryption */
-		if(length)
-			memcpy(g_encrypt.in, g_encrypt.out, AES_BLOCK_SIZE);
-
-		/* XOR previous AES output data in */
-		for(i=0; i<t; i++)
-			*dst++ = g_encrypt.out[i] ^ *src++;
-	}
-}
-
-uint8_t aes_encr(const void* in, void* out, uint32_t length, uint8_t mac_len)
-{
-	/* verify parameters */
-	if(mac_len>AES_BLOCK_SIZE)
-		return 1;
-	if(length<=mac_len)
-		return 2;
-
-	/* calculate payload length */
-	length -= mac_len;
-	/* sign payload to create IV */
-	memcpy(&g_encrypt.in, aes_sign(in, length), mac_len);
-	/* pad IV with 0xFF if needed to generate IV block */
-	if(mac_len<AES_BLOCK_SIZE)
-		memset(&g_encrypt.in[mac_len], 0xFF, AES_BLOCK_SIZE-mac_len);
-	/* copy IV to payload end */
-	memcpy((uint8_t*)out + length, &g_encrypt.in, mac_len);
-
-	/* encrypt data */
-	aes_process((uint8_t*)in, (uint8_t*)out, length);
-	return 0;
-}
-
-uint8_t aes_decr(const void* in, void* out, uint32_t length, uint8_t mac_len)
-{
-	/* verify parameters */
-	if(mac_len>AES_BLOCK_SIZE)
-		return 1;
-	if(length<=mac_len)
-		return 2;
-
-	/* calculate payload length */
-	length -= mac_len;
-	/* re-create IV from end of packet */
-	memcpy(&g_encrypt.in, ((uint8_t*)in) + length, mac_len);
-	/* pad IV with 0xFF if needed to generate IV block */
-	if(mac_len<AES_BLOCK_SIZE)
-		memset(&g_encrypt.in[mac_len], 0xFF, AES_BLOCK_SIZE-mac_len);
-
-	/* decrypt data */
-	aes_process((uint8_t*)in, (uint8_t*)out, length);
-
-	/* verify signature */
-	if(memcmp(aes_sign(out, length), ((uint8_t*)in) + length, mac_len)==0)
-	{
-		/* reset signature in output */
-		memset(((uint8_t*)out) + length, 0xFF, mac_len);
-		return 0;
-	}
-	else
-	{
-		/* erase broken payload */
-		memset(out, 0, length);
-		return 3;
-	}
-}
-
 static void
 aes_add_round_keys(const TAES &key, TAES &state)
 {
@@ -223,20 +116,52 @@ aes_add_round_keys(const TAES &key, TAES &state)
 	AddRoundKey(15);
 }
 
-void aes(TCryptoEngine* engine)
+static void aes_expand_key(const TAES &base, TAESKey* expanded)
 {
 	TAES key;
-	TAES state;
+	uint8_t rcon, round;
+
+	memcpy(&key, &base, AES_BLOCK_SIZE);
+	memcpy(&expanded->round[0], &key, AES_BLOCK_SIZE);
+
+	rcon = 1;
+	for (round = 1; round <= AES_ROUNDS; round++)
+	{
+		key[0] ^= g_sbox[key[13]] ^ rcon;
+		key[1] ^= g_sbox[key[14]];
+		key[2] ^= g_sbox[key[15]];
+		key[3] ^= g_sbox[key[12]];
+
+		key[4] ^= key[0];
+		key[5] ^= key[1];
+		key[6] ^= key[2];
+		key[7] ^= key[3];
+
+		key[8] ^= key[4];
+		key[9] ^= key[5];
+		key[10] ^= key[6];
+		key[11] ^= key[7];
+
+		key[12] ^= key[8];
+		key[13] ^= key[9];
+		key[14] ^= key[10];
+		key[15] ^= key[11];
+
+		memcpy(&expanded->round[round], &key, AES_BLOCK_SIZE);
+
+		/* update rcon */
+		rcon = aes_xtime(rcon);
+	}
+}
+
+static void aes_encrypt_block(const TAESKey* key, TAES &state)
+{
 	uint8_t t[4];
-	uint8_t x, rcon;
+	uint8_t x;
 	uint8_t round;
 
-	memcpy(&key, &engine->key, AES_BLOCK_SIZE);
-	memcpy(&state, &engine->in, AES_BLOCK_SIZE);
+	aes_add_round_keys(key->round[0], state);
 
-	aes_add_round_keys(key, state);
-
-	rcon = 1;
 	for (round = 0; round < AES_ROUNDS; round++)
 	{
 		/* unroll SubBytes */
@@ -285,50 +210,304 @@ void aes(TCryptoEngine* engine)
 			MixColumn(12);
 		}
 
-		key[0] ^= g_sbox[key[13]] ^ rcon;
-		key[1] ^= g_sbox[key[14]];
-		key[2] ^= g_sbox[key[15]];
-		key[3] ^= g_sbox[key[12]];
+		aes_add_round_keys(key->round[round+1], state);
+	}
+}
 
-		key[4] ^= key[0];
-		key[5] ^= key[1];
-		key[6] ^= key[2];
-		key[7] ^= key[3];
+static void aes_blocks_sw(const TAESKey* key, TAES* blocks, int count)
+{
+	TAES state;
 
-		key[8] ^= key[4];
-		key[9] ^= key[5];
-		key[10] ^= key[6];
-		key[11] ^= key[7];
+	/* work on a local copy so the state can't alias the key */
+	for(; count; count--, blocks++)
+	{
+		memcpy(&state, blocks, AES_BLOCK_SIZE);
+		aes_encrypt_block(key, state);
+		memcpy(blocks, &state, AES_BLOCK_SIZE);
+	}
+}
 
-		key[12] ^= key[8];
-		key[13] ^= key[9];
-		key[14] ^= key[10];
-		key[15] ^= key[11];
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
 
-		aes_add_round_keys(key, state);
+#define AES_NI_ROUND(r) \
+	k = _mm_load_si128((const __m128i*)key->round[r]); \
+	b0 = _mm_aesenc_si128(b0, k); \
+	b1 = _mm_aesenc_si128(b1, k); \
+	b2 = _mm_aesenc_si128(b2, k); \
+	b3 = _mm_aesenc_si128(b3, k);
 
-		/* update rcon */
-		rcon = aes_xtime(rcon);
+__attribute__((target("aes,sse2")))
+static void aes_blocks_ni(const TAESKey* key, TAES* blocks, int count)
+{
+	int round;
+	__m128i k, k0, k10, b0, b1, b2, b3;
+
+	k0 = _mm_load_si128((const __m128i*)key->round[0]);
+	k10 = _mm_load_si128((const __m128i*)key->round[AES_ROUNDS]);
+
+	/* interleave four independent blocks to hide AESENC latency */
+	for(; count>=4; count-=4, blocks+=4)
+	{
+		b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)blocks[0]), k0);
+		b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)blocks[1]), k0);
+		b2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)blocks[2]), k0);
+		b3 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)blocks[3]), k0);
+		AES_NI_ROUND(1);
+		AES_NI_ROUND(2);
+		AES_NI_ROUND(3);
+		AES_NI_ROUND(4);
+		AES_NI_ROUND(5);
+		AES_NI_ROUND(6);
+		AES_NI_ROUND(7);
+		AES_NI_ROUND(8);
+		AES_NI_ROUND(9);
+		_mm_storeu_si128((__m128i*)blocks[0], _mm_aesenclast_si128(b0, k10));
+		_mm_storeu_si128((__m128i*)blocks[1], _mm_aesenclast_si128(b1, k10));
+		_mm_storeu_si128((__m128i*)blocks[2], _mm_aesenclast_si128(b2, k10));
+		_mm_storeu_si128((__m128i*)blocks[3], _mm_aesenclast_si128(b3, k10));
 	}
 
-	memcpy(&engine->out, &state, AES_BLOCK_SIZE);
+	/* remaining blocks */
+	for(; count; count--, blocks++)
+	{
+		b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)blocks[0]), k0);
+		for(round=1; round<AES_ROUNDS; round++)
+			b0 = _mm_aesenc_si128(b0,
+				_mm_load_si128((const __m128i*)key->round[round]));
+		_mm_storeu_si128((__m128i*)blocks[0], _mm_aesenclast_si128(b0, k10));
+	}
 }
+#endif
 
-/* initial key derivation */
-void aes_key_derivation(const TAES* key)
+static TAESBlocks aes_blocks_select(void)
 {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("aes"))
+		return aes_blocks_ni;
+#endif
+	return aes_blocks_sw;
+}
+
+static inline void aes_blocks(const TAESKey* key, TAES* blocks, int count)
+{
+	if(!g_aes_blocks)
+		g_aes_blocks = aes_blocks_select();
+	g_aes_blocks(key, blocks, count);
+}
+
+const char* aes_engine_name(void)
+{
+	if(!g_aes_blocks)
+		g_aes_blocks = aes_blocks_select();
+	return (g_aes_blocks == aes_blocks_sw) ? "software" : "aes-ni";
+}
+
+/* CBC-MAC over 'count' independent buffers of equal length */
+static void aes_sign_blocks(const TAESKey* key, const uint8_t* const* data,
+	TAES* signature, int count, uint32_t length)
+{
+	int j;
+	uint32_t pos;
+	uint8_t i, t;
+
+	/* reset signature buffers */
+	memset(signature, 0xFF, count*sizeof(TAES));
+
+	/* sign data block by block */
+	for(pos=0; pos<length; pos+=t)
+	{
+		t = ((length-pos)>=AES_BLOCK_SIZE) ? AES_BLOCK_SIZE : (length-pos);
+		for(j=0; j<count; j++)
+		{
+			/* XOR previous AES output data in */
+			for(i=0; i<t; i++)
+				signature[j][i] ^= data[j][pos+i];
+			/* pad block if needed */
+			if(t<AES_BLOCK_SIZE)
+				memset(&signature[j][t], 0xFF, AES_BLOCK_SIZE-t);
+		}
+		/* AES hash all blocks in lockstep */
+		aes_blocks(key, signature, count);
+	}
+}
+
+/* OFB style keystream, 'iv' holds the IV per buffer */
+static void aes_process_blocks(const TAESKey* key, const uint8_t* const* src,
+	uint8_t* const* dst, TAES* iv, int count, uint32_t length)
+{
+	int j;
+	uint32_t pos;
+	uint8_t i, t;
+
+	for(pos=0; pos<length; pos+=t)
+	{
+		t = ((length-pos)>=AES_BLOCK_SIZE) ? AES_BLOCK_SIZE : (length-pos);
+
+		/* AES output becomes IV of the next block */
+		aes_blocks(key, iv, count);
+
+		/* XOR AES output data in */
+		for(j=0; j<count; j++)
+			for(i=0; i<t; i++)
+				dst[j][pos+i] = iv[j][i] ^ src[j][pos+i];
+	}
+}
+
+void aes_sign_ctx(const TAESContext* ctx, const void* data, uint32_t length, TAES* signature)
+{
+	const uint8_t* src = (const uint8_t*)data;
+
+	aes_sign_blocks(&ctx->signature, &src, signature, 1, length);
+}
+
+uint8_t aes_encr_ctx(const TAESContext* ctx, const void* in, void* out, uint32_t length, uint8_t mac_len)
+{
+	TAES iv;
+	const uint8_t* src = (const uint8_t*)in;
+	uint8_t* dst = (uint8_t*)out;
+
+	/* verify parameters */
+	if(mac_len>AES_BLOCK_SIZE)
+		return 1;
+	if(length<=mac_len)
+		return 2;
+
+	/* calculate payload length */
+	length -= mac_len;
+	/* sign payload to create IV */
+	aes_sign_ctx(ctx, in, length, &iv);
+	/* pad IV with 0xFF if needed to generate IV block */
+	if(mac_len<AES_BLOCK_SIZE)
+		memset(&iv[mac_len], 0xFF, AES_BLOCK_SIZE-mac_len);
+	/* copy IV to payload end */
+	memcpy(dst + length, &iv, mac_len);
+
+	/* encrypt data */
+	aes_process_blocks(&ctx->encrypt, &src, &dst, &iv, 1, length);
+	return 0;
+}
+
+void aes_decr_batch(const TAESContext* ctx, const void* const* in, void* const* out, uint8_t* res, int count, uint32_t length, uint8_t mac_len)
+{
+	int j, n;
+	TAES iv[AES_BATCH], signature[AES_BATCH];
+	const uint8_t* src[AES_BATCH];
+	uint8_t* dst[AES_BATCH];
+
+	/* verify parameters */
+	if((mac_len>AES_BLOCK_SIZE) || (length<=mac_len))
+	{
+		memset(res, (mac_len>AES_BLOCK_SIZE) ? 1 : 2, count);
+		return;
+	}
+
+	/* calculate payload length */
+	length -= mac_len;
+
+	while(count>0)
+	{
+		n = (count>AES_BATCH) ? AES_BATCH : count;
+
+		for(j=0; j<n; j++)
+		{
+			src[j] = (const uint8_t*)in[j];
+			dst[j] = (uint8_t*)out[j];
+			/* re-create IV from end of packet */
+			memcpy(&iv[j], src[j] + length, mac_len);
+			/* pad IV with 0xFF if needed to generate IV block */
+			if(mac_len<AES_BLOCK_SIZE)
+				memset(&iv[j][mac_len], 0xFF, AES_BLOCK_SIZE-mac_len);
+		}
+
+		/* decrypt and verify all packets in lockstep */
+		aes_process_blocks(&ctx->encrypt, src, dst, iv, n, length);
+		aes_sign_blocks(&ctx->signature, dst, signature, n, length);
+
+		for(j=0; j<n; j++)
+		{
+			if(memcmp(&signature[j], src[j] + length, mac_len)==0)
+			{
+				/* reset signature in output */
+				memset(dst[j] + length, 0xFF, mac_len);
+				res[j] = 0;
+			}
+			else
+			{
+				/* erase broken payload */
+				memset(dst[j], 0, length);
+				res[j] = 3;
+			}
+		}
+
+		in += n;
+		out += n;
+		res += n;
+		count -= n;
+	}
+}
+
+uint8_t aes_decr_ctx(const TAESContext* ctx, const void* in, void* out, uint32_t length, uint8_t mac_len)
+{
+	uint8_t res;
+
+	aes_decr_batch(ctx, &in, &out, &res, 1, length, mac_len);
+	return res;
+}
+
+void aes_context_init(TAESContext* ctx, const TAES* key)
+{
+	TAESKey base;
+	TAES derived[2];
+
 	/* use base key to derieve needed keys */
-	memcpy(g_encrypt.key, key, sizeof(g_encrypt.key));
+	aes_expand_key(*key, &base);
+	memset(&derived[0], AES_KEYID_SIGNATURE, sizeof(derived[0]));
+	memset(&derived[1], AES_KEYID_ENCRYPTION, sizeof(derived[1]));
+	aes_blocks(&base, derived, 2);
+
+	/* expand site-signature and site-encryption keys once */
+	aes_expand_key(derived[0], &ctx->signature);
+	aes_expand_key(derived[1], &ctx->encrypt);
+}
+
+const TAESContext* aes_default_context(void)
+{
+	return &g_context;
+}
+
+TAES* aes_sign(const void* data, uint32_t length)
+{
+	static __thread TAES signature;
+
+	aes_sign_ctx(&g_context, data, length, &signature);
+	return &signature;
+}
+
+uint8_t aes_encr(const void* in, void* out, uint32_t length, uint8_t mac_len)
+{
+	return aes_encr_ctx(&g_context, in, out, length, mac_len);
+}
+
+uint8_t aes_decr(const void* in, void* out, uint32_t length, uint8_t mac_len)
+{
+	return aes_decr_ctx(&g_context, in, out, length, mac_len);
+}
 
-	/* create site-signature key */
-	memset(g_encrypt.in, AES_KEYID_SIGNATURE, sizeof(g_encrypt.in));
-	aes(&g_encrypt);
-	memcpy(g_signature.key, g_encrypt.out, sizeof(g_signature.key));
+void aes(TCryptoEngine* engine)
+{
+	TAESKey key;
+
+	aes_expand_key(engine->key, &key);
+	memcpy(&engine->out, &engine->in, AES_BLOCK_SIZE);
+	aes_blocks(&key, &engine->out, 1);
+}
 
-	/* finally, create site-encryption key */
-	memset(g_encrypt.in, AES_KEYID_ENCRYPTION, sizeof(g_encrypt.in));
-	aes(&g_encrypt);
-	memcpy(g_encrypt.key, g_encrypt.out, sizeof(g_encrypt.key));
+/* initial key derivation */
+void aes_key_derivation(const TAES* key)
+{
+	aes_context_init(&g_context, key);
 }
 
 void aes_init(void)
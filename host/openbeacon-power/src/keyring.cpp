@@ -0,0 +1,336 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "bmMapHandleToItem.h"
+#include "crypto.h"
+#include "keyring.h"
+
+/* reader cache handle - bit 48 keeps handle non-zero */
+#define KEYRING_HANDLE(ip,id) ((1ULL<<48)|(((uint64_t)(ip))<<16)|(id))
+
+typedef struct
+{
+	char name[KEYRING_NAME_SIZE];
+	TAESContext ctx;
+} TKeyringKey;
+
+typedef struct
+{
+	/* reader IP prefix or KEYRING_ROUTE_ID|reader_id */
+	uint32_t match, mask;
+	bool by_id;
+	int key;
+} TKeyringRoute;
+
+typedef struct
+{
+	/* index+1 of key which last verified for this reader */
+	int key;
+} TKeyringReader;
+
+static int g_keys;
+static TKeyringKey g_key[KEYRING_MAX_KEYS];
+static int g_routes;
+static TKeyringRoute g_route[KEYRING_MAX_ROUTES];
+static bmMapHandleToItem g_map_reader_key;
+
+int
+keyring_count (void)
+{
+	return g_keys ? g_keys : 1;
+}
+
+static const TAESContext *
+keyring_context (int key)
+{
+	/* without key ring use the compiled-in key */
+	return g_keys ? &g_key[key].ctx : aes_default_context ();
+}
+
+static void
+keyring_cache (uint32_t reader_ip, uint16_t reader_id, int key)
+{
+	TKeyringReader *item;
+	pthread_mutex_t *mutex;
+
+	if ((item = (TKeyringReader *)
+		 g_map_reader_key.Add (KEYRING_HANDLE (reader_ip, reader_id),
+							   &mutex)) != NULL)
+	{
+		item->key = key + 1;
+		pthread_mutex_unlock (mutex);
+	}
+}
+
+const TAESContext *
+keyring_route (uint32_t reader_ip, uint16_t reader_id)
+{
+	int i, key;
+	TKeyringReader *item;
+	TKeyringRoute *route;
+	pthread_mutex_t *mutex;
+
+	/* single key - nothing to route */
+	if (g_keys <= 1)
+		return keyring_context (0);
+
+	/* key which verified last time */
+	if ((item = (TKeyringReader *)
+		 g_map_reader_key.Find (KEYRING_HANDLE (reader_ip, reader_id),
+								&mutex)) != NULL)
+	{
+		key = item->key;
+		pthread_mutex_unlock (mutex);
+		if (key)
+			return &g_key[key - 1].ctx;
+	}
+
+	/* configured routes, first match wins */
+	for (i = 0, route = g_route; i < g_routes; i++, route++)
+		if (route->by_id ? (route->match == reader_id) :
+			((reader_ip & route->mask) == route->match))
+		{
+			keyring_cache (reader_ip, reader_id, route->key);
+			return &g_key[route->key].ctx;
+		}
+
+	return NULL;
+}
+
+uint8_t
+keyring_trial (uint32_t reader_ip, uint16_t reader_id,
+			   const TAESContext * skip, const void *in, void *out,
+			   uint32_t length, uint8_t mac_len)
+{
+	int i, count;
+	uint8_t res;
+	const TAESContext *ctx;
+
+	res = 3;
+	count = keyring_count ();
+	for (i = 0; i < count; i++)
+	{
+		if ((ctx = keyring_context (i)) == skip)
+			continue;
+
+		if ((res = aes_decr_ctx (ctx, in, out, length, mac_len)) == 0)
+		{
+			if (g_keys > 1)
+				keyring_cache (reader_ip, reader_id, i);
+			break;
+		}
+	}
+	return res;
+}
+
+uint8_t
+keyring_decr (uint32_t reader_ip, uint16_t reader_id, const void *in,
+			  void *out, uint32_t length, uint8_t mac_len)
+{
+	const TAESContext *ctx;
+
+	if ((ctx = keyring_route (reader_ip, reader_id)) != NULL &&
+		aes_decr_ctx (ctx, in, out, length, mac_len) == 0)
+		return 0;
+
+	/* unknown reader or key changed */
+	return keyring_trial (reader_ip, reader_id, ctx, in, out, length,
+						  mac_len);
+}
+
+static bool
+keyring_parse_key (const char *hex, TAES * key)
+{
+	int i;
+	unsigned int t;
+
+	if (strlen (hex) != (AES_BLOCK_SIZE * 2))
+		return false;
+
+	for (i = 0; i < AES_BLOCK_SIZE; i++)
+	{
+		if (!isxdigit (hex[i * 2]) || !isxdigit (hex[i * 2 + 1]) ||
+			sscanf (&hex[i * 2], "%2x", &t) != 1)
+			return false;
+		(*key)[i] = (uint8_t) t;
+	}
+	return true;
+}
+
+static bool
+keyring_parse_route (const char *value, TKeyringRoute * route)
+{
+	int bits;
+	char *p, *end, addr[INET_ADDRSTRLEN];
+	struct in_addr in;
+
+	/* route by reader_id from packet header */
+	if (!strncmp (value, "id:", 3))
+	{
+		route->by_id = true;
+		route->match = strtoul (&value[3], &end, 0);
+		route->mask = 0;
+		return (value[3] && !*end && route->match <= 0xFFFF);
+	}
+
+	/* route by reader IP address with optional prefix length */
+	if (strlen (value) >= sizeof (addr) + 3)
+		return false;
+	strncpy (addr, value, sizeof (addr) - 1);
+	addr[sizeof (addr) - 1] = 0;
+	bits = 32;
+	if ((p = strchr ((char *) value, '/')) != NULL)
+	{
+		bits = strtol (p + 1, &end, 10);
+		if (!p[1] || *end || (bits < 0) || (bits > 32))
+			return false;
+		addr[p - value] = 0;
+	}
+
+	if (inet_pton (AF_INET, addr, &in) != 1)
+		return false;
+
+	route->by_id = false;
+	route->mask = bits ? (0xFFFFFFFFUL << (32 - bits)) : 0;
+	route->match = ntohl (in.s_addr) & route->mask;
+	return true;
+}
+
+static int
+keyring_find (const char *name)
+{
+	int i;
+
+	for (i = 0; i < g_keys; i++)
+		if (!strcmp (g_key[i].name, name))
+			return i;
+	return -1;
+}
+
+bool
+keyring_load (const char *file)
+{
+	FILE *f;
+	int n, line;
+	char buffer[256], cmd[16], name[KEYRING_NAME_SIZE], value[64], *p;
+	TAES key;
+
+	if ((f = fopen (file, "r")) == NULL)
+	{
+		fprintf (stderr, "keyring: failed to open '%s'\n", file);
+		return false;
+	}
+
+	g_keys = g_routes = 0;
+	g_map_reader_key.SetItemSize (sizeof (TKeyringReader));
+
+	/* lines of "key <name> <hex>" or "route <name> <ip[/bits]|id:N>" */
+	for (line = 1; fgets (buffer, sizeof (buffer), f); line++)
+	{
+		if ((p = strchr (buffer, '#')) != NULL)
+			*p = 0;
+
+		if ((n = sscanf (buffer, "%15s %31s %63s", cmd, name, value)) <= 0)
+			continue;
+
+		if ((n == 3) && !strcmp (cmd, "key"))
+		{
+			if (keyring_find (name) >= 0)
+			{
+				fprintf (stderr, "keyring: %s:%i: duplicate key '%s'\n",
+						 file, line, name);
+				break;
+			}
+			if (g_keys >= KEYRING_MAX_KEYS)
+			{
+				fprintf (stderr, "keyring: %s:%i: too many keys\n", file,
+						 line);
+				break;
+			}
+			if (!keyring_parse_key (value, &key))
+			{
+				fprintf (stderr, "keyring: %s:%i: invalid key\n", file,
+						 line);
+				break;
+			}
+			strcpy (g_key[g_keys].name, name);
+			aes_context_init (&g_key[g_keys].ctx, &key);
+			g_keys++;
+		}
+		else if ((n == 3) && !strcmp (cmd, "route"))
+		{
+			if (g_routes >= KEYRING_MAX_ROUTES)
+			{
+				fprintf (stderr, "keyring: %s:%i: too many routes\n", file,
+						 line);
+				break;
+			}
+			if ((g_route[g_routes].key = keyring_find (name)) < 0)
+			{
+				fprintf (stderr, "keyring: %s:%i: unknown key '%s'\n",
+						 file, line, name);
+				break;
+			}
+			if (!keyring_parse_route (value, &g_route[g_routes]))
+			{
+				fprintf (stderr, "keyring: %s:%i: invalid route '%s'\n",
+						 file, line, value);
+				break;
+			}
+			g_routes++;
+		}
+		else
+		{
+			fprintf (stderr, "keyring: %s:%i: syntax error\n", file, line);
+			break;
+		}
+	}
+
+	/* stopped early on error */
+	n = !feof (f);
+	fclose (f);
+	memset (&key, 0, sizeof (key));
+
+	if (n || !g_keys)
+	{
+		if (!n)
+			fprintf (stderr, "keyring: no keys in '%s'\n", file);
+		g_keys = g_routes = 0;
+		return false;
+	}
+
+	fprintf (stderr, "keyring: %i keys, %i routes from '%s'\n", g_keys,
+			 g_routes, file);
+	return true;
+}
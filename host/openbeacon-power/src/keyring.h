@@ -0,0 +1,49 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __KEYRING_H__
+#define __KEYRING_H__
+
+#define KEYRING_MAX_KEYS 64
+#define KEYRING_MAX_ROUTES 1024
+#define KEYRING_NAME_SIZE 32
+
+/* load site keys and reader routes, replaces compiled-in key */
+extern bool keyring_load (const char *file);
+extern int keyring_count (void);
+/* key last verified for a reader, or NULL if unknown */
+extern const TAESContext *keyring_route (uint32_t reader_ip,
+										 uint16_t reader_id);
+/* trial decryption against all keys except 'skip', caches result */
+extern uint8_t keyring_trial (uint32_t reader_ip, uint16_t reader_id,
+							  const TAESContext * skip, const void *in,
+							  void *out, uint32_t length, uint8_t mac_len);
+/* routed decryption with trial fallback */
+extern uint8_t keyring_decr (uint32_t reader_ip, uint16_t reader_id,
+							 const void *in, void *out, uint32_t length,
+							 uint8_t mac_len);
+
+#endif/*__KEYRING_H__*/
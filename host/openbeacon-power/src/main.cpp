@@ -38,9 +38,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <math.h>
+#include <pthread.h>
+#include <getopt.h>
 
 #include "bmMapHandleToItem.h"
 #include "crypto.h"
+#include "keyring.h"
+#include "json.h"
 
 #define MAX_POWER_COUNT 32
 
@@ -164,6 +168,7 @@ process_packet(double timestamp, uint32_t reader_id, const TBeaconNgMarker &mark
 	uint32_t tag_id, tag_count;
 	TTagItem* item;
 	double time, *pt, delta;
+	static TJsonBuffer json;
 
 	tag_id = ntohl(marker.uid);
 
@@ -197,8 +202,18 @@ process_packet(double timestamp, uint32_t reader_id, const TBeaconNgMarker &mark
 			if( delta<0.5 )
 				tag_count++;
 		}
-		fprintf(stdout,"{\"tag\":%u, \"reader\":%u, \"power\":%u}\n", tag_id, reader_id, tag_count);
-		fflush(stdout);
+
+		if(!json.data)
+			json_init(&json, 128);
+		json_reset(&json);
+		json_str(&json, "{\"tag\":");
+		json_int(&json, tag_id);
+		json_str(&json, ", \"reader\":");
+		json_int(&json, reader_id);
+		json_str(&json, ", \"power\":");
+		json_int(&json, tag_count);
+		json_str(&json, "}\n");
+		json_write(&json, STDOUT_FILENO);
 	}
 }
 
@@ -233,7 +248,7 @@ parse_packet (double timestamp, uint32_t reader_id, const void *data, int len)
 	}
 
 	/* decrypt valid packet */
-	if((t = aes_decr(&pkt->log, &marker, sizeof(marker), CONFIG_SIGNATURE_SIZE))!=0)
+	if((t = keyring_decr(reader_id, ntohs(pkt->hdr.reader_id), &pkt->log, &marker, sizeof(marker), CONFIG_SIGNATURE_SIZE))!=0)
 	{
 		fprintf(stderr, " Failed decrypting packet with error [%i]\n\r", t);
 		return len;
@@ -298,13 +313,37 @@ listen_packets (FILE* out)
 	return 0;
 }
 
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+		"usage: %s [options]\n"
+		"  -k file      key ring with site keys and reader routes\n",
+		name);
+	exit (EXIT_FAILURE);
+}
+
 int
 main (int argc, char **argv)
 {
+	int opt;
+
 	g_map_tag.SetItemSize (sizeof (TTagItem));
 
 	/* initialize encryption */
 	aes_init();
 
+	/* parse options */
+	while ((opt = getopt (argc, argv, "k:h")) != -1)
+		switch (opt)
+		{
+			case 'k':
+				if (!keyring_load (optarg))
+					exit (EXIT_FAILURE);
+				break;
+			default:
+				usage (argv[0]);
+		}
+
 	return listen_packets (stdout);
 }
@@ -0,0 +1,631 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+#include "helper.h"
+#include "crypto.h"
+#include "main.h"
+#include "fusion.h"
+#include "json.h"
+#include "layout.h"
+#include "pool.h"
+#include "bmMapHandleToItem.h"
+#include "metrics.h"
+#include "distance.h"
+
+/* default workload */
+#define BENCH_TAGS 1000
+#define BENCH_RECORDS (256*1024)
+#define BENCH_STATUS 20
+#define BENCH_SEED 1
+
+/* operations timed together per latency sample */
+#define BENCH_SAMPLE 64
+/* estimation steps timed, records of one step processed in between */
+#define BENCH_STEPS 50
+#define BENCH_STEP_TIME 0.2
+
+/* every tag sends one record per second of simulated time */
+#define BENCH_TIME 1500000000.0
+/* first tag id - clear of the compiled-in beacons */
+#define BENCH_TAG_BASE 0x00100000
+#define BENCH_READER_IP 0x7F000001
+/* parser passes see the workload this much later - records of the
+ * previous pass have left the fusion window */
+#define BENCH_PASS_TIME (FUSION_WINDOW*4)
+#define BENCH_READERS 16
+#define BENCH_MAP_ITEM 64
+/* quantized calibration of the status records, see bench_generate */
+#define BENCH_CAL ((-9000+100-2000)*DISTANCE_SCALE/100)
+/* proximity radio carrier in MHz as used by the tracker */
+#define BENCH_FREQUENCY (2400+CONFIG_PROX_CHANNEL)
+
+typedef struct
+{
+	int tags, density, status, records;
+	uint64_t seed;
+	bool json;
+} TBenchConfig;
+
+typedef struct
+{
+	const char *name;
+	uint64_t ops, ns;
+	/* hardware cache misses within timed code, negative if unavailable */
+	int64_t misses;
+	/* nanoseconds per operation of each sample */
+	double *sample;
+	int samples, samples_size;
+} TBenchResult;
+
+/* times operations first..first+count-1 */
+typedef void (*TBenchOp) (int first, int count);
+
+static TBenchConfig g_config;
+static uint64_t g_rand;
+static TBeaconLogSighting *g_record;
+static TBeaconNgTracker *g_track;
+static double *g_time;
+static bmHandle *g_handle;
+static bmMapHandleToItem g_map_bench;
+static int g_perf = -1;
+static int g_failed;
+static TJsonBuffer g_json;
+static TDistanceModel g_distance;
+static int32_t *g_cal;
+static int16_t *g_power;
+static uint32_t *g_mm;
+
+/* xorshift64* - identical workload for identical seeds */
+static inline uint32_t
+bench_rand (void)
+{
+	g_rand ^= g_rand >> 12;
+	g_rand ^= g_rand << 25;
+	g_rand ^= g_rand >> 27;
+	return (uint32_t) ((g_rand * 2685821657736338717ULL) >> 32);
+}
+
+static void
+bench_generate (void)
+{
+	int i, j, n;
+	uint32_t tag, other, *epoch;
+	TBeaconNgTracker *track;
+	TBeaconLogSighting *pkt;
+
+	n = g_config.records;
+	g_record = (TBeaconLogSighting *) calloc (n, sizeof (*g_record));
+	g_track = (TBeaconNgTracker *) calloc (n, sizeof (*g_track));
+	g_time = (double *) malloc (n * sizeof (*g_time));
+	g_handle = (bmHandle *) malloc (n * sizeof (*g_handle));
+	g_cal = (int32_t *) malloc (n * sizeof (*g_cal));
+	g_power = (int16_t *) malloc (n * sizeof (*g_power));
+	g_mm = (uint32_t *) malloc (n * sizeof (*g_mm));
+	epoch = (uint32_t *) calloc (g_config.tags, sizeof (*epoch));
+	if (!g_record || !g_track || !g_time || !g_handle || !g_cal ||
+		!g_power || !g_mm || !epoch)
+		diep ("bench_generate");
+
+	g_rand = g_config.seed ^ 0x9E3779B97F4A7C15ULL;
+	for (i = 0; i < n; i++)
+	{
+		tag = bench_rand () % g_config.tags;
+		g_time[i] = BENCH_TIME + ((double) i / g_config.tags);
+
+		track = &g_track[i];
+		track->uid = BENCH_TAG_BASE + tag;
+		track->epoch = ++epoch[tag];
+		track->voltage = 28 + (bench_rand () % 6);
+		track->angle = bench_rand () % 90;
+		if ((int) (bench_rand () % 100) < g_config.status)
+		{
+			track->proto = RFBPROTO_BEACON_NG_STATUS;
+			track->p.status.rx_loss = -9000;
+			track->p.status.tx_loss = 100;
+			track->p.status.px_power = -2000;
+			g_handle[i] = track->uid;
+			g_power[i] = -70;
+		}
+		else
+		{
+			track->proto = RFBPROTO_BEACON_NG_SIGHTING;
+			for (j = 0; j < g_config.density; j++)
+			{
+				other = bench_rand () % g_config.tags;
+				if (other == tag)
+					other = (other + 1) % g_config.tags;
+				track->p.sighting[j].uid = BENCH_TAG_BASE + other;
+				track->p.sighting[j].rx_power = -50 - (bench_rand () % 40);
+			}
+			g_power[i] = g_config.density ?
+				track->p.sighting[0].rx_power : -70;
+			/* edge handle as used by the proximity map */
+			other = g_config.density ? track->p.sighting[0].uid : 0;
+			g_handle[i] = (track->uid < other) ?
+				((((uint64_t) track->uid) << 32) | other) :
+				((((uint64_t) other) << 32) | track->uid);
+		}
+		g_cal[i] = BENCH_CAL;
+
+		pkt = &g_record[i];
+		pkt->hdr.protocol = BEACONLOG_SIGHTING;
+		pkt->hdr.reader_id = htons (1 + (bench_rand () % BENCH_READERS));
+		pkt->hdr.size = htons (sizeof (*pkt));
+		pkt->sequence = htonl (i);
+		pkt->timestamp = htonl ((uint32_t) g_time[i]);
+		aes_encr (track, &pkt->log, sizeof (*track), CONFIG_SIGNATURE_SIZE);
+		pkt->hdr.icrc16 = htons (icrc16 (&pkt->hdr.protocol,
+										 sizeof (*pkt) -
+										 sizeof (pkt->hdr.icrc16)));
+	}
+	free (epoch);
+}
+
+/* cache misses of this process in user space, where permitted */
+static int
+bench_perf_open (void)
+{
+	struct perf_event_attr attr;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.size = sizeof (attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void
+bench_begin (TBenchResult * res, const char *name)
+{
+	memset (res, 0, sizeof (*res));
+	res->name = name;
+	res->misses = (g_perf >= 0) ? 0 : -1;
+	if (g_perf >= 0)
+		ioctl (g_perf, PERF_EVENT_IOC_RESET, 0);
+}
+
+static void
+bench_sample (TBenchResult * res, TBenchOp op, int first, int count)
+{
+	uint64_t start, ns;
+
+	if (res->samples == res->samples_size)
+	{
+		res->samples_size = res->samples_size ? res->samples_size * 2 : 1024;
+		if ((res->sample = (double *) realloc (res->sample,
+											   res->samples_size *
+											   sizeof (double))) == NULL)
+			diep ("bench_sample");
+	}
+
+	/* counter is only enabled around the timed code */
+	if (g_perf >= 0)
+		ioctl (g_perf, PERF_EVENT_IOC_ENABLE, 0);
+	start = metrics_clock ();
+	op (first, count);
+	ns = metrics_clock () - start;
+	if (g_perf >= 0)
+		ioctl (g_perf, PERF_EVENT_IOC_DISABLE, 0);
+
+	res->sample[res->samples++] = (double) ns / count;
+	res->ns += ns;
+	res->ops += count;
+}
+
+static int
+bench_compare (const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+bench_end (TBenchResult * res)
+{
+	double ns, p50, p99, misses;
+	uint64_t count;
+
+	if ((g_perf >= 0) &&
+		(read (g_perf, &count, sizeof (count)) == sizeof (count)))
+		res->misses = count;
+
+	qsort (res->sample, res->samples, sizeof (double), &bench_compare);
+	ns = res->ops ? (double) res->ns / res->ops : 0;
+	p50 = res->samples ? res->sample[res->samples / 2] : 0;
+	p99 = res->samples ? res->sample[(res->samples * 99) / 100] : 0;
+	misses = (res->ops && (res->misses >= 0)) ?
+		(double) res->misses / res->ops : -1;
+
+	if (g_config.json)
+	{
+		json_reset (&g_json);
+		json_str (&g_json, "{\"component\":\"");
+		json_str (&g_json, res->name);
+		json_str (&g_json, "\",\"ops\":");
+		json_int (&g_json, res->ops);
+		json_str (&g_json, ",\"ops_per_s\":");
+		json_fixed (&g_json, ns ? 1e9 / ns : 0, 0);
+		json_str (&g_json, ",\"ns_per_op\":");
+		json_fixed (&g_json, ns, 1);
+		json_str (&g_json, ",\"p50_ns\":");
+		json_fixed (&g_json, p50, 1);
+		json_str (&g_json, ",\"p99_ns\":");
+		json_fixed (&g_json, p99, 1);
+		json_str (&g_json, ",\"cache_misses_per_op\":");
+		if (misses >= 0)
+			json_fixed (&g_json, misses, 3);
+		else
+			json_str (&g_json, "null");
+		json_str (&g_json, "}\n");
+		if (!json_write (&g_json, STDOUT_FILENO))
+			diep ("json_write");
+	}
+	else
+	{
+		printf ("%-16s %12.0f %10.1f %10.1f %10.1f", res->name,
+				ns ? 1e9 / ns : 0, ns, p50, p99);
+		if (misses >= 0)
+			printf (" %10.3f\n", misses);
+		else
+			printf (" %10s\n", "n/a");
+		fflush (stdout);
+	}
+
+	free (res->sample);
+}
+
+static void
+bench_run (const char *name, TBenchOp op, int total, int sample)
+{
+	int i;
+	TBenchResult res;
+
+	bench_begin (&res, name);
+	for (i = 0; i < total; i += sample)
+		bench_sample (&res, op, i, ((total - i) < sample) ?
+					  (total - i) : sample);
+	bench_end (&res);
+}
+
+static void
+bench_op_decr (int first, int count)
+{
+	int i;
+	TBeaconNgTracker track;
+
+	for (i = first; i < (first + count); i++)
+		if (aes_decr (&g_record[i].log, &track, sizeof (track),
+					  CONFIG_SIGNATURE_SIZE))
+			g_failed++;
+}
+
+static void
+bench_op_decr_batch (int first, int count)
+{
+	int i, j, n;
+	const void *in[AES_BATCH];
+	void *out[AES_BATCH];
+	uint8_t res[AES_BATCH];
+	TBeaconNgTracker track[AES_BATCH];
+
+	for (i = first; i < (first + count); i += n)
+	{
+		n = ((first + count - i) < AES_BATCH) ? (first + count - i) :
+			AES_BATCH;
+		for (j = 0; j < n; j++)
+		{
+			in[j] = &g_record[i + j].log;
+			out[j] = &track[j];
+		}
+		aes_decr_batch (aes_default_context (), in, out, res, n,
+						sizeof (TBeaconNgTracker), CONFIG_SIGNATURE_SIZE);
+		for (j = 0; j < n; j++)
+			if (res[j])
+				g_failed++;
+	}
+}
+
+static void
+bench_op_map_add (int first, int count)
+{
+	int i;
+	pthread_mutex_t *mutex;
+
+	for (i = first; i < (first + count); i++)
+	{
+		if (g_map_bench.Add (g_handle[i], &mutex) == NULL)
+			diep ("bench_op_map_add");
+		pthread_mutex_unlock (mutex);
+	}
+}
+
+static void
+bench_op_map_find (int first, int count)
+{
+	int i;
+	pthread_mutex_t *mutex;
+
+	for (i = first; i < (first + count); i++)
+	{
+		if (g_map_bench.Find (g_handle[i], &mutex) == NULL)
+			g_failed++;
+		else
+			pthread_mutex_unlock (mutex);
+	}
+}
+
+static void
+bench_op_process (int first, int count)
+{
+	int i;
+
+	for (i = first; i < (first + count); i++)
+		process_packet (g_time[i], BENCH_READER_IP, g_track[i]);
+}
+
+static void
+bench_op_parse (int first, int count)
+{
+	int i;
+
+	for (i = first; i < (first + count); i++)
+		if (parse_packet (g_time[i], BENCH_READER_IP, &g_record[i],
+						  sizeof (TBeaconLogSighting)) !=
+			(int) sizeof (TBeaconLogSighting))
+			g_failed++;
+}
+
+static void
+bench_op_distance (int first, int count)
+{
+	int i;
+
+	for (i = first; i < (first + count); i++)
+		g_mm[i] = distance_mm (&g_distance, g_cal[i], g_power[i]);
+}
+
+static void
+bench_op_distance_batch (int first, int count)
+{
+	distance_batch (&g_distance, &g_cal[first], &g_power[first],
+					&g_mm[first], count);
+}
+
+/* time offset and reader of the current parser pass */
+static double g_pass_time;
+static uint32_t g_pass_reader = BENCH_READER_IP;
+
+/* one record per datagram as sent by the readers */
+static void
+bench_op_parse_batch (int first, int count)
+{
+	int i;
+	uint32_t reader_id[BENCH_SAMPLE];
+	const uint8_t *data[BENCH_SAMPLE];
+	int len[BENCH_SAMPLE];
+
+	for (i = 0; i < count; i++)
+	{
+		reader_id[i] = g_pass_reader;
+		data[i] = (const uint8_t *) &g_record[first + i];
+		len[i] = sizeof (TBeaconLogSighting);
+	}
+	parse_batch (g_time[first] + g_pass_time, count, reader_id, data, len);
+}
+
+static FILE *g_bench_out;
+static double g_bench_step;
+
+static void
+bench_op_step (int first, int count)
+{
+	thread_estimation_step (g_bench_out, g_bench_step, false);
+}
+
+static void
+bench_estimation (void)
+{
+	int i, j, next, step;
+	TBenchResult res;
+
+	if ((g_bench_out = fopen ("/dev/null", "w")) == NULL)
+		diep ("/dev/null");
+
+	/* records arriving between two steps are processed untimed */
+	step = (int) (g_config.tags * BENCH_STEP_TIME);
+	if (step < 1)
+		step = 1;
+	g_bench_step = g_time[g_config.records - 1];
+	next = 0;
+
+	bench_begin (&res, "estimation_step");
+	for (i = 0; i < BENCH_STEPS; i++)
+	{
+		g_bench_step += BENCH_STEP_TIME;
+		for (j = 0; j < step; j++)
+		{
+			process_packet (g_bench_step, BENCH_READER_IP, g_track[next]);
+			next = (next + 1) % g_config.records;
+		}
+		bench_sample (&res, &bench_op_step, i, 1);
+	}
+	bench_end (&res);
+
+	fclose (g_bench_out);
+}
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+			 "usage: %s [options]\n"
+			 "  -t tags      tag population (default %i)\n"
+			 "  -d slots     sightings per sighting record, 0-%i (default %i)\n"
+			 "  -m percent   share of status records (default %i)\n"
+			 "  -n records   generated records (default %i)\n"
+			 "  -s seed      workload seed (default %i)\n"
+			 "  -w workers   estimation threads (default 1)\n"
+			 "  -j           one JSON object per component on stdout\n",
+			 name, BENCH_TAGS, CONFIG_SIGHTING_SLOTS, CONFIG_SIGHTING_SLOTS,
+			 BENCH_STATUS, BENCH_RECORDS, BENCH_SEED);
+	exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+	int opt;
+
+	g_config.tags = BENCH_TAGS;
+	g_config.density = CONFIG_SIGHTING_SLOTS;
+	g_config.status = BENCH_STATUS;
+	g_config.records = BENCH_RECORDS;
+	g_config.seed = BENCH_SEED;
+	while ((opt = getopt (argc, argv, "t:d:m:n:s:w:jh")) != -1)
+		switch (opt)
+		{
+			case 't':
+				if ((g_config.tags = atoi (optarg)) < 2)
+					usage (argv[0]);
+				break;
+			case 'd':
+				g_config.density = atoi (optarg);
+				if ((g_config.density < 0) ||
+					(g_config.density > CONFIG_SIGHTING_SLOTS))
+					usage (argv[0]);
+				break;
+			case 'm':
+				g_config.status = atoi (optarg);
+				if ((g_config.status < 0) || (g_config.status > 100))
+					usage (argv[0]);
+				break;
+			case 'n':
+				if ((g_config.records = atoi (optarg)) < BENCH_SAMPLE)
+					usage (argv[0]);
+				break;
+			case 's':
+				g_config.seed = strtoull (optarg, NULL, 0);
+				break;
+			case 'w':
+				if (!pool_init (atoi (optarg)))
+					usage (argv[0]);
+				break;
+			case 'j':
+				g_config.json = true;
+				break;
+			default:
+				usage (argv[0]);
+		}
+
+	tracking_init ();
+	if (!layout_load (NULL))
+		exit (EXIT_FAILURE);
+	g_map_bench.SetItemSize (BENCH_MAP_ITEM);
+	json_init (&g_json, 1024);
+	distance_init (&g_distance, DISTANCE_FREE_SPACE, 2.0, BENCH_FREQUENCY);
+	bench_generate ();
+	g_perf = bench_perf_open ();
+
+	if (g_config.json)
+	{
+		json_str (&g_json, "{\"tags\":");
+		json_int (&g_json, g_config.tags);
+		json_str (&g_json, ",\"density\":");
+		json_int (&g_json, g_config.density);
+		json_str (&g_json, ",\"status\":");
+		json_int (&g_json, g_config.status);
+		json_str (&g_json, ",\"records\":");
+		json_int (&g_json, g_config.records);
+		json_str (&g_json, ",\"seed\":");
+		json_int (&g_json, g_config.seed);
+		json_str (&g_json, ",\"workers\":");
+		json_int (&g_json, pool_workers ());
+		json_str (&g_json, ",\"aes\":\"");
+		json_str (&g_json, aes_engine_name ());
+		json_str (&g_json, "\"}\n");
+		if (!json_write (&g_json, STDOUT_FILENO))
+			diep ("json_write");
+	}
+	else
+		printf ("bench: %i tags, %i sightings per record, %i%% status, "
+				"%i records, seed %llu, %i workers, %s\n"
+				"%-16s %12s %10s %10s %10s %10s\n", g_config.tags,
+				g_config.density, g_config.status, g_config.records,
+				(unsigned long long) g_config.seed, pool_workers (),
+				aes_engine_name (),
+				"component", "ops/s", "ns/op", "p50", "p99", "misses/op");
+
+	/* stateless components first, then the tracker state is built
+	 * by process_packet and updated by the parsers */
+	bench_run ("aes_decr", &bench_op_decr, g_config.records, BENCH_SAMPLE);
+	bench_run ("aes_decr_batch", &bench_op_decr_batch, g_config.records,
+			   BENCH_SAMPLE);
+	bench_run ("map_add", &bench_op_map_add, g_config.records, BENCH_SAMPLE);
+	bench_run ("map_find", &bench_op_map_find, g_config.records,
+			   BENCH_SAMPLE);
+	bench_run ("distance", &bench_op_distance, g_config.records,
+			   BENCH_SAMPLE);
+	bench_run ("distance_batch", &bench_op_distance_batch, g_config.records,
+			   BENCH_SAMPLE);
+	bench_run ("process_packet", &bench_op_process, g_config.records,
+			   BENCH_SAMPLE);
+	bench_run ("parse_packet", &bench_op_parse, g_config.records,
+			   BENCH_SAMPLE);
+	g_pass_time = BENCH_PASS_TIME;
+	bench_run ("parse_batch", &bench_op_parse_batch, g_config.records,
+			   BENCH_SAMPLE);
+	/* the same transmissions relayed by a second reader */
+	g_pass_reader++;
+	bench_run ("parse_copy", &bench_op_parse_batch, g_config.records,
+			   BENCH_SAMPLE);
+	bench_estimation ();
+
+	if (g_failed)
+	{
+		fprintf (stderr, "bench: %i operations failed\n", g_failed);
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
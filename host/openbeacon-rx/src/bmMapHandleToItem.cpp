@@ -32,27 +32,53 @@
 #include <pthread.h>
 
 #include "bmMapHandleToItem.h"
-#include "crc32.h"
+
+#define ITEM_HANDLE(item) __atomic_load_n (&(item)->handle, __ATOMIC_ACQUIRE)
+#define ITEM_HANDLE_SET(item, value) \
+	__atomic_store_n (&(item)->handle, (value), __ATOMIC_RELEASE)
 
 bmMapHandleToItem::bmMapHandleToItem (void)
 {
-	m_ItemSize = m_MapIteratePos = 0;
-	memset (&m_Map, 0, sizeof (m_Map));
-	memset (&m_MapIterate, 0, sizeof (m_MapIterate));
+	uint32_t i;
+
+	m_ItemSize = 0;
+	m_ItemStride = m_ItemCount = m_ItemAllocated = 0;
+	memset (&m_Shard, 0, sizeof (m_Shard));
+	for (i = 0; i < BM_INDEX_SHARDS; i++)
+		pthread_mutex_init (&m_Shard[i].lock, NULL);
+	memset (&m_Slab, 0, sizeof (m_Slab));
+	memset (&m_Stripe, 0, sizeof (m_Stripe));
+	memset (&m_Iterate, 0, sizeof (m_Iterate));
+	m_Free = m_Expired = NULL;
+	m_FreeCount = m_FreeSize = m_ExpiredSize = 0;
+	m_Archive = NULL;
+	pthread_mutex_init (&m_Lock, NULL);
 }
 
 bmMapHandleToItem::~bmMapHandleToItem (void)
 {
-	int i;
-	bmHandleMap *map = m_Map;
+	uint32_t i, j;
 
-	if (m_ItemSize > (int) sizeof (map->data))
-		for (i = 0; i < HASH_MAP_INDEX_SIZE; i++)
-		{
-			if (map->handle)
-				free (map->data);
-			map++;
-		}
+	for (i = 0; i < BM_SLAB_COUNT; i++)
+	{
+		if (m_Stripe[i])
+			for (j = 0; j < BM_SLAB_STRIPES; j++)
+				pthread_mutex_destroy (&m_Stripe[i][j]);
+		free (m_Stripe[i]);
+		free (m_Slab[i]);
+		free (m_Iterate[i]);
+	}
+
+	for (i = 0; i < BM_INDEX_SHARDS; i++)
+	{
+		free (m_Shard[i].index);
+		free (m_Shard[i].index_old);
+		pthread_mutex_destroy (&m_Shard[i].lock);
+	}
+
+	free (m_Free);
+	free (m_Expired);
+	pthread_mutex_destroy (&m_Lock);
 }
 
 bool bmMapHandleToItem::SetItemSize (int ItemSize)
@@ -62,6 +88,14 @@ bool bmMapHandleToItem::SetItemSize (int ItemSize)
 	else
 	{
 		m_ItemSize = ItemSize;
+
+		/* keep larger items cache line aligned */
+		m_ItemStride = sizeof (bmItemHeader) + ItemSize;
+		if (m_ItemStride < BM_ITEM_ALIGN)
+			m_ItemStride = (m_ItemStride + 7) & ~7UL;
+		else
+			m_ItemStride = (m_ItemStride + BM_ITEM_ALIGN - 1) &
+				~(BM_ITEM_ALIGN - 1UL);
 		return true;
 	}
 }
@@ -72,149 +106,594 @@ bmMapHandleToItem::GetItemSize (void)
 	return m_ItemSize;
 }
 
-bmHandleMap *
-bmMapHandleToItem::HashMap (bmHandle handle)
+void
+bmMapHandleToItem::SetArchiveCallback (bmIterationCallback Archive)
 {
-	int i;
-	uint32_t crc32 = 0xffffffffL;
+	m_Archive = Archive;
+}
+
+uint32_t
+bmMapHandleToItem::Hash (bmHandle handle)
+{
+	/* 64 bit finalizer mix - spreads sequential tag IDs */
+	handle ^= handle >> 33;
+	handle *= 0xff51afd7ed558ccdULL;
+	handle ^= handle >> 33;
+	handle *= 0xc4ceb9fe1a85ec53ULL;
+	handle ^= handle >> 33;
+
+	return (uint32_t) handle;
+}
+
+bmHandleIndex *
+bmMapHandleToItem::IndexLookup (bmHandleIndex * index, uint32_t size,
+								bmHandle handle, uint32_t hash)
+{
+	uint32_t pos, mask;
+	bmHandleIndex *slot;
+
+	if (!index)
+		return NULL;
+
+	mask = size - 1;
+	pos = hash & mask;
+	while (true)
+	{
+		slot = &index[pos];
+		if (slot->handle == handle)
+			return slot;
+		if (!slot->handle)
+			return NULL;
+		pos = (pos + 1) & mask;
+	}
+}
+
+void
+bmMapHandleToItem::IndexInsert (bmHandleIndex * index, uint32_t size,
+								bmHandle handle, uint32_t item)
+{
+	uint32_t pos, mask;
+
+	mask = size - 1;
+	pos = Hash (handle) & mask;
+	while (index[pos].handle && index[pos].handle != handle)
+		pos = (pos + 1) & mask;
+
+	index[pos].handle = handle;
+	index[pos].index = item;
+}
 
-	for (i = 0; i < (int) sizeof (handle); i++)
+void
+bmMapHandleToItem::IndexRemove (bmHandleIndex * index, uint32_t size,
+								bmHandle handle)
+{
+	uint32_t i, j, home, mask;
+	bmHandleIndex *slot;
+
+	if ((slot = IndexLookup (index, size, handle, Hash (handle))) == NULL)
+		return;
+
+	/* backward shift deletion keeps probe chains intact
+	 * without leaving tombstones behind */
+	mask = size - 1;
+	i = j = slot - index;
+	while (true)
 	{
-		crc32 =
-			crc32_table[(uint8_t) crc32 ^ (uint8_t) handle] ^ (crc32 >> 8);
-		handle >>= 8;
+		j = (j + 1) & mask;
+		if (!index[j].handle)
+			break;
+
+		/* leave entries alone whose home slot lies in (i,j] */
+		home = Hash (index[j].handle) & mask;
+		if ((i <= j) ? ((i < home) && (home <= j)) :
+			((i < home) || (home <= j)))
+			continue;
+
+		index[i] = index[j];
+		i = j;
 	}
+	index[i].handle = 0;
+}
 
-	return &m_Map[(crc32 ^ 0xffffffffUL) % HASH_MAP_INDEX_SIZE];
+bmHandleIndex *
+bmMapHandleToItem::ShardLookup (bmIndexShard * shard, bmHandle handle,
+								uint32_t hash)
+{
+	bmHandleIndex *slot;
+
+	if ((slot = IndexLookup (shard->index, shard->size, handle, hash)))
+		return slot;
+	return IndexLookup (shard->index_old, shard->size_old, handle, hash);
 }
 
-void *
-bmMapHandleToItem::Find (bmHandle handle, pthread_mutex_t ** mutex)
+void
+bmMapHandleToItem::ShardMigrate (bmIndexShard * shard, uint32_t count)
+{
+	bmHandleIndex *slot;
+
+	if (!shard->index_old)
+		return;
+
+	/* move a few slots of the previous index per call */
+	while (count-- && (shard->migrate_pos < shard->size_old))
+	{
+		slot = &shard->index_old[shard->migrate_pos++];
+		if (slot->handle)
+			IndexInsert (shard->index, shard->size, slot->handle,
+						 slot->index);
+	}
+
+	/* release previous index once drained */
+	if (shard->migrate_pos >= shard->size_old)
+	{
+		free (shard->index_old);
+		shard->index_old = NULL;
+		shard->size_old = shard->migrate_pos = 0;
+	}
+}
+
+bool
+bmMapHandleToItem::ShardResize (bmIndexShard * shard, uint32_t size)
+{
+	bmHandleIndex *index;
+
+	/* finish pending resize before starting the next one */
+	ShardMigrate (shard, shard->size_old);
+
+	if ((index = (bmHandleIndex *) calloc (size, sizeof (*index))) == NULL)
+		return false;
+
+	shard->index_old = shard->index;
+	shard->size_old = shard->index_old ? shard->size : 0;
+	shard->migrate_pos = 0;
+	shard->index = index;
+	shard->size = size;
+
+	return true;
+}
+
+bool
+bmMapHandleToItem::ShardReserve (bmIndexShard * shard)
+{
+	/* keep index load below 50% */
+	if (((shard->count + 1) * 2) <= shard->size)
+		return true;
+
+	return ShardResize (shard, shard->size ? shard->size * 2 :
+						BM_INDEX_SIZE_MIN);
+}
+
+void
+bmMapHandleToItem::ShardInsert (bmIndexShard * shard, bmHandle handle,
+								uint32_t item)
+{
+	IndexInsert (shard->index, shard->size, handle, item);
+	shard->count++;
+}
+
+void
+bmMapHandleToItem::ShardRemove (bmIndexShard * shard, bmHandle handle)
+{
+	/* deletion needs a single index */
+	ShardMigrate (shard, shard->size_old);
+	IndexRemove (shard->index, shard->size, handle);
+	shard->count--;
+}
+
+bmIndexShard *
+bmMapHandleToItem::Shard (uint32_t hash)
+{
+	return &m_Shard[hash >> (32 - BM_INDEX_SHARD_BITS)];
+}
+
+bmItemHeader *
+bmMapHandleToItem::Item (uint32_t index)
+{
+	return (bmItemHeader *) (m_Slab[index >> BM_SLAB_SHIFT] +
+							 (index & BM_SLAB_MASK) * m_ItemStride);
+}
+
+pthread_mutex_t *
+bmMapHandleToItem::Stripe (uint32_t index)
+{
+	return &m_Stripe[index >> BM_SLAB_SHIFT]
+		[(index & BM_SLAB_MASK) >> BM_STRIPE_SHIFT];
+}
+
+uint32_t *
+bmMapHandleToItem::IterateSlot (uint32_t pos)
+{
+	return &m_Iterate[pos >> BM_SLAB_SHIFT][pos & BM_SLAB_MASK];
+}
+
+bool
+bmMapHandleToItem::Allocate (bmHandle handle, uint32_t * index)
 {
-	bmHandleMap *map;
 	int i;
+	void *slab;
+	uint32_t *free_list, slab_index;
+	pthread_mutex_t *stripe;
+	bmItemHeader *item;
 
-	if (m_ItemSize && handle)
+	/* caller holds m_Lock */
+	if (m_ItemCount >= BM_ITEMS_MAX)
+		return false;
+
+	/* make sure the free list can take back every item */
+	if (m_ItemAllocated >= m_FreeSize)
 	{
+		free_list = (uint32_t *) realloc (m_Free, (m_FreeSize +
+			BM_SLAB_ITEMS) * sizeof (*m_Free));
+		if (!free_list)
+			return false;
+		m_Free = free_list;
+		m_FreeSize += BM_SLAB_ITEMS;
+	}
 
-		map = HashMap (handle);
+	/* allocate iteration list slab on demand */
+	if (!m_Iterate[m_ItemCount >> BM_SLAB_SHIFT])
+		if ((m_Iterate[m_ItemCount >> BM_SLAB_SHIFT] = (uint32_t *)
+			 malloc (BM_SLAB_ITEMS * sizeof (uint32_t))) == NULL)
+			return false;
 
-		for (i = 0; i < HASH_MAP_INDEX_SIZE; i++)
+	if (m_FreeCount)
+		/* recycle previously expired item */
+		*index = m_Free[--m_FreeCount];
+	else
+	{
+		/* allocate new slab and its stripe locks on demand */
+		*index = m_ItemAllocated;
+		slab_index = *index >> BM_SLAB_SHIFT;
+		if (!m_Slab[slab_index])
 		{
-			if (!map->handle)
-				return NULL;
-
-			if (map->handle == handle)
+			if ((stripe = (pthread_mutex_t *)
+				 malloc (BM_SLAB_STRIPES * sizeof (*stripe))) == NULL)
+				return false;
+			if (posix_memalign (&slab, BM_ITEM_ALIGN,
+								BM_SLAB_ITEMS * m_ItemStride))
 			{
-				if (mutex)
-				{
-					pthread_mutex_lock (&map->mutex);
-					*mutex = &map->mutex;
-				}
-#ifdef  DEBUG
-				if (i)
-					fprintf (stderr, "found %lu after %i items\n",
-							 (long unsigned int) handle, i);
-#endif	/*DEBUG*/
-				return (m_ItemSize <=
-					(int) sizeof (map->data)) ? &map->data : map->data;
+				free (stripe);
+				return false;
 			}
+			memset (slab, 0, BM_SLAB_ITEMS * m_ItemStride);
+			for (i = 0; i < (int) BM_SLAB_STRIPES; i++)
+				pthread_mutex_init (&stripe[i], NULL);
+			m_Stripe[slab_index] = stripe;
+			m_Slab[slab_index] = (uint8_t *) slab;
+		}
+		m_ItemAllocated++;
+	}
 
-			map++;
-			if (map >= &m_Map[HASH_MAP_INDEX_SIZE])
-				map = m_Map;
-		};
+	/* never take a stripe lock here - a caller of Find might
+	 * hold it while waiting for our index shard */
+	item = Item (*index);
+	ITEM_HANDLE_SET (item, handle);
+
+	/* append to iteration list */
+	item->iterate = m_ItemCount;
+	*IterateSlot (m_ItemCount++) = *index;
+
+	return true;
+}
+
+void
+bmMapHandleToItem::Release (bmItemHeader * item, uint32_t index)
+{
+	uint32_t last, moved;
+
+	/* caller holds m_Lock - compact iteration list by moving
+	 * the last entry into the hole */
+	last = m_ItemCount - 1;
+	if (item->iterate != last)
+	{
+		moved = *IterateSlot (last);
+		*IterateSlot (item->iterate) = moved;
+		Item (moved)->iterate = item->iterate;
+	}
+	m_ItemCount--;
+
+	m_Free[m_FreeCount++] = index;
+}
+
+static int
+bmCompareIndex (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+void
+bmMapHandleToItem::IterateSort (void)
+{
+	uint32_t pos;
+
+	/* caller holds m_Lock - restore item index order after evictions
+	 * so iteration visits each stripe in a single run */
+	if (m_ItemCount > m_ExpiredSize)
+		return;
+
+	for (pos = 0; pos < m_ItemCount; pos++)
+		m_Expired[pos] = *IterateSlot (pos);
+	qsort (m_Expired, m_ItemCount, sizeof (*m_Expired), bmCompareIndex);
+	for (pos = 0; pos < m_ItemCount; pos++)
+	{
+		*IterateSlot (pos) = m_Expired[pos];
+		Item (m_Expired[pos])->iterate = pos;
+	}
+}
+
+bmItemHeader *
+bmMapHandleToItem::Acquire (bmHandle handle, bool add,
+							pthread_mutex_t ** mutex)
+{
+	bool found;
+	uint32_t hash, index;
+	bmIndexShard *shard;
+	bmHandleIndex *slot;
+	bmItemHeader *item;
+	pthread_mutex_t *stripe;
+
+	if (!m_ItemSize || !handle)
+		return NULL;
+
+	hash = Hash (handle);
+	shard = Shard (hash);
+	while (true)
+	{
+		found = false;
+		index = 0;
+
+		pthread_mutex_lock (&shard->lock);
+		if (add)
+			ShardMigrate (shard, BM_INDEX_MIGRATE);
+		if ((slot = ShardLookup (shard, handle, hash)) != NULL)
+		{
+			index = slot->index;
+			found = true;
+		}
+		else if (add && ShardReserve (shard))
+		{
+			/* only new items touch the shared allocator lock */
+			pthread_mutex_lock (&m_Lock);
+			found = Allocate (handle, &index);
+			pthread_mutex_unlock (&m_Lock);
+			if (found)
+				ShardInsert (shard, handle, index);
+		}
+		pthread_mutex_unlock (&shard->lock);
+
+		if (!found)
+			return NULL;
+
+		item = Item (index);
+		if (!mutex)
+			return item;
+
+		/* retry if item got expired before we locked it */
+		stripe = Stripe (index);
+		pthread_mutex_lock (stripe);
+		if (ITEM_HANDLE (item) == handle)
+		{
+			*mutex = stripe;
+			return item;
+		}
+		pthread_mutex_unlock (stripe);
+	}
+}
+
+void *
+bmMapHandleToItem::Find (bmHandle handle, pthread_mutex_t ** mutex)
+{
+	bmItemHeader *item;
+
+	if ((item = Acquire (handle, false, mutex)) == NULL)
+	{
 #ifdef  DEBUG
 		fprintf (stderr, "can't find %lu\n", (long unsigned int) handle);
 #endif	 /*DEBUG*/
+		return NULL;
 	}
-	return NULL;
+	return item + 1;
 }
 
 int
 bmMapHandleToItem::GetItemCount (void)
 {
-	return m_MapIteratePos;
+	return m_ItemCount;
 }
 
 void *
 bmMapHandleToItem::Add (bmHandle handle, pthread_mutex_t ** mutex)
 {
-	bmHandleMap *map;
-	int i;
+	bmItemHeader *item;
 
-	if (m_ItemSize && handle)
-	{
+	item = Acquire (handle, true, mutex);
+	return item ? item + 1 : NULL;
+}
 
-		map = HashMap (handle);
+int
+bmMapHandleToItem::IterateLocked (bmIterationCallback cb, double timestamp,
+								  bool realtime)
+{
+	uint32_t pos, count, index;
+	pthread_mutex_t *stripe, *locked;
 
-		for (i = 0; i < HASH_MAP_INDEX_SIZE; i++)
-		{
-			if (!map->handle)
-			{
-				pthread_mutex_init (&map->mutex, NULL);
-				if (mutex)
-				{
-					pthread_mutex_lock (&map->mutex);
-					*mutex = &map->mutex;
-				}
-				map->handle = handle;
-
-				/* store object into m_MapIterate for quick interation */
-				m_MapIterate[m_MapIteratePos++] = map;
-
-				if (m_ItemSize <= (int) sizeof (map->data))
-					return &map->data;
-				else
-				{
-					map->data = malloc (m_ItemSize);
-					if (m_ItemSize > (int) sizeof (map->data))
-						memset (map->data, 0, m_ItemSize);
-					return map->data;
-				}
-			}
-			else if (map->handle == handle)
-			{
-				if (mutex)
-				{
-					pthread_mutex_lock (&map->mutex);
-					*mutex = &map->mutex;
-				}
-				return (m_ItemSize <= (int) sizeof (map->data)) ? &map->data
-					: map->data;
-			}
+	if (!cb || !m_ItemSize)
+		return -1;
+
+	/* items added meanwhile are appended behind count, only
+	 * Expire reorders the list - call it from the same thread */
+	pthread_mutex_lock (&m_Lock);
+	count = m_ItemCount;
+	pthread_mutex_unlock (&m_Lock);
 
-			map++;
-			if (map >= &m_Map[HASH_MAP_INDEX_SIZE])
-				map = m_Map;
+	/* take each stripe lock once per run of items */
+	locked = NULL;
+	for (pos = 0; pos < count; pos++)
+	{
+		index = *IterateSlot (pos);
+		stripe = Stripe (index);
+		if (stripe != locked)
+		{
+			if (locked)
+				pthread_mutex_unlock (locked);
+			pthread_mutex_lock (stripe);
+			locked = stripe;
 		}
+		cb (Item (index) + 1, timestamp, realtime);
 	}
-	return NULL;
+	if (locked)
+		pthread_mutex_unlock (locked);
+
+	return count;
 }
 
 int
-bmMapHandleToItem::IterateLocked (bmIterationCallback cb, double timestamp,
-								  bool realtime)
+bmMapHandleToItem::Expire (bmExpiryCallback Expired, double timestamp)
 {
-	int count;
-	bmHandleMap **p, *map;
+	uint32_t i, pos, count, index, *expired;
+	int res;
+	bmHandle handle;
+	bmIndexShard *shard;
+	bmItemHeader *item;
+	pthread_mutex_t *stripe, *locked;
+
+	if (!Expired || !m_ItemSize)
+		return -1;
+
+	pthread_mutex_lock (&m_Lock);
+	count = m_ItemCount;
+	pthread_mutex_unlock (&m_Lock);
+
+	if (count > m_ExpiredSize)
+	{
+		if ((expired = (uint32_t *) realloc (m_Expired,
+			count * 2 * sizeof (*m_Expired))) == NULL)
+			return -1;
+		m_Expired = expired;
+		m_ExpiredSize = count * 2;
+	}
 
-	if (cb && m_ItemSize)
+	/* collect candidates without blocking lookups */
+	res = 0;
+	locked = NULL;
+	for (pos = 0; pos < count; pos++)
 	{
-		p = m_MapIterate;
-		count = m_MapIteratePos;
-		while (count--)
+		index = *IterateSlot (pos);
+		stripe = Stripe (index);
+		if (stripe != locked)
 		{
-			map = *p++;
-			pthread_mutex_lock (&map->mutex);
-			cb ((m_ItemSize <= (int) sizeof (map->data)) ? &map->data
-				: map->data, timestamp, realtime);
-			pthread_mutex_unlock (&map->mutex);
+			if (locked)
+				pthread_mutex_unlock (locked);
+			pthread_mutex_lock (stripe);
+			locked = stripe;
 		}
-		map++;
-		return m_MapIteratePos;
+		if (Expired (Item (index) + 1, timestamp))
+			m_Expired[res++] = index;
 	}
-	else
-		return -1;
+	if (locked)
+		pthread_mutex_unlock (locked);
+
+	count = res;
+	res = 0;
+	for (pos = 0; pos < count; pos++)
+	{
+		index = m_Expired[pos];
+		item = Item (index);
+		if ((handle = ITEM_HANDLE (item)) == 0)
+			continue;
 
+		shard = Shard (Hash (handle));
+		pthread_mutex_lock (&shard->lock);
+
+		/* skip busy items - never wait for an item lock while holding
+		 * the index lock, they get evicted on the next run */
+		stripe = Stripe (index);
+		if (pthread_mutex_trylock (stripe))
+		{
+			pthread_mutex_unlock (&shard->lock);
+			continue;
+		}
+
+		/* item might have been refreshed meanwhile */
+		if ((ITEM_HANDLE (item) == handle) && Expired (item + 1, timestamp))
+		{
+			if (m_Archive)
+				m_Archive (item + 1, timestamp, false);
+
+			ShardRemove (shard, handle);
+
+			/* zero item before it becomes available for reuse */
+			ITEM_HANDLE_SET (item, 0);
+			memset (item + 1, 0, m_ItemSize);
+
+			pthread_mutex_lock (&m_Lock);
+			Release (item, index);
+			pthread_mutex_unlock (&m_Lock);
+			res++;
+		}
+		pthread_mutex_unlock (stripe);
+		pthread_mutex_unlock (&shard->lock);
+	}
+
+	if (!res)
+		return 0;
+
+	pthread_mutex_lock (&m_Lock);
+	IterateSort ();
+	pthread_mutex_unlock (&m_Lock);
+
+	/* give back index memory after large evictions */
+	for (i = 0; i < BM_INDEX_SHARDS; i++)
+	{
+		shard = &m_Shard[i];
+		pthread_mutex_lock (&shard->lock);
+		if (((shard->count * 8) < shard->size)
+			&& (shard->size > BM_INDEX_SIZE_MIN))
+			if (ShardResize (shard, shard->size / 2))
+				ShardMigrate (shard, shard->size_old);
+		pthread_mutex_unlock (&shard->lock);
+	}
+
+	return res;
+}
+
+void
+bmMapHandleToItem::GetStatistics (bmMapStatistics * stats)
+{
+	uint32_t i, pos, mask, probe, entries;
+	uint64_t total;
+	bmIndexShard *shard;
+	bmHandleIndex *slot;
+
+	memset (stats, 0, sizeof (*stats));
+	pthread_mutex_lock (&m_Lock);
+	stats->items = m_ItemCount;
+	stats->allocated = m_ItemAllocated;
+	pthread_mutex_unlock (&m_Lock);
+
+	total = entries = 0;
+	for (i = 0; i < BM_INDEX_SHARDS; i++)
+	{
+		shard = &m_Shard[i];
+		pthread_mutex_lock (&shard->lock);
+		stats->slots += shard->size + shard->size_old;
+		stats->used += shard->count;
+
+		/* entries still waiting for migration are not counted */
+		mask = shard->size - 1;
+		for (pos = 0, slot = shard->index; slot && (pos < shard->size);
+			 pos++, slot++)
+			if (slot->handle)
+			{
+				probe = (pos - Hash (slot->handle)) & mask;
+				if (probe > stats->probe_max)
+					stats->probe_max = probe;
+				total += probe;
+				entries++;
+			}
+		pthread_mutex_unlock (&shard->lock);
+	}
+	stats->probe_mean = entries ? (double) total / entries : 0;
 }
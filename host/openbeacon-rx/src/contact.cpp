@@ -0,0 +1,333 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "helper.h"
+#include "json.h"
+#include "snapshot.h"
+#include "contact.h"
+#include "stream.h"
+#include "bmMapHandleToItem.h"
+#include "metrics.h"
+
+#define CONTACT_HANDLE(tag1,tag2) ((((uint64_t)(tag1))<<32)|(tag2))
+
+/* open interval of a tag pair - estimation thread only */
+typedef struct
+{
+	uint32_t tag1, tag2;
+	uint32_t group1, group2;
+	uint32_t start, last, samples;
+	/* start event sent */
+	bool reported;
+	uint32_t rssi[CONTACT_RSSI_BINS];
+} TContactItem;
+
+static bool g_contact_enabled;
+static uint32_t g_contact_gap = CONTACT_GAP;
+static uint32_t g_contact_duration = CONTACT_DURATION;
+static int g_contact_power = CONTACT_POWER;
+static bmMapHandleToItem g_map_contact;
+static FILE *g_contact_file;
+static TJsonBuffer g_contact_json;
+/* events of the current step */
+static TContactEvent *g_contact_event;
+static int g_contact_event_count, g_contact_event_size;
+static uint32_t g_contact_sequence;
+
+static int
+contact_median (const TContactItem * item)
+{
+	int i;
+	uint32_t sum, half;
+
+	half = (item->samples + 1) / 2;
+	for (i = sum = 0; i < CONTACT_RSSI_BINS; i++)
+		if ((sum += item->rssi[i]) >= half)
+			break;
+	return i - CONTACT_RSSI_BINS;
+}
+
+static void
+contact_event (const TContactItem * item, int kind)
+{
+	TContactEvent *ev;
+
+	if (g_contact_event_count == g_contact_event_size)
+	{
+		g_contact_event_size = g_contact_event_size ?
+			g_contact_event_size * 2 : 1024;
+		if ((g_contact_event = (TContactEvent *) realloc (g_contact_event,
+				g_contact_event_size * sizeof (TContactEvent))) == NULL)
+			diep ("contact_event");
+	}
+
+	ev = &g_contact_event[g_contact_event_count++];
+	ev->kind = kind;
+	ev->tag1 = item->tag1;
+	ev->tag2 = item->tag2;
+	ev->group1 = item->group1;
+	ev->group2 = item->group2;
+	ev->start = item->start;
+	ev->end = item->last;
+	ev->samples = item->samples;
+	ev->rssi = contact_median (item);
+
+	if (kind == CONTACT_END)
+		metrics_count (METRIC_CONTACT, 1);
+}
+
+/* report contacts which lasted long enough */
+static void
+contact_end (TContactItem * item)
+{
+	if (item->reported)
+		contact_event (item, CONTACT_END);
+}
+
+void
+contact_sample (uint32_t tag1, uint32_t tag2, uint32_t group1,
+				uint32_t group2, uint32_t time, int power)
+{
+	TContactItem *item;
+
+	if (power < g_contact_power)
+		return;
+
+	if ((item = (TContactItem *)
+		 g_map_contact.Add (CONTACT_HANDLE (tag1, tag2), NULL)) == NULL)
+		diep ("can't add contact");
+
+	/* silence longer than the gap tolerance starts a new contact */
+	if (item->samples && (time > item->last) &&
+		((time - item->last) > g_contact_gap))
+	{
+		contact_end (item);
+		item->samples = 0;
+	}
+	if (!item->samples)
+	{
+		memset (item, 0, sizeof (*item));
+		item->tag1 = tag1;
+		item->tag2 = tag2;
+		item->start = item->last = time;
+	}
+
+	item->group1 = group1;
+	item->group2 = group2;
+	if (time > item->last)
+		item->last = time;
+	item->samples++;
+	if (power > -1)
+		power = -1;
+	item->rssi[power + CONTACT_RSSI_BINS]++;
+
+	if (!item->reported &&
+		((item->last - item->start) >= g_contact_duration))
+	{
+		item->reported = true;
+		contact_event (item, CONTACT_START);
+	}
+}
+
+static bool
+contact_expire (void *Context, double timestamp)
+{
+	return (timestamp - ((TContactItem *) Context)->last) > g_contact_gap;
+}
+
+static bool
+contact_expire_all (void *Context, double timestamp)
+{
+	return true;
+}
+
+/* contact left the map */
+static void
+contact_archive (void *Context, double timestamp, bool realtime)
+{
+	contact_end ((TContactItem *) Context);
+}
+
+static void
+contact_enable (void)
+{
+	if (g_contact_enabled)
+		return;
+
+	g_map_contact.SetItemSize (sizeof (TContactItem));
+	g_map_contact.SetArchiveCallback (&contact_archive);
+	metrics_map ("contact", &g_map_contact);
+	g_contact_enabled = true;
+}
+
+bool
+contact_config (const char *config)
+{
+	char *end;
+	long gap, duration, power;
+
+	gap = strtol (config, &end, 10);
+	if ((end == config) || (*end != ',') || (gap < 1))
+		return false;
+	config = end + 1;
+	duration = strtol (config, &end, 10);
+	if ((end == config) || (duration < 0))
+		return false;
+	power = CONTACT_POWER;
+	if (*end == ',')
+	{
+		config = end + 1;
+		power = strtol (config, &end, 10);
+		if ((end == config) || (power < CONTACT_POWER) || (power > 0))
+			return false;
+	}
+	if (*end)
+		return false;
+
+	g_contact_gap = gap;
+	g_contact_duration = duration;
+	g_contact_power = power;
+	contact_enable ();
+	return true;
+}
+
+static void
+contact_close (void)
+{
+	if (g_contact_file)
+		fclose (g_contact_file);
+	g_contact_file = NULL;
+}
+
+bool
+contact_open (const char *file)
+{
+	if ((g_contact_file = fopen (file, "a")) == NULL)
+	{
+		fprintf (stderr, "contact: failed to open '%s'\n", file);
+		return false;
+	}
+
+	json_init (&g_contact_json, 64 * 1024);
+	atexit (&contact_close);
+	contact_enable ();
+	return true;
+}
+
+bool
+contact_active (void)
+{
+	return g_contact_enabled;
+}
+
+void
+contact_format (TJsonBuffer * buf, const TContactEvent * ev)
+{
+	json_str (buf, (ev->kind == CONTACT_START) ?
+			  "{\"contact\":\"start\",\"tag\":[" :
+			  "{\"contact\":\"end\",\"tag\":[");
+	json_int (buf, ev->tag1);
+	json_char (buf, ',');
+	json_int (buf, ev->tag2);
+	json_char (buf, ']');
+	if (ev->group1 || ev->group2)
+	{
+		json_str (buf, ",\"group\":[");
+		json_int (buf, ev->group1);
+		json_char (buf, ',');
+		json_int (buf, ev->group2);
+		json_char (buf, ']');
+	}
+	json_str (buf, ",\"start\":");
+	json_int (buf, ev->start);
+	if (ev->kind == CONTACT_END)
+	{
+		json_str (buf, ",\"end\":");
+		json_int (buf, ev->end);
+		json_str (buf, ",\"samples\":");
+		json_int (buf, ev->samples);
+		json_str (buf, ",\"rssi\":");
+		json_int (buf, ev->rssi);
+	}
+	json_char (buf, '}');
+}
+
+/* hand events of this step to the log and event streams */
+static void
+contact_publish (void)
+{
+	int i;
+
+	if (!g_contact_event_count)
+		return;
+
+	if (g_contact_file)
+	{
+		json_reset (&g_contact_json);
+		for (i = 0; i < g_contact_event_count; i++)
+		{
+			contact_format (&g_contact_json, &g_contact_event[i]);
+			json_char (&g_contact_json, '\n');
+		}
+		if ((fwrite (g_contact_json.data, 1, g_contact_json.len,
+					 g_contact_file) != g_contact_json.len) ||
+			fflush (g_contact_file))
+			diep ("contact: write");
+	}
+
+	stream_contact (g_contact_sequence, g_contact_event,
+					g_contact_event_count);
+	g_contact_event_count = 0;
+}
+
+void
+contact_step (uint32_t sequence, double timestamp)
+{
+	if (!g_contact_enabled)
+		return;
+
+	g_contact_sequence = sequence;
+	g_map_contact.Expire (&contact_expire, timestamp);
+	contact_publish ();
+}
+
+void
+contact_flush (void)
+{
+	if (!g_contact_enabled)
+		return;
+
+	g_map_contact.Expire (&contact_expire_all, 0);
+	contact_publish ();
+}
@@ -0,0 +1,71 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __CONTACT_H__
+#define __CONTACT_H__
+
+/* seconds without a sighting which end a contact */
+#define CONTACT_GAP 20
+/* shorter contacts are never reported */
+#define CONTACT_DURATION 20
+/* weakest received power counted as a sighting */
+#define CONTACT_POWER (-128)
+/* median power histogram, one bin per dBm from -128 to -1 */
+#define CONTACT_RSSI_BINS 128
+
+#define CONTACT_START 0
+#define CONTACT_END 1
+
+/* start is reported once a contact lasted the minimum duration,
+ * end once no sighting arrived for the gap tolerance */
+typedef struct
+{
+	int kind;
+	uint32_t tag1, tag2;
+	uint32_t group1, group2;
+	/* unix time of the first and last sighting */
+	uint32_t start, end;
+	uint32_t samples;
+	int rssi;
+} TContactEvent;
+
+/* "gap,duration[,dBm]" - enables the contact engine */
+extern bool contact_config (const char *config);
+/* append events as JSON lines, also enables the engine */
+extern bool contact_open (const char *file);
+extern bool contact_active (void);
+
+/* estimation thread - sightings of a tag pair in time order, then
+ * contact_step once per estimation step */
+extern void contact_sample (uint32_t tag1, uint32_t tag2, uint32_t group1,
+							uint32_t group2, uint32_t time, int power);
+extern void contact_step (uint32_t sequence, double timestamp);
+/* end all open contacts, end of replay */
+extern void contact_flush (void);
+
+extern void contact_format (TJsonBuffer * buf, const TContactEvent * ev);
+
+#endif/*__CONTACT_H__*/
@@ -36,12 +36,26 @@
 #define AES_KEYID_SIGNATURE  0x02
 #define AES_KEYID_AUTH       0x03
 
+/* packets decrypted in lockstep by aes_decr_batch */
+#define AES_BATCH 8
+
 typedef uint8_t TAES[AES_BLOCK_SIZE];
 
 typedef struct {
 	TAES key, in, out;
 } PACKED TCryptoEngine;
 
+/* expanded AES-128 key schedule */
+typedef struct {
+	TAES round[AES_ROUNDS+1];
+} __attribute__((aligned(16))) TAESKey;
+
+/* derived site keys - read-only after aes_context_init */
+typedef struct {
+	TAESKey encrypt;
+	TAESKey signature;
+} TAESContext;
+
 extern void aes_init(void);
 extern void aes_key_derivation(const TAES* key);
 extern void aes(TCryptoEngine* engine);
@@ -49,4 +63,13 @@ extern TAES* aes_sign(const void* data, uint32_t length);
 extern uint8_t aes_encr(const void* in, void* out, uint32_t size, uint8_t mac_len);
 extern uint8_t aes_decr(const void* in, void* out, uint32_t length, uint8_t mac_len);
 
+/* reentrant context based API */
+extern const char* aes_engine_name(void);
+extern const TAESContext* aes_default_context(void);
+extern void aes_context_init(TAESContext* ctx, const TAES* key);
+extern void aes_sign_ctx(const TAESContext* ctx, const void* data, uint32_t length, TAES* signature);
+extern uint8_t aes_encr_ctx(const TAESContext* ctx, const void* in, void* out, uint32_t length, uint8_t mac_len);
+extern uint8_t aes_decr_ctx(const TAESContext* ctx, const void* in, void* out, uint32_t length, uint8_t mac_len);
+extern void aes_decr_batch(const TAESContext* ctx, const void* const* in, void* const* out, uint8_t* res, int count, uint32_t length, uint8_t mac_len);
+
 #endif/*__CRYPTO_H__*/
@@ -0,0 +1,128 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "helper.h"
+#include "distance.h"
+
+/* free space path loss at 1km and 1MHz: 20*log10(41.88) dB */
+#define DISTANCE_FSPL_KM_MHZ 41.88
+
+/* unquantized reference conversion in mm */
+static double
+distance_exact (const TDistanceModel * model, double loss)
+{
+	double d;
+
+	if (model->model == DISTANCE_FREE_SPACE)
+		/* free space path loss solved for distance in km */
+		return (pow (10, loss / 20.0) /
+				(DISTANCE_FSPL_KM_MHZ * model->frequency)) * 1000000;
+
+	/* log-distance model referenced to free space loss at 1m */
+	d = loss - 20 * log10 (DISTANCE_FSPL_KM_MHZ * model->frequency / 1000);
+	return pow (10, d / (10 * model->exponent)) * 1000;
+}
+
+void
+distance_init (TDistanceModel * model, int type, double exponent,
+			   double frequency)
+{
+	int i;
+	double mm;
+
+	model->model = type;
+	model->exponent = (type == DISTANCE_FREE_SPACE) ? 2.0 : exponent;
+	model->frequency = frequency;
+
+	if (!model->table &&
+		!(model->table =
+		  (uint32_t *) malloc (DISTANCE_TABLE_SIZE * sizeof (uint32_t))))
+		diep ("distance_init");
+
+	for (i = 0; i < DISTANCE_TABLE_SIZE; i++)
+	{
+		mm = distance_exact (model,
+							 (double) (i + DISTANCE_LOSS_MIN) /
+							 DISTANCE_SCALE);
+		model->table[i] = (mm >= UINT32_MAX) ? UINT32_MAX : (uint32_t) mm;
+	}
+}
+
+/* "free" or "exp:<path loss exponent>" */
+bool
+distance_parse (TDistanceModel * model, const char *spec, double frequency)
+{
+	char *end;
+	double exponent;
+
+	if (!strcmp (spec, "free"))
+	{
+		distance_init (model, DISTANCE_FREE_SPACE, 2.0, frequency);
+		return true;
+	}
+
+	if (strncmp (spec, "exp:", 4))
+		return false;
+	exponent = strtod (&spec[4], &end);
+	if (*end || (exponent < 1.0) || (exponent > 6.0))
+		return false;
+
+	distance_init (model, DISTANCE_LOG_DISTANCE, exponent, frequency);
+	return true;
+}
+
+const char *
+distance_name (const TDistanceModel * model)
+{
+	return (model->model == DISTANCE_FREE_SPACE) ? "free space" :
+		"log-distance";
+}
+
+void
+distance_batch (const TDistanceModel * model, const int32_t * cal,
+				const int16_t * power, uint32_t * mm, int count)
+{
+	int i;
+	int32_t loss;
+	const uint32_t *table;
+
+	/* branch free clamp keeps the loop vectorizable (gather) */
+	table = model->table - DISTANCE_LOSS_MIN;
+	for (i = 0; i < count; i++)
+	{
+		loss = cal[i] - ((int32_t) power[i] * DISTANCE_SCALE);
+		loss = (loss < DISTANCE_LOSS_MIN) ? DISTANCE_LOSS_MIN : loss;
+		loss = (loss > DISTANCE_LOSS_MAX) ? DISTANCE_LOSS_MAX : loss;
+		mm[i] = table[loss];
+	}
+}
@@ -0,0 +1,82 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __DISTANCE_H__
+#define __DISTANCE_H__
+
+/* distance models */
+#define DISTANCE_FREE_SPACE 0
+#define DISTANCE_LOG_DISTANCE 1
+
+/* path loss (cal - rx_power) is quantized to 1/DISTANCE_SCALE dB */
+#define DISTANCE_SCALE 100
+#define DISTANCE_LOSS_MIN (-100*DISTANCE_SCALE)
+#define DISTANCE_LOSS_MAX (150*DISTANCE_SCALE)
+#define DISTANCE_TABLE_SIZE (DISTANCE_LOSS_MAX-DISTANCE_LOSS_MIN+1)
+
+typedef struct
+{
+	int model;
+	/* path loss exponent, 2.0 for free space */
+	double exponent;
+	/* carrier frequency in MHz */
+	double frequency;
+	/* distance in mm, indexed by quantized loss - DISTANCE_LOSS_MIN */
+	uint32_t *table;
+} TDistanceModel;
+
+extern void distance_init (TDistanceModel * model, int type, double exponent,
+						   double frequency);
+extern bool distance_parse (TDistanceModel * model, const char *spec,
+							double frequency);
+extern const char *distance_name (const TDistanceModel * model);
+/* cal in 1/DISTANCE_SCALE dB, power in dBm */
+extern void distance_batch (const TDistanceModel * model,
+							const int32_t * cal, const int16_t * power,
+							uint32_t * mm, int count);
+
+/* quantize calibration value to table resolution */
+static inline int32_t
+distance_quantize (double cal)
+{
+	return (int32_t) lrint (cal * DISTANCE_SCALE);
+}
+
+/* distance in mm for quantized calibration and received power */
+static inline uint32_t
+distance_mm (const TDistanceModel * model, int32_t cal, int power)
+{
+	int32_t loss;
+
+	loss = cal - (power * DISTANCE_SCALE);
+	if (loss < DISTANCE_LOSS_MIN)
+		loss = DISTANCE_LOSS_MIN;
+	else if (loss > DISTANCE_LOSS_MAX)
+		loss = DISTANCE_LOSS_MAX;
+	return model->table[loss - DISTANCE_LOSS_MIN];
+}
+
+#endif/*__DISTANCE_H__*/
@@ -32,12 +32,38 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <zlib.h>
 
 #define LOG "FILTER_SINGULARSIGHTING "
 
+/* bytes read per system call */
+#define BLOCK_SIZE (256*1024)
+/* uncompressed bytes queued for the compression thread - objects
+ * exceeding it are not compressed rather than stalling the pipe */
+#define GZ_BACKLOG (64*1024*1024)
+#define GZ_LEVEL 6
+
+/* compression thread work items */
+#define CHUNK_DATA 0
+#define CHUNK_ROTATE 1
+#define CHUNK_END 2
+
+typedef struct TChunk
+{
+	struct TChunk *next;
+	int type;
+	/* rotate - object compressed completely */
+	bool keep;
+	size_t len;
+	uint8_t *data;
+} TChunk;
+
 static FILE *g_ftextlog;
-static gzFile g_fgzlog;
 
 static char *g_file_gztarget_tmp, *g_file_gztarget;
 static char *g_file_target_tmp, *g_file_target;
@@ -47,19 +73,132 @@ static const char g_tmp_suffix[] = ".tmp";
 #define GZ_SUFFIX_SIZE (sizeof(g_gz_suffix)-1)
 #define TMP_SUFFIX_SIZE (sizeof(g_tmp_suffix)-1)
 
+static char g_gz_mode[4];
+static bool g_gz_dropped, g_gz_lagging;
+static pthread_t g_gz_thread;
+static pthread_mutex_t g_gz_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_gz_cond = PTHREAD_COND_INITIALIZER;
+static TChunk *g_gz_head, *g_gz_tail;
+static size_t g_gz_backlog;
+
+/* pass input through by duplicating pipe buffers */
+static bool g_tee;
+/* two bytes of the previous block in front to find split boundaries */
+static uint8_t g_buffer[2 + BLOCK_SIZE];
+
 static void
-start_new_fileset (void)
+gz_queue (int type, const uint8_t * data, size_t len)
 {
-	if (g_fgzlog)
+	TChunk *chunk;
+
+	if (type == CHUNK_DATA)
 	{
-		gzclose (g_fgzlog);
-		if (rename (g_file_gztarget_tmp, g_file_gztarget))
-			fprintf (stderr, LOG "failed to rename file '%s'->'%s'\n",
-					 g_file_gztarget_tmp, g_file_gztarget);
+		if (g_gz_dropped)
+			return;
+		/* reading g_gz_backlog unlocked is fine for a threshold */
+		if ((g_gz_backlog + len) > GZ_BACKLOG)
+		{
+			if (!g_gz_lagging)
+				fprintf (stderr, LOG "compression falls behind, skipping "
+						 "objects\n");
+			g_gz_dropped = g_gz_lagging = true;
+			return;
+		}
 	}
-	if ((g_fgzlog = gzopen (g_file_gztarget_tmp, "w9")) == NULL)
-		fprintf (stderr, LOG "failed to open temporary gzip file '%s'\n",
-				 g_file_gztarget_tmp);
+
+	if ((chunk = (TChunk *) malloc (sizeof (TChunk) + len)) == NULL)
+	{
+		g_gz_dropped = true;
+		return;
+	}
+	chunk->next = NULL;
+	chunk->type = type;
+	chunk->keep = !g_gz_dropped;
+	chunk->len = len;
+	chunk->data = (uint8_t *) (chunk + 1);
+	if (len)
+		memcpy (chunk->data, data, len);
+
+	pthread_mutex_lock (&g_gz_mutex);
+	if (g_gz_tail)
+		g_gz_tail->next = chunk;
+	else
+		g_gz_head = chunk;
+	g_gz_tail = chunk;
+	g_gz_backlog += len;
+	pthread_cond_signal (&g_gz_cond);
+	pthread_mutex_unlock (&g_gz_mutex);
+
+	if (type == CHUNK_ROTATE)
+	{
+		if (!g_gz_dropped)
+			g_gz_lagging = false;
+		g_gz_dropped = false;
+	}
+}
+
+static void *
+thread_compress (void *context)
+{
+	TChunk *chunk;
+	gzFile gz;
+	bool failed;
+
+	gz = NULL;
+	failed = false;
+	while (true)
+	{
+		pthread_mutex_lock (&g_gz_mutex);
+		while ((chunk = g_gz_head) == NULL)
+			pthread_cond_wait (&g_gz_cond, &g_gz_mutex);
+		if ((g_gz_head = chunk->next) == NULL)
+			g_gz_tail = NULL;
+		g_gz_backlog -= chunk->len;
+		pthread_mutex_unlock (&g_gz_mutex);
+
+		switch (chunk->type)
+		{
+			case CHUNK_DATA:
+				if (!gz && !failed &&
+					((gz = gzopen (g_file_gztarget_tmp, g_gz_mode)) == NULL))
+				{
+					fprintf (stderr,
+							 LOG "failed to open temporary gzip file '%s'\n",
+							 g_file_gztarget_tmp);
+					failed = true;
+				}
+				if (gz)
+					gzwrite (gz, chunk->data, chunk->len);
+				break;
+
+			case CHUNK_ROTATE:
+				if (gz)
+				{
+					gzclose (gz);
+					gz = NULL;
+					if (chunk->keep &&
+						rename (g_file_gztarget_tmp, g_file_gztarget))
+						fprintf (stderr,
+								 LOG "failed to rename file '%s'->'%s'\n",
+								 g_file_gztarget_tmp, g_file_gztarget);
+				}
+				failed = false;
+				break;
+
+			case CHUNK_END:
+				if (gz)
+					gzclose (gz);
+				free (chunk);
+				return NULL;
+		}
+		free (chunk);
+	}
+}
+
+static void
+start_new_fileset (void)
+{
+	gz_queue (CHUNK_ROTATE, NULL, 0);
 
 	if (g_ftextlog)
 	{
@@ -73,24 +212,132 @@ start_new_fileset (void)
 				 g_file_target_tmp);
 }
 
+static void
+output_object (const uint8_t * data, size_t len)
+{
+	if (!len)
+		return;
+	gz_queue (CHUNK_DATA, data, len);
+	if (g_ftextlog)
+		fwrite (data, 1, len, g_ftextlog);
+}
+
+static bool
+write_all (int fd, const uint8_t * data, size_t len)
+{
+	ssize_t res;
+
+	while (len)
+	{
+		if ((res = write (fd, data, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += res;
+		len -= res;
+	}
+	return true;
+}
+
+/* read next block and echo it to maintain the pipe chain */
+static ssize_t
+input_block (uint8_t * buf, size_t size)
+{
+	ssize_t res, len, n;
+
+	/* copy pipe to pipe in the kernel, then consume the same bytes */
+	while (g_tee)
+	{
+		if ((len = tee (STDIN_FILENO, STDOUT_FILENO, size, 0)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			/* not a pair of pipes */
+			if (errno != EINVAL)
+				return -1;
+			g_tee = false;
+			break;
+		}
+
+		for (res = 0; res < len;)
+		{
+			if ((n = read (STDIN_FILENO, buf + res, len - res)) <= 0)
+			{
+				if ((n < 0) && (errno == EINTR))
+					continue;
+				return -1;
+			}
+			res += n;
+		}
+		return len;
+	}
+
+	while ((len = read (STDIN_FILENO, buf, size)) < 0)
+		if (errno != EINTR)
+			return -1;
+	if ((len > 0) && !write_all (STDOUT_FILENO, buf, len))
+		return -1;
+	return len;
+}
+
+static void
+filter (void)
+{
+	ssize_t len;
+	uint8_t *p, *search, *end, *match;
+
+	start_new_fileset ();
+	while ((len = input_block (g_buffer + 2, BLOCK_SIZE)) > 0)
+	{
+		p = g_buffer + 2;
+		end = p + len;
+
+		/* objects end with "\n}," - separator is not stored */
+		for (search = g_buffer;
+			 (match = (uint8_t *) memmem (search, end - search, "\n},", 3))
+			 != NULL; search = p)
+		{
+			output_object (p, (match + 2) - p);
+			start_new_fileset ();
+			p = match + 3;
+		}
+		output_object (p, end - p);
+
+		/* remember last two characters */
+		g_buffer[0] = end[-2];
+		g_buffer[1] = end[-1];
+	}
+
+	if (len < 0)
+		fprintf (stderr, LOG "pipe failed (%s)\n", strerror (errno));
+}
+
 int
 main (int argc, char *argv[])
 {
-	int data, len, size, res;
-	uint8_t c[3];
+	int len, size, res, opt, level;
 
 	g_ftextlog = NULL;
-	g_fgzlog = NULL;
 
-	if (argc != 2)
+	res = 0;
+	level = GZ_LEVEL;
+	while ((opt = getopt (argc, argv, "z:")) != -1)
+		if ((opt != 'z') || ((level = atoi (optarg)) < 0) || (level > 9))
+			res = -1;
+
+	if (res || (optind != (argc - 1)))
 	{
-		fprintf (stderr, LOG " usage: %s some_path/somefile_prefix\n",
-				 argv[0]);
+		fprintf (stderr, LOG " usage: %s [-z level] some_path/somefile_prefix\n"
+				 "  -z level     gzip compression level 0-9 (default %i)\n",
+				 argv[0], GZ_LEVEL);
 		return -1;
 	}
+	snprintf (g_gz_mode, sizeof (g_gz_mode), "w%i", level);
 
 	/* use first parameter as target prefix */
-	g_file_target = argv[1];
+	g_file_target = argv[optind];
 
 	/* add one byte for zero termination */
 	len = strlen (g_file_target) + 1;
@@ -117,38 +364,21 @@ main (int argc, char *argv[])
 		fprintf (stderr, LOG " out of memory error\n");
 		res = -2;
 	}
+	else if (pthread_create (&g_gz_thread, NULL, &thread_compress, NULL))
+	{
+		fprintf (stderr, LOG " failed to start compression thread\n");
+		res = -3;
+	}
 	else
 	{
-		c[1] = c[2] = 0;
-		start_new_fileset ();
-		while ((data = getchar ()) != EOF)
-		{
-			/* convert to 8 bits */
-			c[0] = (uint8_t) data;
-
-			/* echo everything to maintain pipe chain */
-			putchar (c[0]);
+		g_tee = true;
+		filter ();
 
-			/* find start of new object */
-			if (c[2] == '\n' && c[1] == '}' && c[0] == ',')
-				start_new_fileset ();
-			else
-			{
-				/* echo to zip file */
-				if (g_fgzlog)
-					gzwrite (g_fgzlog, c, 1);
-				/* echo to text file */
-				if (g_ftextlog)
-					fwrite (c, 1, 1, g_ftextlog);
-			}
-
-			/* remember last two characters */
-			c[2] = c[1];
-			c[1] = c[0];
-		}
-		/* close files */
-		gzclose (g_fgzlog);
-		fclose (g_ftextlog);
+		/* flush pending compression and close files */
+		gz_queue (CHUNK_END, NULL, 0);
+		pthread_join (g_gz_thread, NULL);
+		if (g_ftextlog)
+			fclose (g_ftextlog);
 		/* return OK */
 		res = 0;
 	}
@@ -0,0 +1,261 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "crypto.h"
+#include "fusion.h"
+
+#define FUSION_SHARDS (1<<FUSION_SHARD_BITS)
+
+#define FUSION_PENDING_STATE 1
+#define FUSION_DONE_STATE 2
+
+typedef struct
+{
+	/* zero marks free slots */
+	uint64_t key;
+	double timestamp;
+	uint32_t uid, epoch;
+	uint8_t state, queued;
+	/* slots of the queued copies in the shard pool */
+	uint8_t copy[FUSION_PENDING];
+} TFusionEntry;
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	TFusionEntry entry[FUSION_SHARD_SLOTS];
+	/* copies are only queued for microseconds - a small pool per
+	 * shard instead of room in every entry */
+	uint64_t copy_used;
+	TFusionCopy copy[FUSION_SHARD_COPIES];
+} TFusionShard;
+
+static TFusionShard g_fusion[FUSION_SHARDS];
+static pthread_once_t g_fusion_once = PTHREAD_ONCE_INIT;
+
+static void
+fusion_init (void)
+{
+	int i;
+
+	for (i = 0; i < FUSION_SHARDS; i++)
+		pthread_mutex_init (&g_fusion[i].mutex, NULL);
+}
+
+uint64_t
+fusion_key (const void *data, int len)
+{
+	uint64_t h, v;
+	const uint8_t *p;
+
+	/* 64 bit words of the ciphertext, multiply-xorshift mixed */
+	h = 0x9E3779B97F4A7C15ULL ^ len;
+	for (p = (const uint8_t *) data; len >= (int) sizeof (v);
+		 p += sizeof (v), len -= sizeof (v))
+	{
+		memcpy (&v, p, sizeof (v));
+		h = (h ^ v) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	while (len--)
+		h = (h ^ *p++) * 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 29;
+
+	/* zero marks free slots */
+	return h ? h : 1;
+}
+
+static TFusionShard *
+fusion_shard (uint64_t key)
+{
+	TFusionShard *shard;
+
+	pthread_once (&g_fusion_once, fusion_init);
+	shard = &g_fusion[key >> (64 - FUSION_SHARD_BITS)];
+	pthread_mutex_lock (&shard->mutex);
+	return shard;
+}
+
+static TFusionEntry *
+fusion_find (TFusionShard * shard, uint64_t key)
+{
+	int i;
+	TFusionEntry *entry;
+
+	for (i = 0; i < FUSION_PROBE; i++)
+	{
+		entry = &shard->entry[(key + i) & (FUSION_SHARD_SLOTS - 1)];
+		if (entry->key == key)
+			return entry;
+	}
+	return NULL;
+}
+
+/* hand queued copies back and release their pool slots */
+static int
+fusion_dequeue (TFusionShard * shard, TFusionEntry * entry,
+				TFusionCopy * queued)
+{
+	int i, count;
+
+	count = entry->queued;
+	for (i = 0; i < count; i++)
+	{
+		if (queued)
+			queued[i] = shard->copy[entry->copy[i]];
+		shard->copy_used &= ~(1ULL << entry->copy[i]);
+	}
+	entry->queued = 0;
+	return count;
+}
+
+static inline bool
+fusion_expired (const TFusionEntry * entry, double timestamp)
+{
+	/* replayed captures might run backwards in time */
+	return !entry->key ||
+		(fabs (timestamp - entry->timestamp) > FUSION_WINDOW);
+}
+
+int
+fusion_check (uint64_t key, double timestamp, double received,
+			  uint32_t reader_id, const TBeaconLogSighting * pkt,
+			  uint32_t * uid, uint32_t * epoch)
+{
+	int i, res, n;
+	TFusionCopy *copy;
+	bool free;
+	TFusionShard *shard;
+	TFusionEntry *entry, *slot;
+
+	shard = fusion_shard (key);
+
+	/* known transmission, else first free, expired or oldest slot */
+	slot = NULL;
+	free = false;
+	for (i = 0; i < FUSION_PROBE; i++)
+	{
+		entry = &shard->entry[(key + i) & (FUSION_SHARD_SLOTS - 1)];
+		if (fusion_expired (entry, timestamp))
+		{
+			if (entry->key == key)
+			{
+				slot = entry;
+				break;
+			}
+			if (!free)
+			{
+				slot = entry;
+				free = true;
+			}
+		}
+		else if (entry->key == key)
+		{
+			if (entry->state == FUSION_DONE_STATE)
+			{
+				*uid = entry->uid;
+				*epoch = entry->epoch;
+				res = FUSION_DUPLICATE;
+			}
+			else if ((entry->queued < FUSION_PENDING) &&
+					 (~shard->copy_used))
+			{
+				n = __builtin_ctzll (~shard->copy_used);
+				shard->copy_used |= 1ULL << n;
+				copy = &shard->copy[n];
+				copy->received = received;
+				copy->reader_id = reader_id;
+				memcpy (&copy->sighting, pkt, sizeof (copy->sighting));
+				entry->copy[entry->queued++] = n;
+				res = FUSION_QUEUED;
+			}
+			else
+				/* no room - decrypt this copy on its own */
+				res = FUSION_FIRST;
+			pthread_mutex_unlock (&shard->mutex);
+			return res;
+		}
+		else if (!free && (!slot || (entry->timestamp < slot->timestamp)))
+			slot = entry;
+	}
+
+	/* claim slot for the first copy, copies of a recycled
+	 * transmission are lost */
+	fusion_dequeue (shard, slot, NULL);
+	slot->key = key;
+	slot->timestamp = timestamp;
+	slot->state = FUSION_PENDING_STATE;
+	slot->queued = 0;
+	pthread_mutex_unlock (&shard->mutex);
+	return FUSION_FIRST;
+}
+
+int
+fusion_done (uint64_t key, uint32_t uid, uint32_t epoch,
+			 TFusionCopy * queued)
+{
+	int count;
+	TFusionShard *shard;
+	TFusionEntry *entry;
+
+	count = 0;
+	shard = fusion_shard (key);
+	if ((entry = fusion_find (shard, key)) != NULL)
+	{
+		entry->uid = uid;
+		entry->epoch = epoch;
+		entry->state = FUSION_DONE_STATE;
+		count = fusion_dequeue (shard, entry, queued);
+	}
+	pthread_mutex_unlock (&shard->mutex);
+	return count;
+}
+
+int
+fusion_failed (uint64_t key, TFusionCopy * queued)
+{
+	int count;
+	TFusionShard *shard;
+	TFusionEntry *entry;
+
+	/* let the next copy try again */
+	count = 0;
+	shard = fusion_shard (key);
+	if ((entry = fusion_find (shard, key)) != NULL)
+	{
+		count = fusion_dequeue (shard, entry, queued);
+		entry->key = 0;
+	}
+	pthread_mutex_unlock (&shard->mutex);
+	return count;
+}
@@ -0,0 +1,74 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __FUSION_H__
+#define __FUSION_H__
+
+/* requires crypto.h for the protocol structures */
+
+/* seconds a transmission is remembered - copies relayed by further
+ * readers arrive well within this window */
+#define FUSION_WINDOW 0.25
+/* 2^FUSION_SHARD_BITS independently locked shards */
+#define FUSION_SHARD_BITS 6
+#define FUSION_SHARD_SLOTS 4096
+/* slots probed per lookup before the oldest one is recycled */
+#define FUSION_PROBE 8
+/* copies queued while the first one is still being decrypted,
+ * per transmission and per shard */
+#define FUSION_PENDING 4
+#define FUSION_SHARD_COPIES 64
+/* readers remembered per transmission of a tag */
+#define FUSION_READERS 8
+
+/* first copy - decrypt and process it, then call fusion_done
+ * or fusion_failed, also returned if no copy can be queued */
+#define FUSION_FIRST 0
+/* first copy still in flight, copy was queued until fusion_done
+ * or fusion_failed hand it back */
+#define FUSION_QUEUED 1
+/* transmission already processed, uid and epoch are returned */
+#define FUSION_DUPLICATE 2
+
+/* further copy of a transmission as received */
+typedef struct
+{
+	double received;
+	uint32_t reader_id;
+	TBeaconLogSighting sighting;
+} TFusionCopy;
+
+/* fingerprint of the encrypted record - identical for all copies */
+extern uint64_t fusion_key (const void *data, int len);
+extern int fusion_check (uint64_t key, double timestamp, double received,
+						 uint32_t reader_id, const TBeaconLogSighting * pkt,
+						 uint32_t * uid, uint32_t * epoch);
+/* both return the copies queued in the meantime, up to FUSION_PENDING */
+extern int fusion_done (uint64_t key, uint32_t uid, uint32_t epoch,
+						TFusionCopy * queued);
+extern int fusion_failed (uint64_t key, TFusionCopy * queued);
+
+#endif/*__FUSION_H__*/
@@ -0,0 +1,850 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+
+#include "helper.h"
+#include "json.h"
+#include "snapshot.h"
+#include "contact.h"
+#include "stream.h"
+#include "bmMapHandleToItem.h"
+#include "metrics.h"
+#include "http.h"
+
+/* snapshot in identity and gzip encoding, owned by the server thread */
+typedef struct
+{
+	int refs;
+	const char *type;
+	uint32_t sequence;
+	/* empty for responses without snapshot */
+	char etag[16];
+	char *data;
+	size_t len;
+	uint8_t *gzip;
+	size_t gzip_len;
+} THttpEntry;
+
+typedef struct
+{
+	bool head, keep_alive, gzip, wait;
+	uint32_t wait_sequence;
+	char if_none_match[64];
+} THttpRequest;
+
+typedef struct THttpConnection
+{
+	int fd, slot;
+	uint32_t events;
+	bool dead;
+	struct THttpConnection *next_dead;
+	/* request bytes received so far */
+	int received;
+	char buffer[HTTP_REQUEST_SIZE];
+	THttpRequest request;
+	/* response in flight */
+	bool sending, close;
+	char header[HTTP_HEADER_SIZE];
+	size_t header_len, sent;
+	THttpEntry *entry;
+	const void *body;
+	size_t body_len;
+	/* parked long-poll */
+	bool waiting;
+	double deadline;
+	/* server-sent events, refilled once sent completely */
+	TStreamSubscriber *stream;
+	TJsonBuffer out;
+	size_t out_sent;
+	/* last traffic, idle connections are closed */
+	double active;
+} THttpConnection;
+
+static bool g_http_running;
+static int g_http_epoll, g_http_listen, g_http_event;
+static pthread_t g_http_thread;
+/* handed over by the estimation thread */
+static THttpEntry *g_http_pending;
+/* server thread only */
+static THttpEntry *g_http_current;
+static THttpConnection *g_http_conn[HTTP_MAX_CONNECTIONS];
+static THttpConnection *g_http_dead;
+static z_stream g_http_zstream;
+
+static void http_process (THttpConnection * conn);
+
+static void
+http_entry_free (THttpEntry * entry)
+{
+	free (entry->data);
+	free (entry->gzip);
+	free (entry);
+}
+
+static void
+http_release (THttpEntry * entry)
+{
+	if (entry && !--entry->refs)
+		http_entry_free (entry);
+}
+
+static void
+http_interest (THttpConnection * conn, uint32_t events)
+{
+	struct epoll_event ev;
+
+	if (conn->events == events)
+		return;
+	conn->events = events;
+
+	ev.events = events;
+	ev.data.ptr = conn;
+	epoll_ctl (g_http_epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* freed after the current batch of events */
+static void
+http_close (THttpConnection * conn)
+{
+	if (conn->dead)
+		return;
+
+	epoll_ctl (g_http_epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+	close (conn->fd);
+	http_release (conn->entry);
+	conn->entry = NULL;
+	stream_unsubscribe (conn->stream);
+	conn->stream = NULL;
+	json_free (&conn->out);
+	g_http_conn[conn->slot] = NULL;
+
+	conn->dead = true;
+	conn->next_dead = g_http_dead;
+	g_http_dead = conn;
+}
+
+static void
+http_send (THttpConnection * conn)
+{
+	ssize_t res;
+	size_t total;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	total = conn->header_len + conn->body_len;
+	while (conn->sent < total)
+	{
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = iov;
+		if (conn->sent < conn->header_len)
+		{
+			iov[0].iov_base = conn->header + conn->sent;
+			iov[0].iov_len = conn->header_len - conn->sent;
+			iov[1].iov_base = (void *) conn->body;
+			iov[1].iov_len = conn->body_len;
+			msg.msg_iovlen = conn->body_len ? 2 : 1;
+		}
+		else
+		{
+			iov[0].iov_base =
+				(uint8_t *) conn->body + (conn->sent - conn->header_len);
+			iov[0].iov_len = total - conn->sent;
+			msg.msg_iovlen = 1;
+		}
+
+		if ((res = sendmsg (conn->fd, &msg, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				http_interest (conn, EPOLLOUT | EPOLLRDHUP);
+			else
+				http_close (conn);
+			return;
+		}
+		conn->sent += res;
+		conn->active = microtime ();
+	}
+
+	/* response complete */
+	conn->sending = false;
+	http_release (conn->entry);
+	conn->entry = NULL;
+	conn->body = NULL;
+	conn->body_len = 0;
+
+	if (conn->close)
+		http_close (conn);
+	else
+		http_interest (conn, EPOLLIN | EPOLLRDHUP);
+}
+
+static void
+http_response (THttpConnection * conn, const char *status,
+			   THttpEntry * entry, bool body)
+{
+	int len;
+	bool gzip;
+	const THttpRequest *req = &conn->request;
+
+	gzip = body && req->gzip && entry->gzip;
+	conn->close = !req->keep_alive;
+
+	len = snprintf (conn->header, sizeof (conn->header),
+		"HTTP/1.1 %s\r\n"
+		"Server: " PROGRAM_NAME "/" PROGRAM_VERSION "\r\n"
+		"Cache-Control: no-cache\r\n", status);
+	if (entry && entry->etag[0])
+		len += snprintf (conn->header + len, sizeof (conn->header) - len,
+			"ETag: %s\r\nX-Sequence: %u\r\n", entry->etag, entry->sequence);
+	if (body)
+		len += snprintf (conn->header + len, sizeof (conn->header) - len,
+			"Content-Type: %s\r\n"
+			"Vary: Accept-Encoding\r\n%s", entry->type,
+			gzip ? "Content-Encoding: gzip\r\n" : "");
+	len += snprintf (conn->header + len, sizeof (conn->header) - len,
+		"Content-Length: %lu\r\nConnection: %s\r\n\r\n",
+		(unsigned long) (body ? (gzip ? entry->gzip_len : entry->len) : 0),
+		conn->close ? "close" : "keep-alive");
+	conn->header_len = len;
+
+	/* keep snapshot alive until sent */
+	if (body && !req->head)
+	{
+		entry->refs++;
+		conn->entry = entry;
+		conn->body = gzip ? (const void *) entry->gzip : entry->data;
+		conn->body_len = gzip ? entry->gzip_len : entry->len;
+	}
+
+	conn->sent = 0;
+	conn->sending = true;
+	http_send (conn);
+}
+
+static void
+http_error (THttpConnection * conn, const char *status)
+{
+	conn->request.keep_alive = false;
+	http_response (conn, status, NULL, false);
+}
+
+static void
+http_snapshot (THttpConnection * conn)
+{
+	THttpEntry *entry = g_http_current;
+	const THttpRequest *req = &conn->request;
+
+	/* long-poll until a newer snapshot arrives */
+	if (req->wait && (!entry || (entry->sequence <= req->wait_sequence)))
+	{
+		conn->waiting = true;
+		conn->deadline = microtime () + HTTP_WAIT_TIMEOUT;
+		http_interest (conn, EPOLLRDHUP);
+		return;
+	}
+
+	if (!entry)
+		http_response (conn, "503 Service Unavailable", NULL, false);
+	else if (req->if_none_match[0] &&
+			 (!strcmp (req->if_none_match, "*") ||
+			  strstr (req->if_none_match, entry->etag)))
+		http_response (conn, "304 Not Modified", entry, false);
+	else
+		http_response (conn, "200 OK", entry, true);
+}
+
+/* coalesced events are only taken from the queue once the socket
+ * accepted everything before - slow clients never block the estimator */
+static void
+http_stream (THttpConnection * conn)
+{
+	ssize_t res;
+
+	while (true)
+	{
+		if (conn->out_sent == conn->out.len)
+		{
+			conn->out_sent = 0;
+			json_reset (&conn->out);
+			if (!stream_drain (conn->stream, &conn->out))
+			{
+				http_interest (conn, EPOLLRDHUP);
+				return;
+			}
+		}
+
+		if ((res = send (conn->fd, conn->out.data + conn->out_sent,
+						 conn->out.len - conn->out_sent, MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				http_interest (conn, EPOLLOUT | EPOLLRDHUP);
+			else
+				http_close (conn);
+			return;
+		}
+		conn->out_sent += res;
+		conn->active = microtime ();
+	}
+}
+
+static void http_compress (THttpEntry * entry);
+
+/* formatted per request, counters are read without locks */
+static void
+http_metrics (THttpConnection * conn)
+{
+	THttpEntry *entry;
+	TJsonBuffer buf;
+
+	if ((entry = (THttpEntry *) calloc (1, sizeof (THttpEntry))) == NULL)
+	{
+		http_error (conn, "503 Service Unavailable");
+		return;
+	}
+	memset (&buf, 0, sizeof (buf));
+	metrics_format (&buf);
+	entry->refs = 1;
+	entry->type = "text/plain; version=0.0.4";
+	entry->data = buf.data;
+	entry->len = buf.len;
+	if (conn->request.gzip)
+		http_compress (entry);
+
+	http_response (conn, "200 OK", entry, true);
+	http_release (entry);
+}
+
+static void
+http_subscribe (THttpConnection * conn, const char *query)
+{
+	if (conn->request.head)
+	{
+		http_error (conn, "405 Method Not Allowed");
+		return;
+	}
+	if ((conn->stream = stream_subscribe (query ? query : "")) == NULL)
+	{
+		http_error (conn, "400 Bad Request");
+		return;
+	}
+
+	/* unbounded response - connection ends with the stream */
+	json_str (&conn->out, "HTTP/1.1 200 OK\r\n"
+			  "Server: " PROGRAM_NAME "/" PROGRAM_VERSION "\r\n"
+			  "Cache-Control: no-cache\r\n"
+			  "Content-Type: text/event-stream\r\n"
+			  "Connection: close\r\n\r\n");
+	conn->out_sent = 0;
+	http_stream (conn);
+}
+
+static void
+http_request (THttpConnection * conn, char *header)
+{
+	int major, minor;
+	char method[8], target[1024], *p, *next, *value, *query;
+	THttpRequest *req = &conn->request;
+
+	memset (req, 0, sizeof (*req));
+	if (sscanf (header, "%7s %1023s HTTP/%d.%d", method, target, &major,
+				&minor) != 4)
+	{
+		http_error (conn, "400 Bad Request");
+		return;
+	}
+	req->keep_alive = (major == 1) && (minor >= 1);
+
+	/* header fields of interest */
+	for (p = strstr (header, "\r\n"); p; p = next)
+	{
+		p += 2;
+		if ((next = strstr (p, "\r\n")) != NULL)
+			*next = 0;
+		if ((value = strchr (p, ':')) == NULL)
+			continue;
+		*value++ = 0;
+		value += strspn (value, " \t");
+
+		if (!strcasecmp (p, "Connection"))
+		{
+			if (strcasestr (value, "close"))
+				req->keep_alive = false;
+			else if (strcasestr (value, "keep-alive"))
+				req->keep_alive = true;
+		}
+		else if (!strcasecmp (p, "Accept-Encoding"))
+			req->gzip = strstr (value, "gzip") != NULL;
+		else if (!strcasecmp (p, "If-None-Match"))
+		{
+			strncpy (req->if_none_match, value,
+					 sizeof (req->if_none_match) - 1);
+			req->if_none_match[sizeof (req->if_none_match) - 1] = 0;
+		}
+	}
+
+	req->head = !strcmp (method, "HEAD");
+	if (!req->head && strcmp (method, "GET"))
+	{
+		http_error (conn, "405 Method Not Allowed");
+		return;
+	}
+
+	if ((query = strchr (target, '?')) != NULL)
+		*query++ = 0;
+	if (!strcmp (target, "/events"))
+	{
+		http_subscribe (conn, query);
+		return;
+	}
+	if (!strcmp (target, "/metrics"))
+	{
+		http_metrics (conn);
+		return;
+	}
+	if (strcmp (target, "/") && strcmp (target, "/snapshot.json"))
+	{
+		http_response (conn, "404 Not Found", NULL, false);
+		return;
+	}
+
+	/* "?wait=N" - respond once sequence exceeds N */
+	for (p = query; p; p = (p = strchr (p, '&')) ? p + 1 : NULL)
+		if (!strncmp (p, "wait=", 5))
+		{
+			req->wait = true;
+			req->wait_sequence = strtoul (p + 5, NULL, 10);
+		}
+
+	http_snapshot (conn);
+}
+
+static void
+http_process (THttpConnection * conn)
+{
+	int len;
+	char *end;
+
+	/* handle pipelined requests one at a time */
+	while (!conn->dead && !conn->sending && !conn->waiting && !conn->stream)
+	{
+		if ((end = strstr (conn->buffer, "\r\n\r\n")) == NULL)
+		{
+			if (conn->received >= (HTTP_REQUEST_SIZE - 1))
+				http_error (conn, "431 Request Header Fields Too Large");
+			return;
+		}
+
+		*end = 0;
+		len = (end + 4) - conn->buffer;
+		http_request (conn, conn->buffer);
+
+		conn->received -= len;
+		memmove (conn->buffer, conn->buffer + len, conn->received);
+		conn->buffer[conn->received] = 0;
+	}
+}
+
+static void
+http_read (THttpConnection * conn)
+{
+	ssize_t res;
+
+	res = recv (conn->fd, conn->buffer + conn->received,
+				HTTP_REQUEST_SIZE - 1 - conn->received, 0);
+	if (res <= 0)
+	{
+		if ((res < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+			return;
+		http_close (conn);
+		return;
+	}
+
+	conn->received += res;
+	conn->buffer[conn->received] = 0;
+	conn->active = microtime ();
+	http_process (conn);
+}
+
+static void
+http_accept (void)
+{
+	int fd, slot, opt;
+	struct epoll_event ev;
+	THttpConnection *conn;
+
+	while ((fd = accept4 (g_http_listen, NULL, NULL,
+						  SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		for (slot = 0; (slot < HTTP_MAX_CONNECTIONS) && g_http_conn[slot];
+			 slot++);
+		if ((slot == HTTP_MAX_CONNECTIONS) ||
+			((conn = (THttpConnection *)
+			  calloc (1, sizeof (THttpConnection))) == NULL))
+		{
+			close (fd);
+			continue;
+		}
+
+		/* responses are written in one go - fails on UNIX sockets */
+		opt = 1;
+		setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof (opt));
+
+		conn->fd = fd;
+		conn->slot = slot;
+		conn->active = microtime ();
+		conn->events = ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = conn;
+		if (epoll_ctl (g_http_epoll, EPOLL_CTL_ADD, fd, &ev))
+		{
+			close (fd);
+			free (conn);
+			continue;
+		}
+		g_http_conn[slot] = conn;
+	}
+}
+
+static void
+http_compress (THttpEntry * entry)
+{
+	uLong bound;
+	z_stream *z = &g_http_zstream;
+
+	deflateReset (z);
+	bound = deflateBound (z, entry->len);
+	if ((entry->gzip = (uint8_t *) malloc (bound)) == NULL)
+		return;
+
+	z->next_in = (Bytef *) entry->data;
+	z->avail_in = entry->len;
+	z->next_out = entry->gzip;
+	z->avail_out = bound;
+	if (deflate (z, Z_FINISH) != Z_STREAM_END)
+	{
+		free (entry->gzip);
+		entry->gzip = NULL;
+		return;
+	}
+	entry->gzip_len = z->total_out;
+}
+
+/* compress new snapshot once and wake long-polls */
+static void
+http_update (void)
+{
+	int i;
+	uint64_t value;
+	THttpEntry *entry;
+	THttpConnection *conn;
+
+	if (read (g_http_event, &value, sizeof (value)) < 0)
+		return;
+	if ((entry = __atomic_exchange_n (&g_http_pending, (THttpEntry *) NULL,
+									  __ATOMIC_ACQ_REL)) != NULL)
+	{
+		http_compress (entry);
+		http_release (g_http_current);
+		g_http_current = entry;
+	}
+
+	for (i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+	{
+		if ((conn = g_http_conn[i]) == NULL)
+			continue;
+
+		if (entry && conn->waiting &&
+			(entry->sequence > conn->request.wait_sequence))
+		{
+			conn->waiting = false;
+			http_snapshot (conn);
+			http_process (conn);
+		}
+		/* streams still sending keep coalescing */
+		else if (conn->stream && (conn->out_sent == conn->out.len))
+			http_stream (conn);
+	}
+}
+
+/* answer long-polls without newer snapshot, keep idle streams alive
+ * and close other idle connections - keep-alive clients would
+ * otherwise hold all slots */
+static void
+http_expire (double timestamp)
+{
+	int i;
+	THttpConnection *conn;
+
+	for (i = 0; i < HTTP_MAX_CONNECTIONS; i++)
+	{
+		if ((conn = g_http_conn[i]) == NULL)
+			continue;
+
+		if (conn->stream && (conn->out_sent == conn->out.len) &&
+			((timestamp - conn->active) >= STREAM_KEEPALIVE))
+		{
+			json_reset (&conn->out);
+			json_str (&conn->out, ":\n\n");
+			conn->out_sent = 0;
+			http_stream (conn);
+		}
+		else if (conn->waiting && (timestamp >= conn->deadline))
+		{
+			conn->waiting = false;
+			if (g_http_current)
+				http_response (conn, "304 Not Modified", g_http_current,
+							   false);
+			else
+				http_response (conn, "503 Service Unavailable", NULL, false);
+			http_process (conn);
+		}
+		else if (!conn->stream && !conn->waiting &&
+				 ((timestamp - conn->active) >= HTTP_IDLE_TIMEOUT))
+			http_close (conn);
+	}
+}
+
+static void *
+thread_http (void *context)
+{
+	int i, n;
+	double timestamp, expired;
+	THttpConnection *conn;
+	struct epoll_event ev[HTTP_EVENTS];
+
+	expired = 0;
+	while (true)
+	{
+		if ((n = epoll_wait (g_http_epoll, ev, HTTP_EVENTS, 1000)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			diep ("epoll_wait");
+		}
+
+		for (i = 0; i < n; i++)
+			if (ev[i].data.ptr == &g_http_listen)
+				http_accept ();
+			else if (ev[i].data.ptr == &g_http_event)
+				http_update ();
+			else
+			{
+				conn = (THttpConnection *) ev[i].data.ptr;
+				if (conn->dead)
+					continue;
+
+				if ((ev[i].events & EPOLLERR) || (conn->stream &&
+					(ev[i].events & (EPOLLHUP | EPOLLRDHUP))))
+					http_close (conn);
+				else if (conn->stream && (ev[i].events & EPOLLOUT))
+					http_stream (conn);
+				else if (conn->sending && (ev[i].events & EPOLLOUT))
+				{
+					http_send (conn);
+					http_process (conn);
+				}
+				else if (ev[i].events & EPOLLIN)
+					http_read (conn);
+				else if (ev[i].events & (EPOLLHUP | EPOLLRDHUP))
+					http_close (conn);
+			}
+
+		timestamp = microtime ();
+		if ((timestamp - expired) >= 1)
+		{
+			expired = timestamp;
+			http_expire (timestamp);
+		}
+
+		/* nothing refers to closed connections any more */
+		while ((conn = g_http_dead) != NULL)
+		{
+			g_http_dead = conn->next_dead;
+			free (conn);
+		}
+	}
+	return NULL;
+}
+
+static int
+http_socket (const char *listen)
+{
+	int sock, opt, port;
+	char host[INET_ADDRSTRLEN + 8], *p, *end;
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+
+	/* local socket */
+	if (!strncmp (listen, "unix:", 5))
+	{
+		memset (&un, 0, sizeof (un));
+		un.sun_family = AF_UNIX;
+		if (!listen[5] || (strlen (listen + 5) >= sizeof (un.sun_path)))
+			return -1;
+		strcpy (un.sun_path, listen + 5);
+		unlink (un.sun_path);
+
+		if ((sock = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+							SOCK_CLOEXEC, 0)) < 0)
+			return -1;
+		if (bind (sock, (sockaddr *) & un, sizeof (un)))
+		{
+			close (sock);
+			return -1;
+		}
+		return sock;
+	}
+
+	/* "port" or "address:port" */
+	memset (&in, 0, sizeof (in));
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl (INADDR_ANY);
+	if ((p = (char *) strrchr (listen, ':')) != NULL)
+	{
+		if ((size_t) (p - listen) >= sizeof (host))
+			return -1;
+		memcpy (host, listen, p - listen);
+		host[p - listen] = 0;
+		if (inet_pton (AF_INET, host, &in.sin_addr) != 1)
+			return -1;
+		listen = p + 1;
+	}
+	port = strtol (listen, &end, 10);
+	if (!*listen || *end || (port < 1) || (port > 0xFFFF))
+		return -1;
+	in.sin_port = htons (port);
+
+	if ((sock = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+						0)) < 0)
+		return -1;
+	opt = 1;
+	setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
+	if (bind (sock, (sockaddr *) & in, sizeof (in)))
+	{
+		close (sock);
+		return -1;
+	}
+	return sock;
+}
+
+bool
+http_start (const char *listen)
+{
+	struct epoll_event ev;
+
+	if (((g_http_listen = http_socket (listen)) < 0) ||
+		::listen (g_http_listen, SOMAXCONN))
+	{
+		fprintf (stderr, "http: failed to listen on '%s'\n", listen);
+		return false;
+	}
+
+	if (((g_http_epoll = epoll_create1 (EPOLL_CLOEXEC)) < 0) ||
+		((g_http_event = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0))
+		diep ("http: epoll");
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &g_http_listen;
+	if (epoll_ctl (g_http_epoll, EPOLL_CTL_ADD, g_http_listen, &ev))
+		diep ("http: epoll_ctl");
+	ev.data.ptr = &g_http_event;
+	if (epoll_ctl (g_http_epoll, EPOLL_CTL_ADD, g_http_event, &ev))
+		diep ("http: epoll_ctl");
+
+	/* gzip wrapper, stream reset per snapshot */
+	if (deflateInit2 (&g_http_zstream, HTTP_GZIP_LEVEL, Z_DEFLATED, 15 + 16,
+					  8, Z_DEFAULT_STRATEGY) != Z_OK)
+		diep ("http: deflateInit2");
+
+	g_http_running = true;
+	if (pthread_create (&g_http_thread, NULL, &thread_http, NULL))
+		diep ("http: pthread_create");
+
+	fprintf (stderr, "http: listening on '%s'\n", listen);
+	return true;
+}
+
+bool
+http_active (void)
+{
+	return g_http_running;
+}
+
+void
+http_publish (uint32_t sequence, const char *json, size_t len)
+{
+	uint64_t value;
+	THttpEntry *entry;
+
+	if (!g_http_running)
+		return;
+
+	/* drop separator of the object stream */
+	if (len && (json[len - 1] == ','))
+		len--;
+
+	if (((entry = (THttpEntry *) calloc (1, sizeof (THttpEntry))) == NULL) ||
+		((entry->data = (char *) malloc (len)) == NULL))
+	{
+		free (entry);
+		return;
+	}
+	memcpy (entry->data, json, len);
+	entry->len = len;
+	entry->refs = 1;
+	entry->type = "application/json";
+	entry->sequence = sequence;
+	snprintf (entry->etag, sizeof (entry->etag), "\"%u\"", sequence);
+
+	/* server picks up the latest only - unseen ones are dropped */
+	if ((entry = __atomic_exchange_n (&g_http_pending, entry,
+									  __ATOMIC_ACQ_REL)) != NULL)
+		http_entry_free (entry);
+
+	value = 1;
+	if (write (g_http_event, &value, sizeof (value)) < 0)
+		fprintf (stderr, "http: failed to notify server\n");
+}
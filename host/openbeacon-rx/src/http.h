@@ -0,0 +1,47 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#define HTTP_MAX_CONNECTIONS 1024
+#define HTTP_REQUEST_SIZE 4096
+#define HTTP_HEADER_SIZE 512
+#define HTTP_EVENTS 64
+/* seconds a long-poll waits for a newer snapshot */
+#define HTTP_WAIT_TIMEOUT 30
+/* seconds without traffic before other connections are closed */
+#define HTTP_IDLE_TIMEOUT 30
+#define HTTP_GZIP_LEVEL 6
+
+/* "port", "address:port" or "unix:/path" */
+extern bool http_start (const char *listen);
+/* server was started, snapshots are worth formatting for it */
+extern bool http_active (void);
+/* hand a formatted snapshot to the server - estimation thread */
+extern void http_publish (uint32_t sequence, const char *json, size_t len);
+
+#endif/*__HTTP_H__*/
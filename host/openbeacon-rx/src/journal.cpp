@@ -0,0 +1,529 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "crypto.h"
+#include "journal.h"
+
+/* full segment waiting for journal_sync to write its index and
+ * footer - keeps fsync off the ingest path */
+typedef struct
+{
+	int fd;
+	uint64_t records;
+	uint32_t crc;
+	TJournalIndex *index;
+	uint32_t index_count;
+} TJournalSeal;
+
+static pthread_mutex_t g_journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char *g_journal_dir;
+static bool g_journal_failed;
+static int g_journal_fd = -1;
+static uint64_t g_journal_start_us, g_journal_last_us, g_journal_records;
+static uint32_t g_journal_crc;
+static double g_journal_flushed;
+static TJournalIndex *g_journal_index;
+static uint32_t g_journal_index_count, g_journal_index_size;
+static int g_journal_buffered;
+static TJournalRecord g_journal_buffer[JOURNAL_BUFFER_RECORDS];
+static TJournalSeal g_journal_seal = { -1 };
+
+/* stop journaling on I/O errors instead of taking ingest down */
+static void
+journal_fail (const char *what)
+{
+	if (!__atomic_exchange_n (&g_journal_failed, true, __ATOMIC_RELAXED))
+		fprintf (stderr, "journal: %s failed (%s) - journal disabled\n",
+			what, strerror (errno));
+}
+
+static bool
+journal_failed (void)
+{
+	return __atomic_load_n (&g_journal_failed, __ATOMIC_RELAXED);
+}
+
+static bool
+journal_write_fd (int fd, uint32_t *crc, const void *data, size_t len)
+{
+	ssize_t res;
+	const uint8_t *p = (const uint8_t *) data;
+
+	*crc = crc32 (*crc, p, len);
+	while (len)
+	{
+		if ((res = write (fd, p, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			journal_fail ("write");
+			return false;
+		}
+		p += res;
+		len -= res;
+	}
+	return true;
+}
+
+static bool
+journal_write (const void *data, size_t len)
+{
+	return journal_write_fd (g_journal_fd, &g_journal_crc, data, len);
+}
+
+static bool
+journal_flush (void)
+{
+	bool res;
+
+	res = journal_write (g_journal_buffer,
+		g_journal_buffered * sizeof (TJournalRecord));
+	g_journal_buffered = 0;
+	return res;
+}
+
+/* bound loss on crash */
+static void
+journal_flush_due (double timestamp)
+{
+	if ((g_journal_fd >= 0) && g_journal_buffered &&
+		((timestamp - g_journal_flushed) >= JOURNAL_FLUSH_TIME))
+	{
+		g_journal_flushed = timestamp;
+		journal_flush ();
+	}
+}
+
+/* append index and footer - needs no lock once detached */
+static void
+journal_seal (TJournalSeal *seal)
+{
+	TJournalFooter footer;
+
+	if (seal->fd < 0)
+		return;
+
+	if (!journal_failed () && journal_write_fd (seal->fd, &seal->crc,
+			seal->index, seal->index_count * sizeof (TJournalIndex)))
+	{
+		memset (&footer, 0, sizeof (footer));
+		memcpy (footer.magic, JOURNAL_FOOTER_MAGIC, JOURNAL_MAGIC_SIZE);
+		footer.records = seal->records;
+		footer.index_offset = sizeof (TJournalHeader) +
+			seal->records * sizeof (TJournalRecord);
+		footer.index_count = seal->index_count;
+		footer.crc32 = crc32 (seal->crc, (const Bytef *) &footer,
+			offsetof (TJournalFooter, crc32));
+
+		if ((write (seal->fd, &footer, sizeof (footer)) !=
+				(ssize_t) sizeof (footer)) || fsync (seal->fd))
+			journal_fail ("seal");
+	}
+
+	close (seal->fd);
+	free (seal->index);
+	seal->fd = -1;
+	seal->index = NULL;
+}
+
+/* write out buffered records and take the segment off the writer */
+static void
+journal_detach (TJournalSeal *seal)
+{
+	if (!journal_failed ())
+		journal_flush ();
+
+	seal->fd = g_journal_fd;
+	seal->records = g_journal_records;
+	seal->crc = g_journal_crc;
+	seal->index = g_journal_index;
+	seal->index_count = g_journal_index_count;
+
+	g_journal_fd = -1;
+	g_journal_index = NULL;
+	g_journal_index_count = g_journal_index_size = 0;
+}
+
+/* rotate - sealing is left to journal_sync unless the previous
+ * segment is still waiting for it */
+static void
+journal_rotate (void)
+{
+	journal_seal (&g_journal_seal);
+	journal_detach (&g_journal_seal);
+}
+
+static bool
+journal_segment (uint64_t time_us)
+{
+	char file[PATH_MAX];
+	TJournalHeader header;
+
+	/* segment name carries its start time for seeking */
+	snprintf (file, sizeof (file), "%s/" JOURNAL_PREFIX "%016llu"
+		JOURNAL_SUFFIX, g_journal_dir, (unsigned long long) time_us);
+	if ((g_journal_fd = open (file, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+	{
+		journal_fail ("open");
+		return false;
+	}
+
+	g_journal_start_us = time_us;
+	g_journal_records = 0;
+	g_journal_index_count = 0;
+	g_journal_crc = crc32 (0, NULL, 0);
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+	header.version = JOURNAL_VERSION;
+	header.record_size = sizeof (TJournalRecord);
+	header.start_us = time_us;
+	return journal_write (&header, sizeof (header));
+}
+
+bool
+journal_open (const char *dir)
+{
+	if (mkdir (dir, 0755) && (errno != EEXIST))
+	{
+		fprintf (stderr, "journal: failed to create '%s'\n", dir);
+		return false;
+	}
+	if (access (dir, W_OK))
+	{
+		fprintf (stderr, "journal: '%s' is not writable\n", dir);
+		return false;
+	}
+
+	g_journal_dir = dir;
+	atexit (&journal_close);
+	return true;
+}
+
+void
+journal_append (int count, const double *received,
+	const uint32_t *reader_ip, const TBeaconLogSighting *const *sighting)
+{
+	int i;
+	uint64_t time_us;
+	TJournalRecord *record;
+	TJournalIndex *index;
+
+	/* set once before ingest starts */
+	if (!g_journal_dir || journal_failed ())
+		return;
+
+	pthread_mutex_lock (&g_journal_mutex);
+
+	for (i = 0; (i < count) && !journal_failed (); i++)
+	{
+		/* workers race for the lock - keep records in time order */
+		time_us = (uint64_t) (received[i] * 1000000.0);
+		if (time_us < g_journal_last_us)
+			time_us = g_journal_last_us;
+		g_journal_last_us = time_us;
+
+		if ((g_journal_fd >= 0) &&
+			((g_journal_records >= JOURNAL_SEGMENT_RECORDS) ||
+			 ((time_us - g_journal_start_us) >=
+			  (JOURNAL_SEGMENT_TIME * 1000000ULL))))
+			journal_rotate ();
+		if ((g_journal_fd < 0) && !journal_segment (time_us))
+			break;
+
+		if (!(g_journal_records % JOURNAL_INDEX_INTERVAL))
+		{
+			if (g_journal_index_count == g_journal_index_size)
+			{
+				g_journal_index_size = g_journal_index_size ?
+					g_journal_index_size * 2 : 1024;
+				if ((index = (TJournalIndex *) realloc (g_journal_index,
+						g_journal_index_size * sizeof (TJournalIndex))) == NULL)
+				{
+					journal_fail ("index");
+					break;
+				}
+				g_journal_index = index;
+			}
+			index = &g_journal_index[g_journal_index_count++];
+			index->time_us = time_us;
+			index->record = g_journal_records;
+		}
+
+		record = &g_journal_buffer[g_journal_buffered++];
+		record->time_us = time_us;
+		record->reader_ip = reader_ip[i];
+		record->reserved = 0;
+		memcpy (&record->sighting, sighting[i], sizeof (record->sighting));
+		g_journal_records++;
+
+		if (g_journal_buffered == JOURNAL_BUFFER_RECORDS)
+			journal_flush ();
+	}
+
+	journal_flush_due (g_journal_last_us / 1000000.0);
+	pthread_mutex_unlock (&g_journal_mutex);
+}
+
+void
+journal_sync (double timestamp)
+{
+	TJournalSeal seal;
+
+	if (!g_journal_dir)
+		return;
+
+	pthread_mutex_lock (&g_journal_mutex);
+	if (!journal_failed ())
+		journal_flush_due (timestamp);
+	seal = g_journal_seal;
+	g_journal_seal.fd = -1;
+	g_journal_seal.index = NULL;
+	pthread_mutex_unlock (&g_journal_mutex);
+
+	/* index, footer and fsync of a rotated segment */
+	journal_seal (&seal);
+}
+
+void
+journal_close (void)
+{
+	TJournalSeal seal;
+
+	pthread_mutex_lock (&g_journal_mutex);
+	journal_seal (&g_journal_seal);
+	if (g_journal_fd >= 0)
+	{
+		journal_detach (&seal);
+		journal_seal (&seal);
+	}
+	pthread_mutex_unlock (&g_journal_mutex);
+}
+
+bool
+journal_check (const char *path)
+{
+	int fd;
+	bool res;
+	struct stat st;
+	char magic[JOURNAL_MAGIC_SIZE];
+
+	if (stat (path, &st))
+		return false;
+	if (S_ISDIR (st.st_mode))
+		return true;
+
+	if ((fd = open (path, O_RDONLY)) < 0)
+		return false;
+	res = (read (fd, magic, sizeof (magic)) == sizeof (magic)) &&
+		!memcmp (magic, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+	close (fd);
+	return res;
+}
+
+bool
+journal_map (const char *file, TJournalSegment *segment)
+{
+	int fd;
+	struct stat st;
+	const TJournalFooter *footer;
+
+	memset (segment, 0, sizeof (*segment));
+	if ((fd = open (file, O_RDONLY)) < 0)
+		return false;
+	if (fstat (fd, &st) || (st.st_size < (off_t) sizeof (TJournalHeader)) ||
+		((segment->map = (const uint8_t *) mmap (NULL, st.st_size, PROT_READ,
+			MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+	{
+		close (fd);
+		segment->map = NULL;
+		return false;
+	}
+	close (fd);
+	segment->size = st.st_size;
+
+	segment->header = (const TJournalHeader *) segment->map;
+	if (memcmp (segment->header->magic, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) ||
+		(segment->header->version != JOURNAL_VERSION) ||
+		(segment->header->record_size != sizeof (TJournalRecord)))
+	{
+		journal_unmap (segment);
+		return false;
+	}
+	segment->record =
+		(const TJournalRecord *) (segment->map + sizeof (TJournalHeader));
+
+	/* sealed segment with consistent footer */
+	footer = (const TJournalFooter *)
+		(segment->map + segment->size - sizeof (TJournalFooter));
+	if ((segment->size >= (sizeof (TJournalHeader) + sizeof (TJournalFooter))) &&
+		!memcmp (footer->magic, JOURNAL_FOOTER_MAGIC, JOURNAL_MAGIC_SIZE) &&
+		(footer->index_offset == (sizeof (TJournalHeader) +
+			footer->records * sizeof (TJournalRecord))) &&
+		((footer->index_offset + footer->index_count * sizeof (TJournalIndex) +
+			sizeof (TJournalFooter)) == segment->size))
+	{
+		segment->sealed = true;
+		segment->records = footer->records;
+		segment->index =
+			(const TJournalIndex *) (segment->map + footer->index_offset);
+		segment->index_count = footer->index_count;
+	}
+	else
+		/* still written or cut short - use all complete records */
+		segment->records = (segment->size - sizeof (TJournalHeader)) /
+			sizeof (TJournalRecord);
+
+	madvise ((void *) segment->map, segment->size, MADV_SEQUENTIAL);
+	return true;
+}
+
+void
+journal_unmap (TJournalSegment *segment)
+{
+	if (segment->map)
+		munmap ((void *) segment->map, segment->size);
+	segment->map = NULL;
+}
+
+bool
+journal_verify (const TJournalSegment *segment)
+{
+	uint32_t crc;
+	const TJournalFooter *footer;
+
+	if (!segment->sealed)
+		return true;
+
+	footer = (const TJournalFooter *)
+		(segment->map + segment->size - sizeof (TJournalFooter));
+	crc = crc32 (crc32 (0, NULL, 0), segment->map,
+		segment->size - sizeof (TJournalFooter) +
+		offsetof (TJournalFooter, crc32));
+	return crc == footer->crc32;
+}
+
+uint64_t
+journal_seek (const TJournalSegment *segment, uint64_t time_us)
+{
+	uint64_t lo, hi, mid;
+	uint32_t a, b, m;
+
+	lo = 0;
+	hi = segment->records;
+
+	/* narrow down to one index interval first */
+	if (segment->index_count)
+	{
+		a = 0;
+		b = segment->index_count;
+		while ((b - a) > 1)
+		{
+			m = a + (b - a) / 2;
+			if (segment->index[m].time_us < time_us)
+				a = m;
+			else
+				b = m;
+		}
+		lo = segment->index[a].record;
+		if (b < segment->index_count)
+			hi = segment->index[b].record;
+	}
+
+	/* first record at or after time_us */
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (segment->record[mid].time_us < time_us)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int
+journal_filter (const struct dirent *entry)
+{
+	size_t len, prefix, suffix;
+
+	len = strlen (entry->d_name);
+	prefix = strlen (JOURNAL_PREFIX);
+	suffix = strlen (JOURNAL_SUFFIX);
+	return (len > (prefix + suffix)) &&
+		!strncmp (entry->d_name, JOURNAL_PREFIX, prefix) &&
+		!strcmp (&entry->d_name[len - suffix], JOURNAL_SUFFIX);
+}
+
+int
+journal_list (const char *dir, char ***files)
+{
+	int i, count;
+	struct dirent **entry;
+
+	/* fixed width names sort by start time */
+	if ((count = scandir (dir, &entry, &journal_filter, &alphasort)) < 0)
+		return -1;
+
+	if ((*files = (char **) calloc (count ? count : 1, sizeof (char *))) == NULL)
+		return -1;
+	for (i = 0; i < count; i++)
+	{
+		if (asprintf (&(*files)[i], "%s/%s", dir, entry[i]->d_name) < 0)
+			(*files)[i] = NULL;
+		free (entry[i]);
+	}
+	free (entry);
+	return count;
+}
+
+uint64_t
+journal_start (const char *file)
+{
+	const char *name;
+
+	name = strrchr (file, '/');
+	name = name ? name + 1 : file;
+	if (strncmp (name, JOURNAL_PREFIX, strlen (JOURNAL_PREFIX)))
+		return 0;
+	return strtoull (name + strlen (JOURNAL_PREFIX), NULL, 10);
+}
@@ -0,0 +1,118 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#define JOURNAL_MAGIC "OBJRNL01"
+#define JOURNAL_FOOTER_MAGIC "OBJIDX01"
+#define JOURNAL_MAGIC_SIZE 8
+#define JOURNAL_VERSION 1
+#define JOURNAL_PREFIX "journal-"
+#define JOURNAL_SUFFIX ".bin"
+
+/* records per sparse time index entry */
+#define JOURNAL_INDEX_INTERVAL 1024
+/* start a new segment after this many records or seconds */
+#define JOURNAL_SEGMENT_RECORDS (1024*1024)
+#define JOURNAL_SEGMENT_TIME 3600
+/* records buffered before writing, flushed at least every second */
+#define JOURNAL_BUFFER_RECORDS 1024
+#define JOURNAL_FLUSH_TIME 1
+
+/* segment layout, host byte order:
+ *   header | record[records] | index[index_count] | footer
+ * the footer is only present once a segment is sealed */
+typedef struct
+{
+	char magic[JOURNAL_MAGIC_SIZE];
+	uint32_t version, record_size;
+	uint64_t start_us;
+	uint8_t reserved[40];
+} PACKED TJournalHeader;
+
+/* received sighting as it came off the wire */
+typedef struct
+{
+	uint64_t time_us;
+	uint32_t reader_ip;
+	uint32_t reserved;
+	TBeaconLogSighting sighting;
+} PACKED TJournalRecord;
+
+typedef struct
+{
+	uint64_t time_us;
+	uint64_t record;
+} PACKED TJournalIndex;
+
+typedef struct
+{
+	char magic[JOURNAL_MAGIC_SIZE];
+	uint64_t records;
+	uint64_t index_offset;
+	uint32_t index_count;
+	/* CRC32 of all preceding bytes of the segment */
+	uint32_t crc32;
+} PACKED TJournalFooter;
+
+/* read-only view of a mapped segment */
+typedef struct
+{
+	const uint8_t *map;
+	size_t size;
+	const TJournalHeader *header;
+	const TJournalRecord *record;
+	uint64_t records;
+	const TJournalIndex *index;
+	uint32_t index_count;
+	bool sealed;
+} TJournalSegment;
+
+/* writer side - safe to call from all ingest workers */
+extern bool journal_open (const char *dir);
+/* records stamped with their local receive time */
+extern void journal_append (int count, const double *received,
+	const uint32_t *reader_ip, const TBeaconLogSighting *const *sighting);
+/* write out buffered records once they are due and seal rotated
+ * segments - estimation thread */
+extern void journal_sync (double timestamp);
+extern void journal_close (void);
+
+/* reader side */
+extern bool journal_check (const char *path);
+extern bool journal_map (const char *file, TJournalSegment *segment);
+extern void journal_unmap (TJournalSegment *segment);
+/* check footer checksum of a sealed segment */
+extern bool journal_verify (const TJournalSegment *segment);
+/* first record at or after time_us */
+extern uint64_t journal_seek (const TJournalSegment *segment,
+	uint64_t time_us);
+/* sorted segment file names of a journal directory */
+extern int journal_list (const char *dir, char ***files);
+extern uint64_t journal_start (const char *file);
+
+#endif/*__JOURNAL_H__*/
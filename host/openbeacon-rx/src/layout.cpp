@@ -0,0 +1,356 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "layout.h"
+#include "../BeaconPositions.h"
+
+static TLayout *g_layout_current;
+static uint32_t g_layout_version;
+static const char *g_layout_file;
+static struct stat g_layout_stat;
+static double g_layout_check;
+static volatile sig_atomic_t g_layout_reload;
+
+static inline uint32_t
+layout_hash (int type, uint32_t id)
+{
+	uint32_t h;
+
+	h = (id ^ (type ? 0x9E3779B9UL : 0)) * 0x85EBCA6BUL;
+	return h ^ (h >> 16);
+}
+
+static void
+layout_free (TLayout * layout)
+{
+	if (!layout)
+		return;
+	free (layout->item);
+	free (layout->index);
+	free (layout);
+}
+
+static TLayout *
+layout_alloc (int size)
+{
+	TLayout *layout;
+
+	if ((layout = (TLayout *) calloc (1, sizeof (TLayout))) == NULL)
+		return NULL;
+	if ((layout->item = (TLayoutItem *)
+		 malloc ((size ? size : 1) * sizeof (TLayoutItem))) == NULL)
+	{
+		free (layout);
+		return NULL;
+	}
+	return layout;
+}
+
+/* build hash index, fails on duplicate entries */
+static bool
+layout_index (TLayout * layout, const char *file)
+{
+	int i, size;
+	uint32_t slot;
+	const TLayoutItem *item, *other;
+
+	/* keep load factor at or below one half */
+	for (size = 8; size < (layout->count * 2); size <<= 1);
+	layout->mask = size - 1;
+	if ((layout->index = (int *) malloc (size * sizeof (int))) == NULL)
+		return false;
+	memset (layout->index, 0xFF, size * sizeof (int));
+
+	for (i = 0, item = layout->item; i < layout->count; i++, item++)
+	{
+		slot = layout_hash (item->type, item->id) & layout->mask;
+		while (layout->index[slot] >= 0)
+		{
+			other = &layout->item[layout->index[slot]];
+			if ((other->type == item->type) && (other->id == item->id))
+			{
+				fprintf (stderr, "layout: %s: duplicate %s 0x%08X\n", file,
+						 item->type == LAYOUT_BEACON ? "beacon" : "reader",
+						 item->id);
+				return false;
+			}
+			slot = (slot + 1) & layout->mask;
+		}
+		layout->index[slot] = i;
+	}
+	return true;
+}
+
+const TLayoutItem *
+layout_find (const TLayout * layout, int type, uint32_t id)
+{
+	int i;
+	uint32_t slot;
+	const TLayoutItem *item;
+
+	slot = layout_hash (type, id) & layout->mask;
+	while ((i = layout->index[slot]) >= 0)
+	{
+		item = &layout->item[i];
+		if ((item->id == id) && (item->type == type))
+			return item;
+		slot = (slot + 1) & layout->mask;
+	}
+	return NULL;
+}
+
+/* compiled-in fixed beacons from BeaconPositions.h */
+static TLayout *
+layout_builtin (void)
+{
+	int i;
+	TLayout *layout;
+	TLayoutItem *item;
+
+	if ((layout = layout_alloc (BEACON_COUNT)) == NULL)
+		return NULL;
+
+	for (i = 0, item = layout->item; i < BEACON_COUNT; i++, item++)
+	{
+		item->id = g_BeaconList[i].id;
+		item->type = LAYOUT_BEACON;
+		item->room = g_BeaconList[i].room;
+		item->floor = g_BeaconList[i].floor;
+		item->group = g_BeaconList[i].group;
+		item->pX = g_BeaconList[i].pX;
+		item->pY = g_BeaconList[i].pY;
+	}
+	layout->count = BEACON_COUNT;
+
+	if (!layout_index (layout, "built-in"))
+	{
+		layout_free (layout);
+		return NULL;
+	}
+	return layout;
+}
+
+static bool
+layout_parse_id (const char *value, int type, uint32_t * id)
+{
+	char *end;
+	struct in_addr in;
+	unsigned long t;
+
+	/* readers are identified by IPv4 address */
+	if (type == LAYOUT_READER)
+	{
+		if (inet_pton (AF_INET, value, &in) != 1)
+			return false;
+		*id = ntohl (in.s_addr);
+		return true;
+	}
+
+	t = strtoul (value, &end, 0);
+	if (!*value || *end || (t > 0xFFFFFFFFUL))
+		return false;
+	*id = (uint32_t) t;
+	return true;
+}
+
+static TLayout *
+layout_parse (const char *file)
+{
+	FILE *f;
+	int n, line, size;
+	char buffer[256], cmd[16], id[INET_ADDRSTRLEN + 16], *p;
+	TLayout *layout;
+	TLayoutItem *item;
+
+	if ((f = fopen (file, "r")) == NULL)
+	{
+		fprintf (stderr, "layout: failed to open '%s'\n", file);
+		return NULL;
+	}
+
+	size = 64;
+	if ((layout = layout_alloc (size)) == NULL)
+	{
+		fclose (f);
+		return NULL;
+	}
+
+	/* lines of "beacon|reader <id> <x> <y> [<room> <floor> <group>]" */
+	for (line = 1; fgets (buffer, sizeof (buffer), f); line++)
+	{
+		if ((p = strchr (buffer, '#')) != NULL)
+			*p = 0;
+
+		if (layout->count == size)
+		{
+			size *= 2;
+			if ((item = (TLayoutItem *)
+				 realloc (layout->item, size * sizeof (TLayoutItem))) == NULL)
+			{
+				fprintf (stderr, "layout: out of memory\n");
+				break;
+			}
+			layout->item = item;
+		}
+
+		item = &layout->item[layout->count];
+		item->room = item->floor = item->group = 0;
+		if ((n = sscanf (buffer, "%15s %31s %lf %lf %u %u %u", cmd, id,
+						 &item->pX, &item->pY, &item->room, &item->floor,
+						 &item->group)) <= 0)
+			continue;
+
+		if (!strcmp (cmd, "beacon"))
+			item->type = LAYOUT_BEACON;
+		else if (!strcmp (cmd, "reader"))
+			item->type = LAYOUT_READER;
+		else
+			n = 0;
+
+		if ((n != 4) && (n != 7))
+		{
+			fprintf (stderr, "layout: %s:%i: syntax error\n", file, line);
+			break;
+		}
+		if (!layout_parse_id (id, item->type, &item->id))
+		{
+			fprintf (stderr, "layout: %s:%i: invalid id '%s'\n", file, line,
+					 id);
+			break;
+		}
+		layout->count++;
+	}
+
+	/* stopped early on error */
+	n = !feof (f);
+	fclose (f);
+
+	if (n || !layout_index (layout, file))
+	{
+		layout_free (layout);
+		return NULL;
+	}
+	return layout;
+}
+
+/* only the estimation thread looks up layouts and it swaps them
+ * itself, so the previous layout can be released right away */
+static void
+layout_publish (TLayout * layout)
+{
+	TLayout *prev;
+
+	layout->version = ++g_layout_version;
+	prev = __atomic_exchange_n (&g_layout_current, layout, __ATOMIC_ACQ_REL);
+	layout_free (prev);
+}
+
+bool
+layout_load (const char *file)
+{
+	TLayout *layout;
+
+	g_layout_file = file;
+	if (file && stat (file, &g_layout_stat))
+	{
+		fprintf (stderr, "layout: failed to open '%s'\n", file);
+		return false;
+	}
+
+	if ((layout = file ? layout_parse (file) : layout_builtin ()) == NULL)
+		return false;
+
+	if (file)
+		fprintf (stderr, "layout: %i entries from '%s'\n", layout->count,
+				 file);
+	layout_publish (layout);
+	return true;
+}
+
+void
+layout_signal (int signal)
+{
+	g_layout_reload = 1;
+}
+
+bool
+layout_poll (double timestamp)
+{
+	struct stat st;
+	TLayout *layout;
+
+	if (!g_layout_file)
+		return false;
+
+	/* check modification time once per interval unless signalled */
+	if (!g_layout_reload)
+	{
+		if ((timestamp - g_layout_check) < LAYOUT_CHECK_INTERVAL)
+			return false;
+		g_layout_check = timestamp;
+
+		/* editors often replace the file - compare inode as well */
+		if (stat (g_layout_file, &st) ||
+			((st.st_mtim.tv_sec == g_layout_stat.st_mtim.tv_sec) &&
+			 (st.st_mtim.tv_nsec == g_layout_stat.st_mtim.tv_nsec) &&
+			 (st.st_size == g_layout_stat.st_size) &&
+			 (st.st_ino == g_layout_stat.st_ino)))
+			return false;
+		g_layout_stat = st;
+	}
+	else
+	{
+		g_layout_reload = 0;
+		if (!stat (g_layout_file, &st))
+			g_layout_stat = st;
+	}
+
+	/* keep current layout if the new one is broken */
+	if ((layout = layout_parse (g_layout_file)) == NULL)
+	{
+		fprintf (stderr, "layout: keeping version %u\n", g_layout_version);
+		return false;
+	}
+
+	layout_publish (layout);
+	fprintf (stderr, "layout: reloaded %i entries as version %u\n",
+			 layout->count, layout->version);
+	return true;
+}
+
+const TLayout *
+layout_current (void)
+{
+	return __atomic_load_n (&g_layout_current, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,68 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __LAYOUT_H__
+#define __LAYOUT_H__
+
+/* layout entry types */
+#define LAYOUT_READER 0
+#define LAYOUT_BEACON 1
+
+/* seconds between checks of the layout file modification time */
+#define LAYOUT_CHECK_INTERVAL 1
+
+typedef struct
+{
+	/* fixed beacon tag id or reader IPv4 address in host order */
+	uint32_t id;
+	int type;
+	uint32_t room, floor, group;
+	double pX, pY;
+} TLayoutItem;
+
+/* immutable once published */
+typedef struct
+{
+	uint32_t version;
+	int count;
+	TLayoutItem *item;
+	/* open addressing hash of item indices, -1 marks free slots */
+	int mask;
+	int *index;
+} TLayout;
+
+/* load layout file, falls back to compiled-in beacons without file */
+extern bool layout_load (const char *file);
+/* reload on SIGHUP or file change - called by the estimation thread */
+extern bool layout_poll (double timestamp);
+/* SIGHUP handler */
+extern void layout_signal (int signal);
+
+extern const TLayout *layout_current (void);
+extern const TLayoutItem *layout_find (const TLayout * layout, int type,
+									   uint32_t id);
+
+#endif/*__LAYOUT_H__*/
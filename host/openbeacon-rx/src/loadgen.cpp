@@ -0,0 +1,763 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "helper.h"
+#include "crypto.h"
+
+#define LOADGEN_PORT 2342
+#define LOADGEN_TAGS 1000
+#define LOADGEN_READERS 100
+/* readers receiving each tag */
+#define LOADGEN_COVERAGE 2
+#define LOADGEN_CONTACTS "cluster:5"
+/* percent chance to hear a contact within one second */
+#define LOADGEN_HEARING 70
+#define LOADGEN_DURATION 10
+#define LOADGEN_SEED 1
+
+/* tracker slot timing of the tag-proximity firmware - a transmission
+ * is requested once per second and sent rng(5) proximity TX slots
+ * later, slots are CONFIG_PROX_SPACING apart with rng(9) ticks of
+ * jitter and every CONFIG_PROX_LISTEN_RATIO-th slot listens */
+#define LOADGEN_TX_BITS 5
+#define LOADGEN_SLOT 0.025
+#define LOADGEN_SLOT_JITTER (512/32768.0)
+#define LOADGEN_LISTEN_RATIO 10
+/* calibration sent by tags without sightings, firmware radio.c */
+#define LOADGEN_RX_LOSS (-1150)
+#define LOADGEN_TX_LOSS (-375)
+#define LOADGEN_PX_POWER (-2000)
+
+/* first simulated tag id - clear of the compiled-in beacons */
+#define LOADGEN_TAG_BASE 0x00200000
+/* reader N sends from 127.1.0.1+N on loopback targets */
+#define LOADGEN_SOURCE 0x7F010001
+#define LOADGEN_READERS_MAX 65535
+/* datagrams per sendmmsg */
+#define LOADGEN_BATCH 64
+/* transmissions between clock checks */
+#define LOADGEN_CHUNK 1024
+/* seconds behind schedule which mark the generator as the bottleneck */
+#define LOADGEN_LAG 0.1
+/* seconds between reports, seconds to let the tracker drain */
+#define LOADGEN_REPORT 1
+#define LOADGEN_DRAIN 2
+/* ramping stops once this share of an interval goes missing */
+#define LOADGEN_LOSS_LIMIT 1.0
+#define LOADGEN_METRICS_SIZE (64*1024)
+
+/* contact graph models */
+#define LOADGEN_GRAPH_NONE 0
+#define LOADGEN_GRAPH_RING 1
+#define LOADGEN_GRAPH_RANDOM 2
+#define LOADGEN_GRAPH_CLUSTER 3
+
+typedef struct
+{
+	/* offset of the one second RTC tick */
+	double phase;
+	/* firmware listen ratio counter */
+	int listen;
+} TLoadgenTag;
+
+typedef struct
+{
+	double time;
+	uint32_t tag;
+} TLoadgenEvent;
+
+/* tracker counters from '/metrics' */
+typedef struct
+{
+	/* duplicates are further reader copies of accepted records */
+	uint64_t datagrams, accepted, duplicates, rejected, drops;
+	/* records held back by an event time watermark */
+	uint64_t pending;
+} TLoadgenStats;
+
+static int g_tags, g_readers, g_coverage, g_hearing;
+static uint64_t g_rand;
+static TLoadgenTag *g_tag;
+static TLoadgenEvent *g_event;
+static uint32_t *g_sequence;
+/* contact graph, contacts of tag N at g_contact[g_contact_start[N]..] */
+static uint32_t *g_contact_start, *g_contact;
+static uint32_t g_epoch;
+
+static int g_socket;
+static bool g_pktinfo;
+static struct sockaddr_in g_target, g_metrics;
+static bool g_metrics_enabled;
+
+static int g_batch;
+static TBeaconLogSighting g_packet[LOADGEN_BATCH];
+static struct mmsghdr g_msg[LOADGEN_BATCH];
+static struct iovec g_iov[LOADGEN_BATCH];
+static union
+{
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE (sizeof (struct in_pktinfo))];
+} g_control[LOADGEN_BATCH];
+static uint64_t g_sent, g_failed;
+
+/* xorshift64* - identical schedule for identical seeds */
+static inline uint32_t
+loadgen_rand (void)
+{
+	g_rand ^= g_rand >> 12;
+	g_rand ^= g_rand << 25;
+	g_rand ^= g_rand >> 27;
+	return (uint32_t) ((g_rand * 2685821657736338717ULL) >> 32);
+}
+
+static inline double
+loadgen_uniform (void)
+{
+	return loadgen_rand () / 4294967296.0;
+}
+
+static double
+loadgen_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static bool
+loadgen_contacts (const char *model)
+{
+	int i, j, k, n, size, type;
+	uint32_t count;
+	const char *p;
+
+	if ((p = strchr (model, ':')) == NULL)
+		n = 0;
+	else if ((n = atoi (p + 1)) < 1)
+		return false;
+
+	if (!strcmp (model, "none"))
+		type = LOADGEN_GRAPH_NONE;
+	else if (!strncmp (model, "ring:", 5))
+		type = LOADGEN_GRAPH_RING;
+	else if (!strncmp (model, "random:", 7))
+		type = LOADGEN_GRAPH_RANDOM;
+	else if (!strncmp (model, "cluster:", 8))
+		type = LOADGEN_GRAPH_CLUSTER;
+	else
+		return false;
+	/* contacts per tag */
+	size = (type == LOADGEN_GRAPH_NONE) ? 0 :
+		(type == LOADGEN_GRAPH_CLUSTER) ? (n - 1) : n;
+	if (size >= g_tags)
+		return false;
+
+	g_contact_start = (uint32_t *) malloc ((g_tags + 1) * sizeof (uint32_t));
+	g_contact = (uint32_t *) malloc ((size ? size : 1) * (size_t) g_tags *
+									 sizeof (uint32_t));
+	if (!g_contact_start || !g_contact)
+		diep ("loadgen_contacts");
+
+	count = 0;
+	for (i = 0; i < g_tags; i++)
+	{
+		g_contact_start[i] = count;
+		switch (type)
+		{
+			/* nearest neighbours on both sides */
+			case LOADGEN_GRAPH_RING:
+				for (k = 1; k <= size; k++)
+					g_contact[count++] = (i + g_tags + ((k & 1) ?
+						((k + 1) / 2) : -(k / 2))) % g_tags;
+				break;
+			/* independent draws per tag */
+			case LOADGEN_GRAPH_RANDOM:
+				for (k = 0; k < size; k++)
+				{
+					j = loadgen_rand () % (g_tags - 1);
+					g_contact[count++] = (j >= i) ? j + 1 : j;
+				}
+				break;
+			/* everyone within a group of n tags */
+			case LOADGEN_GRAPH_CLUSTER:
+				for (j = (i / n) * n; (j < ((i / n) + 1) * n) && (j < g_tags);
+					 j++)
+					if (j != i)
+						g_contact[count++] = j;
+				break;
+		}
+	}
+	g_contact_start[g_tags] = count;
+	return true;
+}
+
+/* transmission requested at second tick 't' as scheduled by the
+ * firmware - a pending request suppresses further ticks */
+static double
+loadgen_schedule (TLoadgenTag * tag, double t)
+{
+	int slots;
+
+	/* rng(5) of zero skips a second */
+	while (!(slots = loadgen_rand () & ((1 << LOADGEN_TX_BITS) - 1)))
+		t += 1;
+
+	/* count down proximity TX slots, listen slots do not count */
+	t += loadgen_uniform () * LOADGEN_SLOT;
+	while (1)
+	{
+		if (++tag->listen >= LOADGEN_LISTEN_RATIO)
+			tag->listen = 0;
+		else if (!--slots)
+			break;
+		t += LOADGEN_SLOT + (loadgen_uniform () - 0.5) * LOADGEN_SLOT_JITTER;
+	}
+	return t;
+}
+
+static void
+loadgen_heap_down (int pos)
+{
+	int child;
+	TLoadgenEvent event;
+
+	event = g_event[pos];
+	while ((child = (pos * 2) + 1) < g_tags)
+	{
+		if (((child + 1) < g_tags) &&
+			(g_event[child + 1].time < g_event[child].time))
+			child++;
+		if (event.time <= g_event[child].time)
+			break;
+		g_event[pos] = g_event[child];
+		pos = child;
+	}
+	g_event[pos] = event;
+}
+
+static void
+loadgen_flush (void)
+{
+	int res, i;
+
+	for (i = 0; i < g_batch; i += res)
+		if ((res = sendmmsg (g_socket, &g_msg[i], g_batch - i, 0)) <= 0)
+		{
+			if (errno == EINTR)
+			{
+				res = 0;
+				continue;
+			}
+			/* local send buffer exhausted */
+			g_failed += g_batch - i;
+			break;
+		}
+		else
+			g_sent += res;
+	g_batch = 0;
+}
+
+static void
+loadgen_queue (uint32_t reader, const TBeaconNgTracker * track, double t)
+{
+	TBeaconLogSighting *pkt;
+	struct in_pktinfo *info;
+	struct msghdr *msg;
+
+	pkt = &g_packet[g_batch];
+	memset (&pkt->hdr, 0, sizeof (pkt->hdr));
+	pkt->hdr.protocol = BEACONLOG_SIGHTING;
+	pkt->hdr.reader_id = htons (reader + 1);
+	pkt->hdr.size = htons (sizeof (*pkt));
+	pkt->sequence = htonl (g_sequence[reader]++);
+	pkt->timestamp = htonl (g_epoch + (uint32_t) t);
+	pkt->log = *track;
+	pkt->hdr.icrc16 = htons (icrc16 (&pkt->hdr.protocol,
+									 sizeof (*pkt) -
+									 sizeof (pkt->hdr.icrc16)));
+
+	msg = &g_msg[g_batch].msg_hdr;
+	g_iov[g_batch].iov_base = pkt;
+	g_iov[g_batch].iov_len = sizeof (*pkt);
+	msg->msg_name = &g_target;
+	msg->msg_namelen = sizeof (g_target);
+	msg->msg_iov = &g_iov[g_batch];
+	msg->msg_iovlen = 1;
+	if (g_pktinfo)
+	{
+		/* every reader gets its own source address */
+		msg->msg_control = &g_control[g_batch];
+		msg->msg_controllen = CMSG_SPACE (sizeof (struct in_pktinfo));
+		g_control[g_batch].hdr.cmsg_level = IPPROTO_IP;
+		g_control[g_batch].hdr.cmsg_type = IP_PKTINFO;
+		g_control[g_batch].hdr.cmsg_len = CMSG_LEN (sizeof (*info));
+		info = (struct in_pktinfo *) CMSG_DATA (&g_control[g_batch].hdr);
+		memset (info, 0, sizeof (*info));
+		info->ipi_spec_dst.s_addr = htonl (LOADGEN_SOURCE + reader);
+	}
+
+	if (++g_batch == LOADGEN_BATCH)
+		loadgen_flush ();
+}
+
+/* one tracker packet forwarded by every reader in range */
+static void
+loadgen_transmit (uint32_t id, double t)
+{
+	int i, slot;
+	uint32_t n, first, contact, reader;
+	TBeaconNgTracker track, encrypted;
+
+	memset (&track, 0, sizeof (track));
+	track.uid = LOADGEN_TAG_BASE + id;
+	track.epoch = g_epoch + (uint32_t) floor (t - g_tag[id].phase);
+	track.voltage = 30 - (id % 4);
+	track.angle = loadgen_rand () % 90;
+
+	/* sighting slots keep the first contacts heard */
+	n = g_contact_start[id + 1] - g_contact_start[id];
+	first = n ? loadgen_rand () % n : 0;
+	for (i = slot = 0; (i < (int) n) && (slot < CONFIG_SIGHTING_SLOTS); i++)
+	{
+		if ((int) (loadgen_rand () % 100) >= g_hearing)
+			continue;
+		contact = g_contact[g_contact_start[id] + ((first + i) % n)];
+		track.p.sighting[slot].uid = LOADGEN_TAG_BASE + contact;
+		/* stable per pair, a few dB of fading */
+		track.p.sighting[slot].rx_power = -50 -
+			(int) ((((id < contact) ? id : contact) * 2654435761U ^
+					((id < contact) ? contact : id)) % 35) -
+			(int) (loadgen_rand () % 4);
+		slot++;
+	}
+	if (slot)
+		track.proto = RFBPROTO_BEACON_NG_SIGHTING;
+	else
+	{
+		track.proto = RFBPROTO_BEACON_NG_STATUS;
+		track.p.status.rx_loss = LOADGEN_RX_LOSS;
+		track.p.status.tx_loss = LOADGEN_TX_LOSS;
+		track.p.status.px_power = LOADGEN_PX_POWER;
+	}
+	aes_encr (&track, &encrypted, sizeof (encrypted), CONFIG_SIGNATURE_SIZE);
+
+	reader = id % g_readers;
+	for (i = 0; i < g_coverage; i++)
+		loadgen_queue ((reader + i) % g_readers, &encrypted, t);
+}
+
+static bool
+loadgen_address (const char *value, int port, struct sockaddr_in *addr)
+{
+	char host[256], *p;
+	struct addrinfo hints, *res;
+
+	if (strlen (value) >= sizeof (host))
+		return false;
+	strcpy (host, value);
+	if ((p = strrchr (host, ':')) != NULL)
+	{
+		*p++ = 0;
+		if ((port = atoi (p)) <= 0 || port > 0xFFFF)
+			return false;
+	}
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo (host[0] ? host : "127.0.0.1", NULL, &hints, &res))
+		return false;
+	memcpy (addr, res->ai_addr, sizeof (*addr));
+	addr->sin_port = htons (port);
+	freeaddrinfo (res);
+	return true;
+}
+
+static uint64_t
+loadgen_counter (const char *text, const char *name)
+{
+	const char *p;
+	size_t len;
+	uint64_t sum;
+
+	/* sum of all label sets */
+	sum = 0;
+	len = strlen (name);
+	for (p = text; (p = strstr (p, name)) != NULL; p += len)
+		if (((p == text) || (p[-1] == '\n')) &&
+			((p[len] == ' ') || (p[len] == '{')))
+			sum += strtoull (strchr (p, ' ') + 1, NULL, 10);
+	return sum;
+}
+
+/* tracker counters via its HTTP server */
+static bool
+loadgen_stats (TLoadgenStats * stats)
+{
+	int fd, len, res;
+	char *buf, *body;
+	struct timeval tv;
+	static const char request[] =
+		"GET /metrics HTTP/1.1\r\nHost: loadgen\r\nConnection: close\r\n\r\n";
+
+	if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+		return false;
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+	setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+	if (connect (fd, (struct sockaddr *) &g_metrics, sizeof (g_metrics)) ||
+		(write (fd, request, sizeof (request) - 1) !=
+		 (ssize_t) (sizeof (request) - 1)))
+	{
+		close (fd);
+		return false;
+	}
+
+	if ((buf = (char *) malloc (LOADGEN_METRICS_SIZE)) == NULL)
+		diep ("loadgen_stats");
+	len = 0;
+	while ((len < (LOADGEN_METRICS_SIZE - 1)) &&
+		   ((res = read (fd, buf + len, LOADGEN_METRICS_SIZE - 1 - len)) > 0))
+		len += res;
+	buf[len] = 0;
+	close (fd);
+
+	if (strncmp (buf, "HTTP/1.1 200", 12) ||
+		((body = strstr (buf, "\r\n\r\n")) == NULL))
+	{
+		free (buf);
+		return false;
+	}
+	body += 4;
+
+	stats->datagrams = loadgen_counter (body, "openbeacon_datagrams_total");
+	stats->drops = loadgen_counter (body, "openbeacon_kernel_drops_total");
+	stats->pending = loadgen_counter (body, "openbeacon_pending_records");
+	stats->accepted =
+		loadgen_counter (body, "openbeacon_records_total{outcome=\"sighting\"}")
+		+ loadgen_counter (body,
+						   "openbeacon_records_total{outcome=\"status\"}");
+	stats->duplicates =
+		loadgen_counter (body,
+						 "openbeacon_records_total{outcome=\"duplicate\"}");
+	stats->rejected =
+		loadgen_counter (body, "openbeacon_records_total") - stats->accepted -
+		stats->duplicates;
+	free (buf);
+	return true;
+}
+
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+			 "usage: %s [options] [host[:port]]\n"
+			 "  -t tags      simulated tags (default %i)\n"
+			 "  -r readers   simulated readers, distinct source addresses\n"
+			 "               from 127.1.0.1 on loopback (default %i)\n"
+			 "  -c readers   readers in range of each tag (default %i)\n"
+			 "  -g graph     tag contacts 'none', 'ring:N', 'random:N' or\n"
+			 "               'cluster:N' (default %s)\n"
+			 "  -p percent   chance to hear a contact per second (default %i)\n"
+			 "  -x factor    run simulated time 'factor' times faster\n"
+			 "  -u percent   raise the speed by 'percent' every second until\n"
+			 "               the tracker loses more than %.0f%%\n"
+			 "  -d seconds   duration (default %i)\n"
+			 "  -m host:port tracker HTTP server for reconciliation\n"
+			 "  -s seed      schedule seed (default %i)\n"
+			 "  host:port    tracker UDP port (default 127.0.0.1:%i)\n",
+			 name, LOADGEN_TAGS, LOADGEN_READERS, LOADGEN_COVERAGE,
+			 LOADGEN_CONTACTS, LOADGEN_HEARING, LOADGEN_LOSS_LIMIT,
+			 LOADGEN_DURATION, LOADGEN_SEED, LOADGEN_PORT);
+	exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+	int opt, i, duration;
+	int count;
+	const char *contacts;
+	double speed, ramp, start, now, report, sim_base, real_base, due;
+	double best_rate, rate, loss, lag;
+	uint64_t last_sent, sent;
+	struct timespec ts;
+	TLoadgenTag *tag;
+	TLoadgenStats base, last, stats;
+
+	g_tags = LOADGEN_TAGS;
+	g_readers = LOADGEN_READERS;
+	g_coverage = LOADGEN_COVERAGE;
+	g_hearing = LOADGEN_HEARING;
+	contacts = LOADGEN_CONTACTS;
+	duration = LOADGEN_DURATION;
+	speed = 1;
+	ramp = 0;
+	g_rand = LOADGEN_SEED;
+	while ((opt = getopt (argc, argv, "t:r:c:g:p:x:u:d:m:s:h")) != -1)
+		switch (opt)
+		{
+			case 't':
+				if ((g_tags = atoi (optarg)) < 2)
+					usage (argv[0]);
+				break;
+			case 'r':
+				g_readers = atoi (optarg);
+				if ((g_readers < 1) || (g_readers > LOADGEN_READERS_MAX))
+					usage (argv[0]);
+				break;
+			case 'c':
+				if ((g_coverage = atoi (optarg)) < 1)
+					usage (argv[0]);
+				break;
+			case 'g':
+				contacts = optarg;
+				break;
+			case 'p':
+				g_hearing = atoi (optarg);
+				if ((g_hearing < 0) || (g_hearing > 100))
+					usage (argv[0]);
+				break;
+			case 'x':
+				if ((speed = atof (optarg)) <= 0)
+					usage (argv[0]);
+				break;
+			case 'u':
+				if ((ramp = atof (optarg)) <= 0)
+					usage (argv[0]);
+				break;
+			case 'd':
+				if ((duration = atoi (optarg)) < 1)
+					usage (argv[0]);
+				break;
+			case 'm':
+				if (!loadgen_address (optarg, 80, &g_metrics))
+					usage (argv[0]);
+				g_metrics_enabled = true;
+				break;
+			case 's':
+				g_rand = strtoull (optarg, NULL, 0);
+				break;
+			default:
+				usage (argv[0]);
+		}
+	if (g_coverage > g_readers)
+		g_coverage = g_readers;
+	if (ramp && !g_metrics_enabled)
+	{
+		fprintf (stderr, "loadgen: ramping needs the tracker metrics (-m)\n");
+		usage (argv[0]);
+	}
+
+	memset (&g_target, 0, sizeof (g_target));
+	if (!loadgen_address ((optind < argc) ? argv[optind] : "127.0.0.1",
+						  LOADGEN_PORT, &g_target))
+		usage (argv[0]);
+
+	g_rand ^= 0x9E3779B97F4A7C15ULL;
+	if (!loadgen_contacts (contacts))
+	{
+		fprintf (stderr, "loadgen: invalid contact graph '%s'\n", contacts);
+		usage (argv[0]);
+	}
+
+	aes_init ();
+	if ((g_socket = socket (AF_INET, SOCK_DGRAM, 0)) < 0)
+		diep ("socket");
+	/* distinct reader addresses only exist on loopback */
+	g_pktinfo = (ntohl (g_target.sin_addr.s_addr) >> 24) == 127;
+	if (!g_pktinfo && (g_readers > 1))
+		fprintf (stderr, "loadgen: remote target - readers share one "
+				 "source address\n");
+
+	/* firmware epoch continues across runs */
+	g_epoch = (uint32_t) time (NULL);
+	g_tag = (TLoadgenTag *) calloc (g_tags, sizeof (TLoadgenTag));
+	g_event = (TLoadgenEvent *) malloc (g_tags * sizeof (TLoadgenEvent));
+	g_sequence = (uint32_t *) calloc (g_readers, sizeof (uint32_t));
+	if (!g_tag || !g_event || !g_sequence)
+		diep ("main");
+	for (i = 0; i < g_tags; i++)
+	{
+		g_tag[i].phase = loadgen_uniform ();
+		g_tag[i].listen = loadgen_rand () % LOADGEN_LISTEN_RATIO;
+		g_event[i].tag = i;
+		g_event[i].time = loadgen_schedule (&g_tag[i], g_tag[i].phase);
+	}
+	for (i = (g_tags / 2) - 1; i >= 0; i--)
+		loadgen_heap_down (i);
+
+	memset (&base, 0, sizeof (base));
+	if (g_metrics_enabled && !loadgen_stats (&base))
+	{
+		fprintf (stderr, "loadgen: can't read tracker metrics\n");
+		return EXIT_FAILURE;
+	}
+	last = base;
+
+	printf ("loadgen: %i tags, %i readers, %i per tag, contacts %s, "
+			"about %.0f datagrams/s at %gx\n", g_tags, g_readers, g_coverage,
+			contacts, g_tags * g_coverage * (31 / 32.0) * speed, speed);
+
+	/* simulated time advances 'speed' times as fast as real time */
+	start = real_base = report = loadgen_now ();
+	sim_base = 0;
+	last_sent = 0;
+	best_rate = lag = 0;
+	while (((now = loadgen_now ()) - start) < duration)
+	{
+		/* send everything due, sleep up to a millisecond otherwise */
+		due = sim_base + (now - real_base) * speed;
+		for (count = 0; (g_event[0].time <= due) && (count < LOADGEN_CHUNK);
+			 count++)
+		{
+			loadgen_transmit (g_event[0].tag, g_event[0].time);
+			/* next request at the first tick after sending */
+			tag = &g_tag[g_event[0].tag];
+			g_event[0].time = loadgen_schedule (tag, tag->phase +
+				floor (g_event[0].time - tag->phase) + 1);
+			loadgen_heap_down (0);
+		}
+		loadgen_flush ();
+		if (((due - g_event[0].time) / speed) > lag)
+			lag = (due - g_event[0].time) / speed;
+		if (g_event[0].time > due)
+		{
+			ts.tv_sec = 0;
+			ts.tv_nsec = (long) fmin ((g_event[0].time - due) / speed * 1e9,
+									  1e6);
+			nanosleep (&ts, NULL);
+		}
+
+		if ((now - report) < LOADGEN_REPORT)
+			continue;
+
+		sent = g_sent - last_sent;
+		rate = sent / (now - report);
+		if (g_metrics_enabled && loadgen_stats (&stats))
+		{
+			loss = sent ? 100.0 * ((double) sent -
+								   (double) (stats.datagrams -
+											 last.datagrams)) / sent : 0;
+			printf ("loadgen: %.0fs %gx sent %.0f/s, tracker %.0f/s, "
+					"%llu kernel drops, %.1f%% missing", now - start,
+					speed, rate,
+					(stats.datagrams - last.datagrams) / (now - report),
+					(unsigned long long) (stats.drops - last.drops), loss);
+			last = stats;
+		}
+		else
+		{
+			printf ("loadgen: %.0fs %gx sent %.0f/s", now - start, speed,
+					rate);
+			loss = -1;
+		}
+		if (lag > LOADGEN_LAG)
+			printf (", generator %.0fms behind", lag * 1000);
+		printf ("\n");
+		fflush (stdout);
+
+		/* a lagging generator understates the tracker's limit */
+		if (ramp && (lag > LOADGEN_LAG))
+		{
+			printf ("loadgen: generator limit reached at %.0f datagrams/s\n",
+					rate);
+			duration = 0;
+		}
+		else if (ramp && (loss > LOADGEN_LOSS_LIMIT))
+		{
+			printf ("loadgen: tracker saturated above %.0f datagrams/s\n",
+					best_rate);
+			duration = 0;
+		}
+		else if (ramp && (loss >= 0))
+		{
+			if (rate > best_rate)
+				best_rate = rate;
+			/* keep simulated time continuous */
+			sim_base += (now - real_base) * speed;
+			real_base = now;
+			speed *= 1 + (ramp / 100);
+		}
+
+		last_sent = g_sent;
+		report = now;
+		lag = 0;
+	}
+
+	printf ("loadgen: sent %llu datagrams", (unsigned long long) g_sent);
+	if (g_failed)
+		printf (", %llu failed locally", (unsigned long long) g_failed);
+	printf ("\n");
+
+	/* wait for queued datagrams, then reconcile with the tracker - drops
+	 * are only reported along with the next datagram a worker receives */
+	if (g_metrics_enabled)
+	{
+		for (i = 0; i < (LOADGEN_DRAIN * 10); i++)
+		{
+			usleep (100 * 1000);
+			if (loadgen_stats (&stats) &&
+				((stats.datagrams - base.datagrams +
+				  stats.drops - base.drops) >= g_sent) && !stats.pending)
+				break;
+		}
+		if (!loadgen_stats (&stats))
+		{
+			fprintf (stderr, "loadgen: can't read tracker metrics\n");
+			return EXIT_FAILURE;
+		}
+		printf ("loadgen: tracker received %llu datagrams, %llu records "
+				"accepted, %llu duplicates, %llu rejected, %llu kernel "
+				"drops, %lld unaccounted\n",
+				(unsigned long long) (stats.datagrams - base.datagrams),
+				(unsigned long long) (stats.accepted - base.accepted),
+				(unsigned long long) (stats.duplicates - base.duplicates),
+				(unsigned long long) (stats.rejected - base.rejected),
+				(unsigned long long) (stats.drops - base.drops),
+				(long long) (g_sent - (stats.datagrams - base.datagrams) -
+							 (stats.drops - base.drops)));
+	}
+	return 0;
+}
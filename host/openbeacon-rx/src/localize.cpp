@@ -0,0 +1,266 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "helper.h"
+#include "localize.h"
+
+#define LOCALIZE_GROW(array,size) \
+	if ((array = (typeof (array)) realloc (array, \
+		(size) * sizeof (*array))) == NULL) \
+		diep ("localize_grow")
+
+void
+localize_reset (TLocalizeBatch * batch)
+{
+	batch->tags = 0;
+	batch->obs = 0;
+}
+
+int
+localize_tag (TLocalizeBatch * batch, float x, float y, bool warm)
+{
+	int size;
+
+	if (batch->tags == batch->tags_size)
+	{
+		size = batch->tags_size ? batch->tags_size * 2 : 1024;
+		LOCALIZE_GROW (batch->x, size);
+		LOCALIZE_GROW (batch->y, size);
+		LOCALIZE_GROW (batch->x0, size);
+		LOCALIZE_GROW (batch->y0, size);
+		LOCALIZE_GROW (batch->first, size + 1);
+		LOCALIZE_GROW (batch->count, size);
+		LOCALIZE_GROW (batch->warm, size);
+		batch->tags_size = size;
+	}
+
+	batch->x[batch->tags] = batch->x0[batch->tags] = x;
+	batch->y[batch->tags] = batch->y0[batch->tags] = y;
+	batch->count[batch->tags] = 0;
+	batch->warm[batch->tags] = warm;
+	return batch->tags++;
+}
+
+void
+localize_observe (TLocalizeBatch * batch, int tag, float bx, float by,
+				  float range, float weight)
+{
+	int size, i;
+
+	if (batch->obs == batch->obs_size)
+	{
+		size = batch->obs_size ? batch->obs_size * 2 : 4096;
+		LOCALIZE_GROW (batch->tag, size);
+		LOCALIZE_GROW (batch->bx, size);
+		LOCALIZE_GROW (batch->by, size);
+		LOCALIZE_GROW (batch->range, size);
+		LOCALIZE_GROW (batch->weight, size);
+		LOCALIZE_GROW (batch->px, size);
+		LOCALIZE_GROW (batch->py, size);
+		LOCALIZE_GROW (batch->hxx, size);
+		LOCALIZE_GROW (batch->hxy, size);
+		LOCALIZE_GROW (batch->hyy, size);
+		LOCALIZE_GROW (batch->gx, size);
+		LOCALIZE_GROW (batch->gy, size);
+		LOCALIZE_GROW (batch->order, size);
+		LOCALIZE_GROW (batch->sort, size);
+		batch->obs_size = size;
+	}
+
+	i = batch->obs++;
+	batch->tag[i] = tag;
+	batch->bx[i] = bx;
+	batch->by[i] = by;
+	batch->range[i] = range;
+	batch->weight[i] = weight;
+	batch->count[tag]++;
+}
+
+/* counting sort of observations by tag, in place via scratch */
+static void
+localize_sort (TLocalizeBatch * batch)
+{
+	int i, t, pos;
+	float *field[4];
+
+	pos = 0;
+	for (t = 0; t < batch->tags; t++)
+	{
+		batch->first[t] = pos;
+		pos += batch->count[t];
+	}
+	batch->first[t] = pos;
+
+	for (i = 0; i < batch->obs; i++)
+		batch->order[batch->first[batch->tag[i]]++] = i;
+	for (t = 0; t < batch->tags; t++)
+		batch->first[t] -= batch->count[t];
+
+	field[0] = batch->bx;
+	field[1] = batch->by;
+	field[2] = batch->range;
+	field[3] = batch->weight;
+	for (t = 0; t < 4; t++)
+	{
+		for (i = 0; i < batch->obs; i++)
+			batch->sort[i] = field[t][batch->order[i]];
+		memcpy (field[t], batch->sort, batch->obs * sizeof (float));
+	}
+}
+
+/* residuals and normal equation terms of all observations in one
+ * branch free pass over contiguous arrays */
+static void
+localize_linearize (TLocalizeBatch * batch)
+{
+	int i, n;
+	float dx, dy, d, inv, ux, uy, res, w;
+	const float *__restrict px = batch->px, *__restrict py = batch->py;
+	const float *__restrict bx = batch->bx, *__restrict by = batch->by;
+	const float *__restrict range = batch->range;
+	const float *__restrict weight = batch->weight;
+	float *__restrict hxx = batch->hxx, *__restrict hxy = batch->hxy;
+	float *__restrict hyy = batch->hyy;
+	float *__restrict gx = batch->gx, *__restrict gy = batch->gy;
+
+	n = batch->obs;
+	for (i = 0; i < n; i++)
+	{
+		dx = px[i] - bx[i];
+		dy = py[i] - by[i];
+		d = sqrtf (dx * dx + dy * dy + LOCALIZE_EPSILON);
+		inv = 1.0f / d;
+		ux = dx * inv;
+		uy = dy * inv;
+		res = d - range[i];
+		w = weight[i];
+		hxx[i] = w * ux * ux;
+		hxy[i] = w * ux * uy;
+		hyy[i] = w * uy * uy;
+		gx[i] = w * ux * res;
+		gy[i] = w * uy * res;
+	}
+}
+
+/* weighted centroid of observing beacons, slightly off-center so
+ * symmetric layouts still produce a gradient */
+static void
+localize_cold_start (TLocalizeBatch * batch, int t)
+{
+	int i, end;
+	float x, y, W;
+
+	x = y = W = 0;
+	for (i = batch->first[t], end = i + batch->count[t]; i < end; i++)
+	{
+		x += batch->bx[i] * batch->weight[i];
+		y += batch->by[i] * batch->weight[i];
+		W += batch->weight[i];
+	}
+	if (!(W > 0))
+		return;
+
+	batch->x[t] = batch->x0[t] = (x / W) + 1;
+	batch->y[t] = batch->y0[t] = (y / W) + 1;
+}
+
+void
+localize_solve (TLocalizeBatch * batch)
+{
+	int t, i, it, end;
+	float Hxx, Hxy, Hyy, Gx, Gy, W, lambda, det;
+
+	/* nothing observed - all tags keep their position */
+	if (!batch->obs)
+		return;
+
+	localize_sort (batch);
+
+	/* start all observations from their tag's previous position */
+	for (t = 0; t < batch->tags; t++)
+	{
+		if (!batch->warm[t] && batch->count[t])
+			localize_cold_start (batch, t);
+		for (i = batch->first[t], end = i + batch->count[t]; i < end; i++)
+		{
+			batch->px[i] = batch->x[t];
+			batch->py[i] = batch->y[t];
+		}
+	}
+
+	for (it = 0; it < LOCALIZE_ITERATIONS; it++)
+	{
+		localize_linearize (batch);
+
+		/* per tag 2x2 damped Gauss-Newton step */
+		for (t = 0; t < batch->tags; t++)
+		{
+			if (!batch->count[t])
+				continue;
+
+			Hxx = Hxy = Hyy = Gx = Gy = W = 0;
+			for (i = batch->first[t], end = i + batch->count[t]; i < end;
+				 i++)
+			{
+				Hxx += batch->hxx[i];
+				Hxy += batch->hxy[i];
+				Hyy += batch->hyy[i];
+				Gx += batch->gx[i];
+				Gy += batch->gy[i];
+				W += batch->weight[i];
+			}
+
+			/* prior towards the warm start regularizes tags seen by
+			 * fewer than three beacons */
+			lambda = LOCALIZE_DAMPING * W;
+			Hxx += lambda;
+			Hyy += lambda;
+			Gx += lambda * (batch->x[t] - batch->x0[t]);
+			Gy += lambda * (batch->y[t] - batch->y0[t]);
+
+			det = Hxx * Hyy - Hxy * Hxy;
+			if (!(det > 0))
+				continue;
+
+			batch->x[t] -= (Hyy * Gx - Hxy * Gy) / det;
+			batch->y[t] -= (Hxx * Gy - Hxy * Gx) / det;
+
+			for (i = batch->first[t], end = i + batch->count[t]; i < end;
+				 i++)
+			{
+				batch->px[i] = batch->x[t];
+				batch->py[i] = batch->y[t];
+			}
+		}
+	}
+}
@@ -0,0 +1,67 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __LOCALIZE_H__
+#define __LOCALIZE_H__
+
+/* fixed number of Gauss-Newton iterations keeps the cost bounded */
+#define LOCALIZE_ITERATIONS 4
+/* pull towards warm start, relative to total observation weight */
+#define LOCALIZE_DAMPING 0.05f
+/* keeps gradients defined on top of a beacon */
+#define LOCALIZE_EPSILON 1e-3f
+
+/* one solve over all tags of an estimation step - observations are
+ * staged in any order and sorted into structure-of-arrays form */
+typedef struct
+{
+	/* per tag: warm start in, solution out */
+	int tags, tags_size;
+	float *x, *y, *x0, *y0;
+	int *first, *count;
+	bool *warm;
+
+	/* per observation, grouped by tag after localize_solve */
+	int obs, obs_size;
+	int *tag;
+	float *bx, *by, *range, *weight;
+	/* scratch, one entry per observation */
+	float *px, *py, *hxx, *hxy, *hyy, *gx, *gy;
+	int *order;
+	float *sort;
+} TLocalizeBatch;
+
+extern void localize_reset (TLocalizeBatch * batch);
+/* add a tag with its previous position, returns tag index - without
+ * warm start the tag starts from the centroid of its observations */
+extern int localize_tag (TLocalizeBatch * batch, float x, float y,
+						 bool warm);
+/* distance 'range' to a known position, weight ~ 1/variance */
+extern void localize_observe (TLocalizeBatch * batch, int tag, float bx,
+							  float by, float range, float weight);
+extern void localize_solve (TLocalizeBatch * batch);
+
+#endif/*__LOCALIZE_H__*/
@@ -38,15 +38,30 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <getopt.h>
 #include <math.h>
+#include <signal.h>
 
-#include "main.h"
 #include "helper.h"
 #include "crypto.h"
+#include "main.h"
+#include "keyring.h"
+#include "json.h"
+#include "snapshot.h"
+#include "distance.h"
+#include "localize.h"
+#include "layout.h"
+#include "journal.h"
+#include "fusion.h"
+#include "reorder.h"
+#include "contact.h"
+#include "pool.h"
 #include "replay.h"
+#include "http.h"
+#include "stream.h"
 #include "network.h"
 #include "bmMapHandleToItem.h"
-#include "../BeaconPositions.h"
+#include "metrics.h"
 
 #define TAG_DAMPEN 10.0
 
@@ -55,33 +70,79 @@
 #define PROXAGGREGATION_TIME 10
 #define MAX_PROXIMITY_SLOTS 32
 
+/* evict stale map entries every EXPIRY_INTERVAL seconds */
+#define EXPIRY_INTERVAL 1
+#define TAG_EXPIRY_TIME (TAGAGGREGATION_TIME*4)
+#define PROX_EXPIRY_TIME PROXAGGREGATION_TIME
+
+/* forwarder links idle this long are forgotten */
+#define READER_EXPIRY_TIME (TAGAGGREGATION_TIME*10)
+/* sequence numbers tracked behind the highest one, records further
+ * behind count as forwarder restart */
+#define READER_REORDER_WINDOW 64
+/* larger sequence jumps count as forwarder restart, not as loss */
+#define READER_GAP_MAX 65536
+/* seconds per rate sample and smoothing of rate and clock offset */
+#define READER_RATE_TIME 1.0
+#define READER_RATE_DAMPEN 4.0
+#define READER_OFFSET_DAMPEN 64.0
+/* forwarder link handle - bit 48 keeps handle non-zero */
+#define READER_HANDLE(ip,id) ((1ULL<<48)|(((uint64_t)(ip))<<16)|(id))
+
+/* layout coordinate units per meter */
+#define LOCALIZE_SCALE 100.0
+/* received power at 1m for edges without calibration */
+#define LOCALIZE_RSSI_1M (-45)
+
+/* proximity radio carrier in MHz */
+#define DISTANCE_FREQUENCY (2400+CONFIG_PROX_CHANNEL)
+
 #define PROX_STEP (1/PROXAGGREGATION_TIME)
 #define PROX_WEIGHT(x) (1-(PROX_STEP*x))
 
-#if __APPLE__ && __MACH__
-#define exp10(x) __exp10(x)
-#endif
-
+/* ingest state - written by process_packet, copied by the estimator */
 typedef struct
 {
 	uint32_t tag_id, epoch;
 	float voltage;
 	int angle;
-	bool calibrated, fixed, visible;
+	bool calibrated;
 	double last_seen;
 	uint32_t button_time;
-	uint32_t last_reader_id;
-	int Fcount;
-	double Fx, Fy;
+	/* readers which relayed the latest transmission, first one first */
+	uint32_t reader_id[FUSION_READERS];
+	int reader_count;
 	double rx_loss, tx_loss, px_power;
-	double pX, pY, vX, vY;
+	/* changed since last estimation step */
+	bool dirty;
 } TTagItem;
 
+/* forwarder link state - sequence and clock of TBeaconLogSighting */
+typedef struct
+{
+	uint32_t reader_ip;
+	uint16_t reader_id;
+	/* highest sequence number received, bit N of window marks
+	 * sequence-N as received or not counted as lost */
+	uint32_t sequence;
+	uint64_t window;
+	uint64_t records, lost, reordered, restarts;
+	/* bit mask of reader interfaces seen */
+	uint32_t interfaces[256/32];
+	double last_seen;
+	/* records of the current rate sample */
+	double window_start, rate;
+	uint32_t window_count;
+	double offset;
+} TReaderItem;
+
 typedef struct
 {
 	uint32_t last_seen;
 	int power;
 	uint32_t distance;
+	/* sighting reported by tag2, selects tag2_cal */
+	bool reverse;
 } TTagProximitySlot;
 
 typedef struct
@@ -91,33 +152,250 @@ typedef struct
 	uint32_t last_seen;
 	int last_power;
 	bool calibrated;
-	double tag1_calrx,tag2_calrx;
+	/* quantized calibration, see distance_quantize */
+	int32_t tag1_cal, tag2_cal;
 	uint32_t fifo_pos;
 	TTagProximitySlot fifo[MAX_PROXIMITY_SLOTS];
+	/* changed since last estimation step */
+	bool dirty;
+	/* newest fifo entries added since last estimation step */
+	uint32_t fresh;
 } TTagProximity;
 
-static FILE* g_out;
-static bool g_first;
-static bmMapHandleToItem g_map_reader, g_map_tag, g_map_proximity;
+/* estimator state - private to the estimation thread */
+typedef struct
+{
+	uint32_t tag_id, generation;
+	bool fixed, visible;
+	/* position known from a previous step - warm start */
+	bool located;
+	/* index in this step's localization batch, -1 for fixed */
+	int index;
+	double pX, pY;
+	/* layout version fixed beacons were resolved against */
+	uint32_t layout;
+	uint32_t room, floor, group;
+	/* strongest fixed beacon edge of this step */
+	double near_power;
+	/* delta output state - as of last snapshot */
+	bool reported, snap_button, snap_visible;
+	int snap_px, snap_py;
+	uint32_t snap_room;
+} TTagState;
+
+typedef struct
+{
+	uint32_t tag1, tag2, generation;
+	/* delta output state - as of last snapshot */
+	bool reported;
+	int snap_count;
+} TEdgeState;
+
+/* range observation of a mobile tag to a fixed beacon */
+typedef struct
+{
+	TTagState *mobile, *beacon;
+	float range, weight;
+	double power;
+} TEstimationObservation;
+
+/* private output of one pool worker, merged in chunk order */
+typedef struct
+{
+	/* tag and edge records only */
+	TSnapshot part;
+	TEstimationObservation *obs;
+	int obs_count, obs_size;
+} TEstimationWorker;
 
-static uint32_t g_total_crc_ok, g_total_crc_errors;
-static uint32_t g_ignored_protocol, g_invalid_protocol, g_unknown_reader;
-static uint32_t g_doubled_reader;
-static uint8_t g_decrypted_one;
+/* output of a chunk within the buffers of the worker which ran it */
+typedef struct
+{
+	TEstimationWorker *worker;
+	int tag_first, tag_count;
+	int edge_first, edge_count;
+	int obs_first, obs_count;
+} TEstimationChunk;
+
+static bmMapHandleToItem g_map_reader, g_map_tag, g_map_proximity;
+/* RSSI to distance conversion, selectable per deployment */
+static TDistanceModel g_distance;
+/* only used by the estimation thread, accessed without stripe locks */
+static bmMapHandleToItem g_map_tag_state, g_map_edge_state;
+
+/* ingest records copied per stripe, processed without locks */
+static TTagItem *g_copy_tag;
+static TTagState **g_copy_tag_state;
+static TTagProximity *g_copy_prox;
+static TEdgeState **g_copy_edge_state;
+static int g_copy_tag_count, g_copy_tag_size;
+static int g_copy_prox_count, g_copy_prox_size;
+static uint32_t g_generation;
+static TLocalizeBatch g_localize;
+static TEstimationWorker g_estimation_worker[POOL_MAX_WORKERS];
+static TEstimationChunk *g_estimation_chunk;
+static int g_estimation_chunk_size;
+/* reader and beacon layout of the current estimation step */
+static const TLayout *g_layout;
+/* snapshot being built by the current estimation step */
+static TSnapshot *g_snap;
+static TJsonBuffer g_json;
+/* HTTP documents are always complete, even in delta mode */
+static TJsonBuffer g_json_full;
+/* delta output - full keyframe every g_delta_keyframe steps */
+static int g_delta_keyframe;
 
 #define STRENGTH_LEVELS_COUNT 4
 
+/* expired tags are recycled - make sure a cached pointer still
+ * refers to the same tag */
+static inline bool
+prox_tag_valid(const TTagItem *tag, uint32_t tag_id)
+{
+	return tag && (tag->tag_id == tag_id);
+}
+
+/* sightings recorded before both sides were calibrated get their
+ * distance once the calibration values are known */
+static void
+prox_calibrate(TTagProximity *prox)
+{
+	int i;
+	int32_t cal[MAX_PROXIMITY_SLOTS];
+	int16_t power[MAX_PROXIMITY_SLOTS];
+	uint32_t mm[MAX_PROXIMITY_SLOTS];
+	TTagProximitySlot *slot;
+
+	for(i=0, slot=prox->fifo; i<MAX_PROXIMITY_SLOTS; i++, slot++)
+	{
+		cal[i] = slot->reverse ? prox->tag2_cal : prox->tag1_cal;
+		power[i] = slot->power;
+	}
+
+	distance_batch(&g_distance, cal, power, mm, MAX_PROXIMITY_SLOTS);
+
+	for(i=0, slot=prox->fifo; i<MAX_PROXIMITY_SLOTS; i++, slot++)
+		if(slot->last_seen)
+			slot->distance = mm[i];
+}
+
+static void
+tag_reader(TTagItem *tag, uint32_t reader_id)
+{
+	int i;
+
+	for(i=0; i<tag->reader_count; i++)
+		if(tag->reader_id[i]==reader_id)
+			return;
+	if(tag->reader_count<FUSION_READERS)
+		tag->reader_id[tag->reader_count++] = reader_id;
+}
+
+/* link health of each forwarder, before decryption as sequence
+ * and reader time are sent in clear - returns event time of the
+ * record, its reader time corrected by the learned clock offset */
+static double
+process_reader(double timestamp, uint32_t reader_ip, const TBeaconLogSighting *pkt)
+{
+	int32_t delta;
+	uint32_t sequence, behind;
+	uint16_t reader_id;
+	double elapsed, offset, event;
+	TReaderItem *reader;
+	pthread_mutex_t *reader_mutex;
+
+	reader_id = ntohs(pkt->hdr.reader_id);
+	if((reader = (TReaderItem*)g_map_reader.Add(READER_HANDLE(reader_ip, reader_id), &reader_mutex))==NULL)
+		diep("can't add reader item");
+
+	sequence = ntohl(pkt->sequence);
+	/* reader time has seconds resolution - centre it */
+	offset = ntohl(pkt->timestamp) + 0.5 - timestamp;
+
+	/* reader seen first time */
+	if(!reader->records)
+	{
+		reader->reader_ip = reader_ip;
+		reader->reader_id = reader_id;
+		reader->sequence = sequence - 1;
+		reader->window = ~0ULL;
+		reader->window_start = timestamp;
+		reader->offset = offset;
+	}
+	reader->records++;
+	reader->last_seen = timestamp;
+	reader->interfaces[pkt->hdr.interface/32] |= 1UL << (pkt->hdr.interface%32);
+	reader->offset += (offset - reader->offset)/READER_OFFSET_DAMPEN;
+
+	/* sequence numbers skipped are lost until they show up late */
+	delta = (int32_t)(sequence - reader->sequence);
+	behind = reader->sequence - sequence;
+	if((delta>0) && (delta<=READER_GAP_MAX))
+	{
+		reader->lost += delta - 1;
+		reader->window = (delta<READER_REORDER_WINDOW) ?
+			(reader->window << delta) | 1 : 1;
+		reader->sequence = sequence;
+	}
+	else if((delta<=0) && (behind<READER_REORDER_WINDOW))
+	{
+		/* only sequences counted as skipped recover - ignore
+		 * duplicated datagrams */
+		if(!(reader->window & (1ULL << behind)))
+		{
+			reader->window |= 1ULL << behind;
+			reader->reordered++;
+			reader->lost--;
+		}
+	}
+	else
+	{
+		/* sequences before a restart were never counted as lost */
+		reader->restarts++;
+		reader->window = ~0ULL;
+		reader->sequence = sequence;
+	}
+
+	/* records per second */
+	reader->window_count++;
+	if((elapsed = timestamp - reader->window_start)>=READER_RATE_TIME)
+	{
+		reader->rate = reader->rate ?
+			reader->rate + (reader->window_count/elapsed - reader->rate)/READER_RATE_DAMPEN :
+			reader->window_count/elapsed;
+		reader->window_start = timestamp;
+		reader->window_count = 0;
+	}
+
+	event = timestamp + offset - reader->offset;
+	pthread_mutex_unlock (reader_mutex);
+	return event;
+}
+
+/* further copy of the latest transmission of a tag */
 static void
+process_copy(uint32_t reader_id, uint32_t uid, uint32_t epoch)
+{
+	TTagItem *tag;
+	pthread_mutex_t *tag_mutex;
+
+	if((tag = (TTagItem*)g_map_tag.Find(uid, &tag_mutex))==NULL)
+		return;
+	if((tag->tag_id==uid) && (tag->epoch==epoch))
+		tag_reader(tag, reader_id);
+	pthread_mutex_unlock (tag_mutex);
+}
+
+bool
 process_packet(double timestamp, uint32_t reader_id, const TBeaconNgTracker &track)
 {
 	int i;
-	double cal;
+	int32_t cal;
 	uint32_t tag1, tag2;
 	TTagItem *tag, *tag1p, *tag2p;
 	TTagProximity *prox;
 	TTagProximitySlot *prox_slot;
 	const TBeaconNgSighting *slot;
-	const TBeaconItem *beacon;
 	pthread_mutex_t *tag_mutex, *prox_mutex;
 
 	/* find tag */
@@ -130,18 +408,6 @@ process_packet(double timestamp, uint32_t reader_id, const TBeaconNgTracker &tra
 		tag->tag_id = track.uid;
 		tag->calibrated = false;
 		tag->epoch = 0;
-
-		/* check for fixed beacons ID's */
-		for(i=0; i<BEACON_COUNT; i++)
-		{
-			beacon = &g_BeaconList[i];
-			if(tag->tag_id == beacon->id)
-			{
-				tag->fixed = tag->visible = true;
-				tag->pX = beacon->pX;
-				tag->pY = beacon->pY;
-			}
-		}
 	}
 
 #ifdef REPLAY_PROTECTION
@@ -149,16 +415,19 @@ process_packet(double timestamp, uint32_t reader_id, const TBeaconNgTracker &tra
 	if(track.epoch <= tag->epoch)
 	{
 		pthread_mutex_unlock (tag_mutex);
-		return;
+		return false;
 	}
 #endif
 
 	/* remember reader time */
+	if(tag->epoch != track.epoch)
+		tag->reader_count = 0;
+	tag_reader(tag, reader_id);
 	tag->epoch = track.epoch;
 	tag->last_seen = timestamp;
-	tag->last_reader_id = reader_id;
 	tag->voltage = track.voltage/10.0;
 	tag->angle = track.angle;
+	tag->dirty = true;
 	if(track.proto & RFBPROTO_PROTO_BUTTON)
 		tag->button_time = timestamp;
 
@@ -207,11 +476,15 @@ process_packet(double timestamp, uint32_t reader_id, const TBeaconNgTracker &tra
 				if((timestamp-prox->last_seen)>=PROXAGGREGATION_TIME)
 				{
 					prox->fifo_pos = 0;
+					prox->fresh = 0;
 					bzero(&prox->fifo, sizeof(prox->fifo));
 				}
 				/* remember time */
 				prox->last_seen = timestamp;
 				prox->last_power = slot->rx_power;
+				prox->dirty = true;
+				if(prox->fresh < MAX_PROXIMITY_SLOTS)
+					prox->fresh++;
 
 				/* remember sighting */
 				prox_slot = &prox->fifo[prox->fifo_pos++];
@@ -219,21 +492,20 @@ process_packet(double timestamp, uint32_t reader_id, const TBeaconNgTracker &tra
 					prox->fifo_pos = 0;
 				prox_slot->last_seen =  timestamp;
 				prox_slot->power = slot->rx_power;
+				prox_slot->reverse = (tag->tag_id != tag1);
 
-				/* populate second tag pointer */
-				if(!prox->tag1p)
+				/* populate second tag pointer, refresh expired ones */
+				if(!prox_tag_valid(prox->tag1p, prox->tag1))
 					prox->tag1p = (TTagItem*)g_map_tag.Find(prox->tag1, NULL);
-				if(!prox->tag2p)
+				if(!prox_tag_valid(prox->tag2p, prox->tag2))
 					prox->tag2p = (TTagItem*)g_map_tag.Find(prox->tag2, NULL);
 
 				/* pre-calculate calibration values */
 				if(prox->calibrated)
 				{
-					cal = (tag->tag_id == tag1) ? prox->tag1_calrx : prox->tag2_calrx;
-					/* calculate distance in mm */
-					prox_slot->distance =
-						(exp10((cal - prox_slot->power)/20.0)/
-						(41.88*(2400+CONFIG_PROX_CHANNEL)))*1000000;
+					cal = prox_slot->reverse ? prox->tag2_cal : prox->tag1_cal;
+					/* look up distance in mm */
+					prox_slot->distance = distance_mm(&g_distance, cal, prox_slot->power);
 				}
 				else
 				{
@@ -245,14 +517,15 @@ process_packet(double timestamp, uint32_t reader_id, const TBeaconNgTracker &tra
 						prox->tag2p->calibrated)
 					{
 						prox->calibrated = true;
-						prox->tag1_calrx =
+						prox->tag1_cal = distance_quantize(
 							prox->tag1p->rx_loss +
 							prox->tag2p->px_power +
-							prox->tag2p->tx_loss;
-						prox->tag2_calrx =
+							prox->tag2p->tx_loss);
+						prox->tag2_cal = distance_quantize(
 							prox->tag2p->rx_loss +
 							prox->tag1p->px_power +
-							prox->tag1p->tx_loss;
+							prox->tag1p->tx_loss);
+						prox_calibrate(prox);
 					}
 				}
 
@@ -276,6 +549,7 @@ process_packet(double timestamp, uint32_t reader_id, const TBeaconNgTracker &tra
 
 	/* release tag object */
 	pthread_mutex_unlock (tag_mutex);
+	return true;
 }
 
 void
@@ -283,225 +557,673 @@ print_packet(FILE *out, uint32_t reader_id, const TBeaconNgTracker &track)
 {
 	uint32_t t;
 	const TBeaconNgSighting *slot;
+	static __thread TJsonBuffer buf;
+
+	if(!buf.data)
+		json_init(&buf, 512);
+	json_reset(&buf);
 
 	/* show common fields */
-	fprintf(out, "{\"id\":\"0x%08X\",\"t\":%i,\"voltage\":%1.1f,\"angle\":%03i,",
-		track.uid,
-		track.epoch,
-		track.voltage/10.0,
-		track.angle
-	);
+	json_str(&buf, "{\"id\":\"");
+	json_hex32(&buf, track.uid);
+	json_str(&buf, "\",\"t\":");
+	json_int(&buf, track.epoch);
+	json_str(&buf, ",\"voltage\":");
+	json_fixed(&buf, track.voltage/10.0, 1);
+	json_str(&buf, ",\"angle\":");
+	json_int_pad(&buf, track.angle, 3, '0');
+	json_char(&buf, ',');
 
 	/* show specific fields */
 	switch(track.proto & RFBPROTO_PROTO_MASK)
 	{
 		case RFBPROTO_BEACON_NG_SIGHTING:
 		{
-			fprintf(out, "\"sighting\"=[");
+			json_str(&buf, "\"sighting\"=[");
 			slot = track.p.sighting;
 			for(t=0; t<CONFIG_SIGHTING_SLOTS; t++)
 			{
 				if(slot->uid)
 				{
-					fprintf(out, "%s{\"id\":\"0x%08X\",\"dBm\":%03i}",
-						t ? ",":"",
-						slot->uid,
-						slot->rx_power
-					);
+					json_str(&buf, t ? ",{\"id\":\"" : "{\"id\":\"");
+					json_hex32(&buf, slot->uid);
+					json_str(&buf, "\",\"dBm\":");
+					json_int_pad(&buf, slot->rx_power, 3, '0');
+					json_char(&buf, '}');
 				}
 				slot++;
 			}
-			fprintf(out, "]");
+			json_char(&buf, ']');
 			break;
 		}
 
 		case RFBPROTO_BEACON_NG_STATUS:
 		{
-			fprintf(out, "\"status\":{\"rx_loss\":%1.2f,\"tx_loss\":%1.2f,\"px_power\":%2.0f,\"ticks\":%06i}",
-				track.p.status.rx_loss/100.0,
-				track.p.status.tx_loss/100.0,
-				track.p.status.px_power/100.0,
-				track.p.status.ticks
-			);
+			json_str(&buf, "\"status\":{\"rx_loss\":");
+			json_fixed(&buf, track.p.status.rx_loss/100.0, 2);
+			json_str(&buf, ",\"tx_loss\":");
+			json_fixed(&buf, track.p.status.tx_loss/100.0, 2);
+			json_str(&buf, ",\"px_power\":");
+			json_fixed_pad(&buf, track.p.status.px_power/100.0, 0, 2, ' ');
+			json_str(&buf, ",\"ticks\":");
+			json_int_pad(&buf, track.p.status.ticks, 6, '0');
+			json_char(&buf, '}');
 			break;
 		}
 	}
 
-	fprintf(out, "}\n\r");
+	json_str(&buf, "}\n\r");
+	fflush(out);
+	json_write(&buf, fileno(out));
+}
+
+/* rejected records are counted, see metrics_report */
+static bool
+packet_valid (uint32_t reader_id, const TBeaconLogSighting *pkt)
+{
+	int res;
+
+	if(pkt->hdr.protocol != BEACONLOG_SIGHTING)
+		res = METRIC_INVALID_PROTOCOL;
+	else if(ntohs(pkt->hdr.size) != sizeof(TBeaconLogSighting))
+		res = METRIC_INVALID_SIZE;
+	else if(ntohs(pkt->hdr.icrc16) != icrc16(&pkt->hdr.protocol, (sizeof(TBeaconLogSighting)-sizeof(pkt->hdr.icrc16))))
+		res = METRIC_CRC_ERROR;
+	else
+		return true;
+
+	metrics_count(res, 1);
+	metrics_reader(reader_id, false);
+	return false;
+}
+
+static bool
+packet_decrypted (double timestamp, uint32_t reader_id, const TBeaconNgTracker &track)
+{
+	switch(track.proto & RFBPROTO_PROTO_MASK)
+	{
+		case RFBPROTO_BEACON_NG_SIGHTING:
+		case RFBPROTO_BEACON_NG_STATUS:
+			/* show & process latest packet */
+//			print_packet(stdout, reader_id, track);
+			metrics_reader(reader_id, true);
+			if(!process_packet(timestamp, reader_id, track))
+				metrics_count(METRIC_REPLAYED, 1);
+			else
+				metrics_count(((track.proto & RFBPROTO_PROTO_MASK) ==
+					RFBPROTO_BEACON_NG_SIGHTING) ? METRIC_SIGHTING : METRIC_STATUS, 1);
+			return true;
+
+		default:
+			metrics_reader(reader_id, false);
+			metrics_count(METRIC_UNKNOWN_PROTOCOL, 1);
+			return false;
+	}
+}
+
+/* copy of an authenticated transmission */
+static void
+packet_duplicate (uint32_t reader_id, uint32_t uid, uint32_t epoch)
+{
+	process_copy(reader_id, uid, epoch);
+	metrics_count(METRIC_DUPLICATE, 1);
+	metrics_reader(reader_id, true);
+}
+
+/* further copies of a transmission skip decryption - FUSION_FIRST if
+ * this one has to be decrypted, queued copies are settled once the
+ * first copy was */
+static int
+packet_copy (uint64_t key, double timestamp, double received, uint32_t reader_id,
+	const TBeaconLogSighting *pkt)
+{
+	int res;
+	uint32_t uid, epoch;
+
+	res = fusion_check(key, timestamp, received, reader_id, pkt, &uid, &epoch);
+	if(res == FUSION_DUPLICATE)
+		packet_duplicate(reader_id, uid, epoch);
+	return res;
+}
+
+/* first copy rejected - queued copies carry the same ciphertext */
+static void
+packet_unfused (uint64_t key, int metric)
+{
+	int i, count;
+	TFusionCopy queued[FUSION_PENDING];
+
+	count = fusion_failed(key, queued);
+	for(i=0; i<count; i++)
+	{
+		metrics_count(metric, 1);
+		metrics_reader(queued[i].reader_id, false);
+	}
+}
+
+/* first copy of a transmission decrypted - process queued copies and
+ * return them, -1 if rejected */
+static int
+packet_fused (uint64_t key, double timestamp, uint32_t reader_id, const TBeaconNgTracker &track,
+	TFusionCopy *queued)
+{
+	int i, count;
+
+	if(!packet_decrypted(timestamp, reader_id, track))
+	{
+		packet_unfused(key, METRIC_UNKNOWN_PROTOCOL);
+		return -1;
+	}
+
+	count = fusion_done(key, track.uid, track.epoch, queued);
+	for(i=0; i<count; i++)
+		packet_duplicate(queued[i].reader_id, track.uid, track.epoch);
+	return count;
 }
 
 int
 parse_packet (double timestamp, uint32_t reader_id, const void *data, int len)
 {
 	uint32_t t;
+	uint64_t key;
 	const TBeaconLogSighting *pkt;
 	TBeaconNgTracker track;
+	TFusionCopy queued[FUSION_PENDING];
 
 	if(len<(int)sizeof(TBeaconLogSighting))
+	{
+		if(len>0)
+			metrics_count(METRIC_TRUNCATED, 1);
 		return len;
+	}
 
 	pkt = (const TBeaconLogSighting*)data;
-	if(pkt->hdr.protocol != BEACONLOG_SIGHTING)
+	if(!packet_valid(reader_id, pkt))
+		return len;
+	process_reader(timestamp, reader_id, pkt);
+
+	key = fusion_key(&pkt->log, sizeof(pkt->log));
+	if(packet_copy(key, timestamp, timestamp, reader_id, pkt) != FUSION_FIRST)
+		return sizeof(TBeaconLogSighting);
+
+	/* decrypt valid packet */
+	if((t = keyring_decr(reader_id, ntohs(pkt->hdr.reader_id), &pkt->log, &track, sizeof(track), CONFIG_SIGNATURE_SIZE))!=0)
 	{
-		fprintf(stderr, " Invalid protocol [0x%02X]\n\r", pkt->hdr.protocol);
+		packet_unfused(key, METRIC_DECRYPT_ERROR);
+		metrics_count(METRIC_DECRYPT_ERROR, 1);
+		metrics_reader(reader_id, false);
 		return len;
 	}
 
-	t = ntohs(pkt->hdr.size);
-	if(ntohs(t != sizeof(TBeaconLogSighting)))
+	return (packet_fused(key, timestamp, reader_id, track, queued) >= 0) ?
+		(int)sizeof(TBeaconLogSighting) : len;
+}
+
+typedef struct
+{
+	int count;
+	double received[AES_BATCH];
+	uint32_t reader_id[AES_BATCH];
+	uint16_t hdr_reader_id[AES_BATCH];
+	const TAESContext *ctx[AES_BATCH];
+	const TBeaconLogSighting *pkt[AES_BATCH];
+	const void *in[AES_BATCH];
+	uint64_t key[AES_BATCH];
+	uint8_t res[AES_BATCH];
+	TBeaconNgTracker track[AES_BATCH];
+	/* copies of authenticated transmissions, journaled only */
+	int copies;
+	double copy_received[AES_BATCH];
+	uint32_t copy_reader_id[AES_BATCH];
+	const TBeaconLogSighting *copy[AES_BATCH];
+	/* nanoseconds spent in flushes of this batch */
+	uint64_t decrypt, process;
+} TParseBatch;
+
+#define PARSE_PENDING 0xFF
+/* records, their settled copies and further copies of a batch */
+#define PARSE_VALID (AES_BATCH*(FUSION_PENDING+2))
+
+static void
+parse_batch_flush (double timestamp, TParseBatch *batch)
+{
+	int i, j, n, copies, pos[AES_BATCH];
+	const TAESContext *ctx;
+	double valid_received[PARSE_VALID];
+	uint32_t valid_reader[PARSE_VALID];
+	const TBeaconLogSighting *valid[PARSE_VALID];
+	TFusionCopy settled[AES_BATCH*FUSION_PENDING];
+	const void *in[AES_BATCH];
+	void *out[AES_BATCH];
+	uint8_t res[AES_BATCH];
+	uint64_t start, decrypted;
+
+	start = metrics_clock();
+	memset(batch->res, PARSE_PENDING, batch->count);
+	for(i=0; i<batch->count; i++)
 	{
-		fprintf(stderr, " Invalid packet size (%i expected, %u received)\n\r", (int)sizeof(TBeaconLogSighting), t);
-		return len;
+		if(batch->res[i]!=PARSE_PENDING)
+			continue;
+
+		/* unknown reader - try all site keys */
+		if((ctx = batch->ctx[i]) == NULL)
+		{
+			metrics_count(METRIC_KEY_TRIAL, 1);
+			batch->res[i] = keyring_trial(batch->reader_id[i], batch->hdr_reader_id[i],
+				NULL, batch->in[i], &batch->track[i], sizeof(TBeaconNgTracker), CONFIG_SIGNATURE_SIZE);
+			continue;
+		}
+
+		/* decrypt all records sharing this site key in lockstep */
+		for(j=i, n=0; j<batch->count; j++)
+			if((batch->ctx[j]==ctx) && (batch->res[j]==PARSE_PENDING))
+			{
+				pos[n] = j;
+				in[n] = batch->in[j];
+				out[n] = &batch->track[j];
+				n++;
+			}
+		aes_decr_batch(ctx, in, out, res, n, sizeof(TBeaconNgTracker), CONFIG_SIGNATURE_SIZE);
+
+		/* reader key might have changed */
+		for(j=0; j<n; j++)
+			batch->res[pos[j]] = res[j] ? keyring_trial(batch->reader_id[pos[j]],
+				batch->hdr_reader_id[pos[j]], ctx, in[j], out[j],
+				sizeof(TBeaconNgTracker), CONFIG_SIGNATURE_SIZE) : 0;
 	}
-	
-	if(ntohs(pkt->hdr.icrc16) != icrc16(&pkt->hdr.protocol, (sizeof(TBeaconLogSighting)-sizeof(pkt->hdr.icrc16))))
+
+	decrypted = metrics_clock();
+	for(i=n=copies=0; i<batch->count; i++)
+		if(batch->res[i])
+		{
+			packet_unfused(batch->key[i], METRIC_DECRYPT_ERROR);
+			metrics_count(METRIC_DECRYPT_ERROR, 1);
+			metrics_reader(batch->reader_id[i], false);
+		}
+		else
+		{
+			valid_received[n] = batch->received[i];
+			valid_reader[n] = batch->reader_id[i];
+			valid[n++] = batch->pkt[i];
+			if((j = packet_fused(batch->key[i], timestamp, batch->reader_id[i], batch->track[i],
+				&settled[copies])) > 0)
+				copies += j;
+		}
+
+	/* archive authentic records and their copies as received */
+	for(i=0; i<copies; i++)
 	{
-		fprintf(stderr, " Invalid packet CRC\n\r");
-		return len;
+		valid_received[n] = settled[i].received;
+		valid_reader[n] = settled[i].reader_id;
+		valid[n++] = &settled[i].sighting;
 	}
+	memcpy(&valid_received[n], batch->copy_received, batch->copies * sizeof(double));
+	memcpy(&valid_reader[n], batch->copy_reader_id, batch->copies * sizeof(uint32_t));
+	memcpy(&valid[n], batch->copy, batch->copies * sizeof(batch->copy[0]));
+	n += batch->copies;
+	if(n)
+		journal_append(n, valid_received, valid_reader, valid);
+
+	batch->count = batch->copies = 0;
+	batch->decrypt += decrypted - start;
+	batch->process += metrics_clock() - decrypted;
+}
 
-	/* decrypt valid packet */
-	if((t = aes_decr(&pkt->log, &track, sizeof(track), CONFIG_SIGNATURE_SIZE))!=0)
+/* 'received' times are only passed for records released by the
+ * reorder buffer, others were received at 'timestamp' */
+static void
+parse_datagrams (double timestamp, int count, const double *received,
+	const uint32_t *reader_id, const uint8_t *const *data, const int *len)
+{
+	int i, size, res;
+	uint16_t id;
+	uint64_t start;
+	double event;
+	bool released;
+	double receive;
+	const TBeaconLogSighting *pkt;
+	TParseBatch batch;
+
+	start = metrics_clock();
+	released = received != NULL;
+	if(!released)
 	{
-		fprintf(stderr, " Failed decrypting packet with error [%i]\n\r", t);
-		return len;
+		metrics_received(start);
+		metrics_count(METRIC_DATAGRAMS, count);
 	}
+	batch.count = batch.copies = 0;
+	batch.decrypt = batch.process = 0;
 
-	switch(track.proto & RFBPROTO_PROTO_MASK)
+	/* collect the valid records of all datagrams and
+	 * decrypt them AES_BATCH at a time */
+	for(i=0; i<count; i++)
 	{
-		case RFBPROTO_BEACON_NG_SIGHTING:
-		case RFBPROTO_BEACON_NG_STATUS:
-			/* show & process latest packet */
-//			print_packet(stdout, reader_id, track);
-			process_packet(timestamp, reader_id, track);
-			return sizeof(TBeaconLogSighting);
+		pkt = (const TBeaconLogSighting*)data[i];
+		size = len[i];
+		receive = released ? received[i] : timestamp;
 
-		default:
-			fprintf(stderr, " Unknown protocol [0x%02X]\n\r", track.proto);
-			return len;
+		while(size>=(int)sizeof(TBeaconLogSighting))
+		{
+			if(!packet_valid(reader_id[i], pkt))
+			{
+				size = 0;
+				break;
+			}
+			if(!released)
+			{
+				event = process_reader(timestamp, reader_id[i], pkt);
+
+				/* event time mode - decrypt once the watermark passed */
+				if(reorder_enabled())
+				{
+					if(!reorder_push(event, timestamp, reader_id[i], pkt))
+						metrics_count(METRIC_LATE, 1);
+					pkt++;
+					size -= sizeof(TBeaconLogSighting);
+					continue;
+				}
+			}
+
+			batch.key[batch.count] = fusion_key(&pkt->log, sizeof(pkt->log));
+			res = packet_copy(batch.key[batch.count], timestamp, receive, reader_id[i], pkt);
+			if(res == FUSION_DUPLICATE)
+			{
+				batch.copy_received[batch.copies] = receive;
+				batch.copy_reader_id[batch.copies] = reader_id[i];
+				batch.copy[batch.copies] = pkt;
+				if(++batch.copies==AES_BATCH)
+					parse_batch_flush(timestamp, &batch);
+			}
+			else if(res == FUSION_FIRST)
+			{
+				id = ntohs(pkt->hdr.reader_id);
+				batch.received[batch.count] = receive;
+				batch.pkt[batch.count] = pkt;
+				batch.in[batch.count] = &pkt->log;
+				batch.reader_id[batch.count] = reader_id[i];
+				batch.hdr_reader_id[batch.count] = id;
+				batch.ctx[batch.count] = keyring_route(reader_id[i], id);
+				if(++batch.count==AES_BATCH)
+					parse_batch_flush(timestamp, &batch);
+			}
+
+			pkt++;
+			size -= sizeof(TBeaconLogSighting);
+		}
+
+		if(size>0)
+			metrics_count(METRIC_TRUNCATED, 1);
 	}
+
+	if(batch.count || batch.copies)
+		parse_batch_flush(timestamp, &batch);
+
+	/* per batch of datagrams, parsing excludes the flushes */
+	metrics_record(METRIC_STAGE_PARSE,
+		metrics_clock() - start - batch.decrypt - batch.process);
+	metrics_record(METRIC_STAGE_DECRYPT, batch.decrypt);
+	metrics_record(METRIC_STAGE_PROCESS, batch.process);
 }
 
+/* records due in event time mode, see reorder_init in main */
+#ifndef BENCHMARK
 static void
-thread_iterate_tag (void *Context, double timestamp, bool realtime)
+parse_released (double timestamp, int count, const double *received,
+	const uint32_t *reader_id, const uint8_t *const *data, const int *len)
+{
+	parse_datagrams(timestamp, count, received, reader_id, data, len);
+}
+#endif/*BENCHMARK*/
+
+void
+parse_batch (double timestamp, int count, const uint32_t *reader_id,
+	const uint8_t *const *data, const int *len)
+{
+	parse_datagrams(timestamp, count, NULL, reader_id, data, len);
+
+	/* release windows closed meanwhile unless another thread does */
+	if(reorder_enabled())
+		reorder_drain(timestamp, false);
+}
+
+static void
+thread_copy_reader (void *Context, double timestamp, bool realtime)
+{
+	int i;
+	TReaderItem *reader = (TReaderItem*)Context;
+	TReaderSnapshot *snap;
+
+	/* ignore empty slots */
+	if(!reader->records)
+		return;
+
+	snap = snapshot_reader(g_snap, reader->reader_ip, reader->reader_id);
+	for(i=0; i<(int)(sizeof(reader->interfaces)/sizeof(reader->interfaces[0])); i++)
+		snap->interfaces += __builtin_popcount(reader->interfaces[i]);
+	/* event time steps trail the receive clock */
+	snap->age = (timestamp > reader->last_seen) ?
+		(int)(timestamp - reader->last_seen) : 0;
+	snap->records = reader->records;
+	snap->lost = reader->lost;
+	snap->reordered = reader->reordered;
+	snap->restarts = reader->restarts;
+	/* silent readers have no rate sample in progress */
+	snap->rate = ((timestamp - reader->last_seen) < (READER_RATE_TIME*2)) ?
+		reader->rate : 0;
+	snap->offset = reader->offset;
+}
+
+static void *
+estimation_grow (void *array, int *size, size_t item)
+{
+	*size = *size ? (*size * 2) : 1024;
+	if((array = realloc(array, *size * item)) == NULL)
+		diep("estimation_grow");
+	return array;
+}
+
+static void
+thread_copy_tag (void *Context, double timestamp, bool realtime)
 {
-	int delta;
-	double dx, dy, distance;
 	TTagItem *tag = (TTagItem*)Context;
 
 	/* ignore empty slots */
 	if(!tag->last_seen)
 		return;
 
-	/* calculate delta time since last sighting - expired ? */
-	delta = timestamp - tag->last_seen;
-	if (delta >= TAGAGGREGATION_TIME)
+	if(g_copy_tag_count == g_copy_tag_size)
+	{
+		g_copy_tag = (TTagItem*)estimation_grow(g_copy_tag, &g_copy_tag_size, sizeof(TTagItem));
+		g_copy_tag_state = (TTagState**)realloc(g_copy_tag_state, g_copy_tag_size*sizeof(TTagState*));
+		if(!g_copy_tag_state)
+			diep("estimation_grow");
+	}
+	memcpy(&g_copy_tag[g_copy_tag_count++], tag, sizeof(*tag));
+	tag->dirty = false;
+}
+
+static void
+thread_copy_prox (void *Context, double timestamp, bool realtime)
+{
+	TTagProximity *prox = (TTagProximity*)Context;
+
+	/* ignore empty and expired slots */
+	if(!prox->last_seen || ((timestamp - prox->last_seen) >= PROXAGGREGATION_TIME))
 		return;
 
-	if(g_first)
+	if(g_copy_prox_count == g_copy_prox_size)
 	{
-		fprintf(g_out,"\n  ],\n  \"tag\":[");
+		g_copy_prox = (TTagProximity*)estimation_grow(g_copy_prox, &g_copy_prox_size, sizeof(TTagProximity));
+		g_copy_edge_state = (TEdgeState**)realloc(g_copy_edge_state, g_copy_prox_size*sizeof(TEdgeState*));
+		if(!g_copy_edge_state)
+			diep("estimation_grow");
 	}
-	fprintf(g_out,"%s\n    {\"id\":%u,\"hex\":\"0x%08X\",\"age\":%i,\"angle\":%i,\"voltage\":%1.1f",
-		g_first ? "":",",
-		tag->tag_id,
-		tag->tag_id,
-		delta,
-		tag->angle,
-		tag->voltage
-	);
-	g_first = false;
-
-	if((timestamp - tag->button_time)<=TAGBUTTON_TIME)
-		fprintf(g_out,",\"button\":true");
+	memcpy(&g_copy_prox[g_copy_prox_count++], prox, sizeof(*prox));
+	prox->dirty = false;
+	prox->fresh = 0;
+}
 
-	if(tag->fixed)
-		fprintf(g_out,",\"fixed\":true");
+static TTagState *
+estimation_tag_state (uint32_t tag_id)
+{
+	TTagState *state;
+	const TLayoutItem *beacon;
 
-	if(tag->visible)
-		fprintf(g_out,",\"px\":%i,\"py\":%i", (int)tag->pX, (int)tag->pY);
+	if((state = (TTagState*)g_map_tag_state.Add(tag_id, NULL))==NULL)
+		diep("can't add tag state");
+	state->tag_id = tag_id;
 
-	if(tag->Fcount)
+	/* check for fixed beacons on first sight and after layout reloads */
+	if(state->layout != g_layout->version)
 	{
-		dx = tag->Fx/tag->Fcount;
-		dy = tag->Fy/tag->Fcount;
-		distance = sqrt(dx*dx + dy*dy);
-		if(distance>=0.1)
+		state->layout = g_layout->version;
+		if((beacon = layout_find(g_layout, LAYOUT_BEACON, tag_id)) != NULL)
 		{
-			/* move only in unity-steps */
-			tag->pX += dx/distance;
-			tag->pY += dy/distance;
+			state->fixed = state->visible = true;
+			state->pX = beacon->pX;
+			state->pY = beacon->pY;
+			state->room = beacon->room;
+			state->floor = beacon->floor;
+			state->group = beacon->group;
 		}
-//		fprintf(g_out,",\"Fx\":%1.1f,\"Fy\":%1.1f", dx, dy);
+		else
+			if(state->fixed)
+			{
+				/* no longer fixed - locate from its last position */
+				state->fixed = state->visible = false;
+				state->located = true;
+			}
 	}
-	tag->visible = tag->fixed || (tag->Fcount>0);
 
-	fprintf(g_out,"}");
+	state->generation = g_generation;
+	state->near_power = -INFINITY;
+	state->index = state->fixed ? -1 :
+		localize_tag(&g_localize, state->pX, state->pY, state->located);
+	return state;
 }
 
 static void
-thread_reset_tag (void *Context, double timestamp, bool realtime)
+estimation_tag (TSnapshot *part, const TTagItem *tag, TTagState *state, double timestamp)
 {
-	TTagItem *tag = (TTagItem*)Context;
+	int i, delta, kind, px, py;
+	bool button, changed;
+	TTagSnapshot *snap;
+	const TLayoutItem *reader;
+
+	/* pick up solution of this step */
+	state->visible = state->fixed;
+	if((state->index>=0) && g_localize.count[state->index])
+	{
+		state->pX = g_localize.x[state->index];
+		state->pY = g_localize.y[state->index];
+		state->located = state->visible = true;
+	}
+
+	/* without nearby fixed beacon use room of the first known reader
+	 * which relayed the latest transmission */
+	if(!state->fixed && (state->near_power == -INFINITY))
+		for(i=0; i<tag->reader_count; i++)
+			if((reader = layout_find(g_layout, LAYOUT_READER, tag->reader_id[i])) != NULL)
+			{
+				state->room = reader->room;
+				state->floor = reader->floor;
+				state->group = reader->group;
+				break;
+			}
 
-	tag->Fx = tag->Fy = 0;
-	tag->Fcount = 0;
+	/* calculate delta time since last sighting - expired ? */
+	delta = timestamp - tag->last_seen;
+	if (delta >= TAGAGGREGATION_TIME)
+	{
+		if(state->reported)
+		{
+			snap = snapshot_tag(part, SNAPSHOT_REMOVE, tag->tag_id);
+			snap->group = state->group;
+		}
+		state->reported = false;
+		return;
+	}
+
+	px = (int)state->pX;
+	py = (int)state->pY;
+	button = (timestamp - tag->button_time)<=TAGBUTTON_TIME;
+	changed = !state->reported || tag->dirty ||
+		(button != state->snap_button) ||
+		(state->visible != state->snap_visible) ||
+		(state->room != state->snap_room) ||
+		(state->visible && ((px != state->snap_px) || (py != state->snap_py)));
+
+	/* every tag is recorded, delta output picks the changed ones */
+	kind = ((g_snap->type == SNAPSHOT_DELTA) && !state->reported) ?
+		SNAPSHOT_INSERT : SNAPSHOT_UPDATE;
+	snap = snapshot_tag(part, kind, tag->tag_id);
+	snap->age = delta;
+	snap->angle = tag->angle;
+	snap->voltage = tag->voltage;
+	snap->button = button;
+	snap->fixed = state->fixed;
+	snap->visible = state->visible;
+	snap->px = px;
+	snap->py = py;
+	snap->room = state->room;
+	snap->floor = state->floor;
+	snap->group = state->group;
+	snap->changed = changed;
+
+	state->reported = true;
+	state->snap_button = button;
+	state->snap_visible = state->visible;
+	state->snap_px = px;
+	state->snap_py = py;
+	state->snap_room = state->room;
 }
 
-static void thread_update_tag_speed(TTagItem *tag, const TTagItem *beacon, double power)
+/* range in meters from uncalibrated received power */
+static double
+estimation_range (double power)
 {
-	double dX, dY, dist;
-
-	/* calculate force unity vector */
-	dX = beacon->pX - tag->pX;
-	dY = beacon->pY - tag->pY;
-	dist = sqrt(dX*dX + dY*dY);
+	return pow(10, (LOCALIZE_RSSI_1M - power)/(10*g_distance.exponent));
+}
 
-	if(dist>0.1)
-	{
-		dX /= dist;
-		dY /= dist;
-	}
+static TTagState *
+estimation_find_tag (uint32_t tag_id)
+{
+	TTagState *state;
 
-	/* simple power multilateration - FIXME! */
-	power = fabs(power);
-	if(power <= 40)
-		power = 1;
-	else
-	{
-		power -= 39;
-		if(power > 40)
-			power = 40;
-		power = 40 - power;
-	}
+	/* only tags present in this estimation step */
+	state = (TTagState*)g_map_tag_state.Find(tag_id, NULL);
+	return (state && (state->generation == g_generation)) ? state : NULL;
+}
 
-	/* register power */
-	tag->Fx += dX * power;
-	tag->Fy += dY * power;
-	tag->Fcount++;
+/* state lookup stays serial - allocation order decides the order
+ * of removal records */
+static TEdgeState *
+estimation_edge_state (const TTagProximity *prox)
+{
+	TEdgeState *state;
+
+	if((state = (TEdgeState*)g_map_edge_state.Add(
+		(((uint64_t) prox->tag1) << 32) | prox->tag2, NULL))==NULL)
+		diep("can't add edge state");
+	state->tag1 = prox->tag1;
+	state->tag2 = prox->tag2;
+	return state;
 }
 
 static void
-thread_iterate_prox (void *Context, double timestamp, bool realtime)
+estimation_prox (TEstimationWorker *worker, const TTagProximity *prox,
+	TEdgeState *state, double timestamp)
 {
-	double weigth, totalp, totald, power;
-	int i, j, count, delta;
+	double weigth, totalp, totald, power, range;
+	int i, j, count, delta, kind;
+	bool changed;
 	uint32_t dist;
-	TTagProximitySlot *slot;
-	TTagProximity *prox = (TTagProximity*)Context;
-
-	/* ignore empty slots */
-	if(!prox->last_seen)
-		return;
+	const TTagProximitySlot *slot;
+	TTagState *tag1, *tag2;
+	TEstimationObservation *obs;
+	TEdgeSnapshot *snap;
 
-	/* calculate delta time since last sighting - expired ? */
 	delta = timestamp - prox->last_seen;
-	if (delta >= PROXAGGREGATION_TIME)
-	{
-		prox->last_seen = prox->fifo_pos = 0;
-		bzero(&prox->fifo, sizeof(prox->fifo));
-		return;
-	}
 
 	dist = 0;
 	count = 0;
@@ -526,103 +1248,558 @@ thread_iterate_prox (void *Context, double timestamp, bool realtime)
 		}
 	}
 
-	/* ignore empty sets */
+	/* ignore empty sets - edge state expires */
 	if(!count)
 		return;
 
 	/* normalize data */
 	power/=totalp;
 
-	/* update delta-Velocity */
-	if(prox->tag1p && prox->tag2p)
+	/* range observation of a mobile tag to a fixed beacon, tag
+	 * state is updated when merging the worker output */
+	if(((tag1 = estimation_find_tag(prox->tag1)) != NULL) &&
+		((tag2 = estimation_find_tag(prox->tag2)) != NULL) &&
+		(tag1->fixed != tag2->fixed))
 	{
-		if(prox->tag1p->fixed && !prox->tag2p->fixed)
-			thread_update_tag_speed(prox->tag2p, prox->tag1p, power);
-		else
-			if(!prox->tag1p->fixed && prox->tag2p->fixed)
-				thread_update_tag_speed(prox->tag1p, prox->tag2p, power);
+		if(worker->obs_count == worker->obs_size)
+			worker->obs = (TEstimationObservation*)estimation_grow(worker->obs,
+				&worker->obs_size, sizeof(TEstimationObservation));
+		obs = &worker->obs[worker->obs_count++];
+		obs->mobile = tag1->fixed ? tag2 : tag1;
+		obs->beacon = tag1->fixed ? tag1 : tag2;
+		range = ((totald>0) ? (dist/totald)/1000.0 : estimation_range(power))
+			* LOCALIZE_SCALE;
+		/* RSSI noise makes range variance grow with range squared */
+		obs->range = range;
+		obs->weight = count/(range*range + 1);
+		obs->power = power;
 	}
 
-	fprintf(g_out,"%s\n    {\"tag\":[%u,%u],\"age\":%i,\"count\":%u,\"power\":%1.1f",
-		g_first ? "":",",
-		prox->tag1,
-		prox->tag2,
-		delta,
-		count,
-		power
-	);
-	g_first = false;
+	state->generation = g_generation;
 
-	if(totald>0)
-		fprintf(g_out,",\"dist\":%1.1f", (dist/totald)/1000.0);
+	changed = !state->reported || prox->dirty || (count != state->snap_count);
 
-	fprintf(g_out,"}");
+	/* every edge is recorded, delta output picks the changed ones */
+	kind = ((g_snap->type == SNAPSHOT_DELTA) && !state->reported) ?
+		SNAPSHOT_INSERT : SNAPSHOT_UPDATE;
+	state->reported = true;
+	state->snap_count = count;
+
+	snap = snapshot_edge(&worker->part, kind, prox->tag1, prox->tag2);
+	snap->changed = changed;
+	snap->age = delta;
+	snap->count = count;
+	snap->power = power;
+	snap->has_dist = totald>0;
+	snap->dist = snap->has_dist ? (dist/totald)/1000.0 : 0;
+}
+
+static TEstimationWorker *
+estimation_chunk_begin (int worker, int chunk)
+{
+	TEstimationWorker *output = &g_estimation_worker[worker];
+	TEstimationChunk *slice = &g_estimation_chunk[chunk];
+
+	slice->worker = output;
+	slice->tag_first = output->part.tag_count;
+	slice->edge_first = output->part.edge_count;
+	slice->obs_first = output->obs_count;
+	return output;
+}
+
+static void
+estimation_chunk_end (TEstimationWorker *output, int chunk)
+{
+	TEstimationChunk *slice = &g_estimation_chunk[chunk];
+
+	slice->tag_count = output->part.tag_count - slice->tag_first;
+	slice->edge_count = output->part.edge_count - slice->edge_first;
+	slice->obs_count = output->obs_count - slice->obs_first;
+}
+
+static void
+estimation_prox_task (void *context, int worker, int chunk, int first, int last)
+{
+	int i;
+	TEstimationWorker *output;
+
+	output = estimation_chunk_begin(worker, chunk);
+	for(i=first; i<last; i++)
+		estimation_prox(output, &g_copy_prox[i], g_copy_edge_state[i],
+			*(double*)context);
+	estimation_chunk_end(output, chunk);
+}
+
+static void
+estimation_tag_task (void *context, int worker, int chunk, int first, int last)
+{
+	int i;
+	TEstimationWorker *output;
+
+	output = estimation_chunk_begin(worker, chunk);
+	for(i=first; i<last; i++)
+		estimation_tag(&output->part, &g_copy_tag[i], g_copy_tag_state[i],
+			*(double*)context);
+	estimation_chunk_end(output, chunk);
+}
+
+/* reduce worker output in chunk order - the result does not depend
+ * on which worker processed a chunk */
+static void
+estimation_merge (int chunks)
+{
+	int i, j;
+	const TEstimationChunk *slice;
+	const TEstimationObservation *obs;
+	TTagState *mobile;
+
+	for(i=0, slice=g_estimation_chunk; i<chunks; i++, slice++)
+	{
+		snapshot_append_tags(g_snap, &slice->worker->part.tag[slice->tag_first],
+			slice->tag_count);
+		snapshot_append_edges(g_snap, &slice->worker->part.edge[slice->edge_first],
+			slice->edge_count);
+
+		obs = &slice->worker->obs[slice->obs_first];
+		for(j=0; j<slice->obs_count; j++, obs++)
+		{
+			mobile = obs->mobile;
+			localize_observe(&g_localize, mobile->index, obs->beacon->pX,
+				obs->beacon->pY, obs->range, obs->weight);
+
+			/* mobile tag is in the room of its strongest fixed beacon */
+			if(obs->power > mobile->near_power)
+			{
+				mobile->near_power = obs->power;
+				mobile->room = obs->beacon->room;
+				mobile->floor = obs->beacon->floor;
+				mobile->group = obs->beacon->group;
+			}
+		}
+	}
+}
+
+/* run one estimation pass over 'count' items on the worker pool */
+static void
+estimation_parallel (TPoolTask task, double timestamp, int count)
+{
+	int i, chunks;
+	TEstimationWorker *output;
+
+	chunks = pool_chunks(count);
+	while(chunks > g_estimation_chunk_size)
+		g_estimation_chunk = (TEstimationChunk*)estimation_grow(g_estimation_chunk,
+			&g_estimation_chunk_size, sizeof(TEstimationChunk));
+
+	for(i=0, output=g_estimation_worker; i<pool_workers(); i++, output++)
+		output->part.tag_count = output->part.edge_count = output->obs_count = 0;
+
+	pool_run(task, &timestamp, count);
+	estimation_merge(chunks);
+}
+
+/* feed sightings of this step to the contact engine, oldest first */
+static void
+estimation_contacts (void)
+{
+	int i, j;
+	uint32_t group1, group2;
+	const TTagProximity *prox;
+	const TTagProximitySlot *slot;
+	TTagState *state;
+
+	for(i=0, prox=g_copy_prox; i<g_copy_prox_count; i++, prox++)
+	{
+		if(!prox->fresh)
+			continue;
+
+		state = estimation_find_tag(prox->tag1);
+		group1 = state ? state->group : 0;
+		state = estimation_find_tag(prox->tag2);
+		group2 = state ? state->group : 0;
+
+		for(j=prox->fresh; j>0; j--)
+		{
+			slot = &prox->fifo[(prox->fifo_pos + MAX_PROXIMITY_SLOTS - j) % MAX_PROXIMITY_SLOTS];
+			if(slot->last_seen)
+				contact_sample(prox->tag1, prox->tag2, group1, group2,
+					slot->last_seen, slot->power);
+		}
+	}
+}
+
+/* private state of tags and edges which left the ingest maps */
+static bool
+estimation_expire_tag (void *Context, double timestamp)
+{
+	return ((TTagState*)Context)->generation != g_generation;
+}
+
+static bool
+estimation_expire_edge (void *Context, double timestamp)
+{
+	return ((TEdgeState*)Context)->generation != g_generation;
+}
+
+static void
+estimation_archive_tag (void *Context, double timestamp, bool realtime)
+{
+	TTagState *state = (TTagState*)Context;
+
+	if(state->reported)
+		snapshot_tag(g_snap, SNAPSHOT_REMOVE, state->tag_id)->group =
+			state->group;
+}
+
+static void
+estimation_archive_edge (void *Context, double timestamp, bool realtime)
+{
+	TEdgeState *state = (TEdgeState*)Context;
+
+	if(state->reported)
+		snapshot_edge(g_snap, SNAPSHOT_REMOVE, state->tag1, state->tag2);
+}
+
+/* groups of both edge tags - filter criteria of change streams */
+static void
+estimation_edge_groups (void)
+{
+	int i;
+	TTagState *state;
+	TEdgeSnapshot *edge;
+
+	for(i=0, edge=g_snap->edge; i<g_snap->edge_count; i++, edge++)
+	{
+		state = (TTagState*)g_map_tag_state.Find(edge->tag1, NULL);
+		edge->group1 = state ? state->group : 0;
+		state = (TTagState*)g_map_tag_state.Find(edge->tag2, NULL);
+		edge->group2 = state ? state->group : 0;
+	}
+}
+
+static bool
+thread_expire_reader (void *Context, double timestamp)
+{
+	TReaderItem *reader = (TReaderItem*)Context;
+
+	return (timestamp - reader->last_seen) >= READER_EXPIRY_TIME;
+}
+
+static bool
+thread_expire_tag (void *Context, double timestamp)
+{
+	TTagItem *tag = (TTagItem*)Context;
+
+	return (timestamp - tag->last_seen) >= TAG_EXPIRY_TIME;
+}
+
+static bool
+thread_expire_prox (void *Context, double timestamp)
+{
+	TTagProximity *prox = (TTagProximity*)Context;
+
+	return (timestamp - prox->last_seen) >= PROX_EXPIRY_TIME;
 }
 
 void
 thread_estimation_step (FILE *out, double timestamp, bool realtime)
 {
+	int i;
+	uint64_t start;
 	static uint32_t sequence = 0;
+	static double expiry = 0;
 
 	if (realtime)
 		usleep (200 * 1000);
+	start = metrics_clock ();
 
-	/* tracking dump state in JSON format */
-	fprintf (out, "{\n  \"id\":%u,\n"
-			"  \"api\":{\"name\":\"" PROGRAM_NAME "\",\"ver\":\""
-			PROGRAM_VERSION "\"},\n" "  \"time\":%u,\n  \"edge\":[",
-			sequence++, (uint32_t) timestamp);
+	/* event time mode - windows close on the watermark */
+	if (reorder_enabled ())
+	{
+		reorder_drain (timestamp, true);
+		timestamp = reorder_watermark (timestamp);
+	}
 
-	g_out = out;
+	if (!g_json.data)
+	{
+		json_init (&g_json, SNAPSHOT_JSON_SIZE);
+		json_init (&g_json_full, SNAPSHOT_JSON_SIZE);
+	}
 
-	/* reset all tags */
-	g_first = true;
-	g_map_tag.IterateLocked (&thread_reset_tag, timestamp, realtime);
+	/* copy ingest state, holding each stripe lock only briefly */
+	g_copy_tag_count = g_copy_prox_count = 0;
+	g_map_tag.IterateLocked (&thread_copy_tag, timestamp, realtime);
+	g_map_proximity.IterateLocked (&thread_copy_prox, timestamp, realtime);
+
+	/* full snapshot unless in delta mode between keyframes */
+	g_snap = snapshot_begin (sequence, timestamp, !g_delta_keyframe ?
+		SNAPSHOT_FULL : (sequence % g_delta_keyframe) ?
+		SNAPSHOT_DELTA : SNAPSHOT_KEYFRAME);
+	sequence++;
+	g_generation++;
+	g_map_reader.IterateLocked (&thread_copy_reader, timestamp, realtime);
+
+	/* pick up layout changes between steps */
+	layout_poll (timestamp);
+	g_layout = layout_current ();
+
+	/* collect range observations along edges, then locate all
+	 * mobile tags in one batch */
+	localize_reset (&g_localize);
+	for (i = 0; i < g_copy_tag_count; i++)
+		g_copy_tag_state[i] = estimation_tag_state (g_copy_tag[i].tag_id);
+	for (i = 0; i < g_copy_prox_count; i++)
+		g_copy_edge_state[i] = estimation_edge_state (&g_copy_prox[i]);
+	estimation_parallel (&estimation_prox_task, timestamp, g_copy_prox_count);
+	localize_solve (&g_localize);
+	estimation_parallel (&estimation_tag_task, timestamp, g_copy_tag_count);
+
+	/* contact intervals of tag pairs */
+	if (contact_active ())
+	{
+		estimation_contacts ();
+		contact_step (g_snap->sequence, timestamp);
+	}
+
+	/* drop state of vanished edges and tags */
+	g_map_edge_state.Expire (&estimation_expire_edge, timestamp);
+	if (stream_active ())
+		estimation_edge_groups ();
+	g_map_tag_state.Expire (&estimation_expire_tag, timestamp);
+
+	/* format and publish result - change events first as both
+	 * share the wakeup of the HTTP server */
+	snapshot_format (&g_json, g_snap, g_snap->type);
+	stream_publish (g_snap);
+	if (g_snap->type != SNAPSHOT_DELTA)
+		http_publish (g_snap->sequence, g_json.data, g_json.len);
+	else if (http_active ())
+	{
+		snapshot_format (&g_json_full, g_snap, SNAPSHOT_FULL);
+		http_publish (g_snap->sequence, g_json_full.data, g_json_full.len);
+	}
+	snapshot_publish (g_snap);
+	metrics_record (METRIC_STAGE_PUBLISH, metrics_clock () - start);
+	metrics_published ();
 
-	/* display all edges */
-	g_first = true;
-	g_map_proximity.IterateLocked (&thread_iterate_prox, timestamp, realtime);
+	/* propagate object on stdout in one go */
+	fflush (out);
+	if (!json_write (&g_json, fileno (out)))
+		diep ("json_write");
 
-	/* display all tags */
-	g_first = true;
-	g_map_tag.IterateLocked (&thread_iterate_tag, timestamp, realtime);
+	/* evict stale entries - edges first as they point to tags */
+	if ((timestamp - expiry) >= EXPIRY_INTERVAL)
+	{
+		expiry = timestamp;
+		g_map_proximity.Expire (&thread_expire_prox, timestamp);
+		g_map_tag.Expire (&thread_expire_tag, timestamp);
+		g_map_reader.Expire (&thread_expire_reader, timestamp);
+	}
 
-	fprintf (out, "\n  ]\n},");
+	/* records stay buffered when traffic stops */
+	journal_sync (timestamp);
 
-	/* propagate object on stdout */
-	fflush (out);
+	/* aggregated error counts and optional summary on stderr */
+	metrics_report ();
 }
 
-int
-main (int argc, char **argv)
+void
+tracking_init (void)
 {
-	int mode;
-
-	/* initialize statistics */
-	g_unknown_reader = 0;
-	g_decrypted_one = 0;
-	g_total_crc_ok = g_total_crc_errors = 0;
-	g_doubled_reader = 0;
-	g_ignored_protocol = g_invalid_protocol = 0;
-
+	g_map_reader.SetItemSize (sizeof (TReaderItem));
 	g_map_tag.SetItemSize (sizeof (TTagItem));
 	g_map_proximity.SetItemSize (sizeof (TTagProximity));
+	g_map_tag_state.SetItemSize (sizeof (TTagState));
+	g_map_edge_state.SetItemSize (sizeof (TEdgeState));
+	g_map_tag_state.SetArchiveCallback (&estimation_archive_tag);
+	g_map_edge_state.SetArchiveCallback (&estimation_archive_edge);
+	metrics_map ("reader", &g_map_reader);
+	metrics_map ("tag", &g_map_tag);
+	metrics_map ("proximity", &g_map_proximity);
+	metrics_map ("tag_state", &g_map_tag_state);
+	metrics_map ("edge_state", &g_map_edge_state);
 
 	/* initialize encryption */
 	aes_init();
 
+	/* default to free space path loss */
+	distance_init (&g_distance, DISTANCE_FREE_SPACE, 2.0, DISTANCE_FREQUENCY);
+}
+
+/* the benchmark links the tracker with its own main */
+#ifndef BENCHMARK
+static void
+usage (const char *name)
+{
+	fprintf (stderr,
+		"usage: %s [options] [capture [mode]]\n"
+		"  -w workers   number of UDP receive threads (default 1)\n"
+		"  -c cpu,...   pin receive threads to the listed CPUs\n"
+		"  -n workers   number of estimation threads (default 1)\n"
+		"  -r bytes     socket receive buffer size\n"
+		"  -k file      key ring with site keys and reader routes\n"
+		"  -d steps     delta snapshots, full keyframe every 'steps'\n"
+		"  -j dir       append authentic sightings to journal segments\n"
+		"  -l file      reader and beacon layout, reloaded on SIGHUP\n"
+		"               or when modified\n"
+		"  -p listen    serve snapshots over HTTP on 'port', 'address:port'\n"
+		"               or 'unix:/path', long-poll with '/?wait=sequence',\n"
+		"               change events on '/events?tag=id,..&group=g,..\n"
+		"               &power=dBm&type=tag,edge,contact', metrics on\n"
+		"               '/metrics'\n"
+		"  -i seconds   print metrics summary every 'seconds'\n"
+		"  -t seconds   event time - order records by reader clock and\n"
+		"               close windows 'seconds' behind the receive clock\n"
+		"  -o file      append contact start and end events as JSON lines\n"
+		"  -x gap,duration[,dBm]\n"
+		"               contact intervals - end after 'gap' seconds without\n"
+		"               sighting, report if lasting 'duration' seconds,\n"
+		"               ignore sightings below 'dBm' (default 20,20)\n"
+		"  -m model     distance model, 'free' space (default) or\n"
+		"               'exp:N' log-distance with path loss exponent N\n"
+		"  -s, --speed Nx\n"
+		"               replay capture at N times its speed, 'max' for\n"
+		"               full speed (default)\n"
+		"  -b, --start time\n"
+		"  -e, --stop time\n"
+		"               replay records from/until unix time, or '+seconds'\n"
+		"               relative to the first record\n"
+		"  capture      pcap or pcapng file with Ethernet, VLAN, Linux\n"
+		"               cooked or raw IP frames, journal segment or\n"
+		"               journal directory\n"
+		"  mode 0/2     replay capture, 2 listens afterwards\n"
+		"  mode 1       replay capture in realtime, same as --speed 1x\n",
+		name);
+	exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+	int mode, opt;
+	char *end;
+	const char *layout;
+	TNetworkConfig network;
+	TReplayConfig replay;
+	static const struct option options[] = {
+		{"speed", required_argument, NULL, 's'},
+		{"start", required_argument, NULL, 'b'},
+		{"stop", required_argument, NULL, 'e'},
+		{NULL, 0, NULL, 0}
+	};
+
+	tracking_init ();
+
+	/* parse options */
+	network_config_init (&network);
+	replay_config_init (&replay);
+	layout = NULL;
+	while ((opt = getopt_long (argc, argv, "w:c:n:r:k:d:i:j:l:m:o:p:s:b:e:t:x:h",
+		options, NULL)) != -1)
+		switch (opt)
+		{
+			case 'w':
+				network.workers = atoi (optarg);
+				if ((network.workers < 1) ||
+					(network.workers > NETWORK_MAX_WORKERS))
+					usage (argv[0]);
+				break;
+			case 'c':
+				if (!network_config_cpus (&network, optarg))
+					usage (argv[0]);
+				break;
+			case 'n':
+				if (!pool_init (atoi (optarg)))
+					usage (argv[0]);
+				break;
+			case 'r':
+				network.rcvbuf = atoi (optarg);
+				break;
+			case 'p':
+				if (!http_start (optarg))
+					exit (EXIT_FAILURE);
+				break;
+			case 's':
+				if (!replay_config_speed (&replay, optarg))
+					usage (argv[0]);
+				break;
+			case 'b':
+				if (!replay_config_time (optarg, &replay.start,
+					&replay.start_relative))
+					usage (argv[0]);
+				break;
+			case 'e':
+				if (!replay_config_time (optarg, &replay.stop,
+					&replay.stop_relative))
+					usage (argv[0]);
+				break;
+			case 'j':
+				if (!journal_open (optarg))
+					exit (EXIT_FAILURE);
+				break;
+			case 'l':
+				layout = optarg;
+				break;
+			case 'o':
+				if (!contact_open (optarg))
+					exit (EXIT_FAILURE);
+				break;
+			case 'x':
+				if (!contact_config (optarg))
+					usage (argv[0]);
+				break;
+			case 'm':
+				if (!distance_parse (&g_distance, optarg, DISTANCE_FREQUENCY))
+					usage (argv[0]);
+				fprintf (stderr, "distance: %s model, path loss exponent %.1f\n",
+						 distance_name (&g_distance), g_distance.exponent);
+				break;
+			case 'd':
+				if ((g_delta_keyframe = atoi (optarg)) < 1)
+					usage (argv[0]);
+				break;
+			case 'k':
+				if (!keyring_load (optarg))
+					exit (EXIT_FAILURE);
+				break;
+			case 'i':
+				if ((opt = atoi (optarg)) < 1)
+					usage (argv[0]);
+				metrics_summary (opt);
+				break;
+			case 't':
+				if (!reorder_init (strtod (optarg, &end), &parse_released) ||
+					(end == optarg) || *end)
+					usage (argv[0]);
+				break;
+			default:
+				usage (argv[0]);
+		}
+	argc -= optind;
+	argv += optind;
+
+	/* compiled-in beacon positions unless a layout file is given */
+	if (!layout_load (layout))
+		exit (EXIT_FAILURE);
+	if (layout)
+		signal (SIGHUP, &layout_signal);
+
 	/* check command line arguments */
-	if (argc <= 1)
-		return listen_packets (stdout);
+	if (argc < 1)
+		return listen_packets (stdout, &network);
 	else
 	{
-		mode = (argc >= 3) ? atoi (argv[2]) : 0;
+		mode = (argc >= 2) ? atoi (argv[1]) : 0;
 
-		/* mode one means realtime replay, zero or two maximum speed */
-		parse_pcap (argv[1], mode == 1);
+		/* mode one means realtime replay */
+		if ((mode == 1) && !replay.speed)
+			replay.speed = 1;
+		parse_pcap (argv[0], &replay);
 
 		/* if mode is two, then start listening */
 		if(mode == 2)
-			listen_packets (stdout);
+			listen_packets (stdout, &network);
 	}
+	return 0;
 }
+#endif/*BENCHMARK*/
@@ -27,7 +27,13 @@
 #ifndef __MAIN_H__
 #define __MAIN_H__
 
+/* requires crypto.h for the protocol structures */
+extern void tracking_init (void);
+extern bool process_packet (double timestamp, uint32_t reader_id,
+	const TBeaconNgTracker &track);
 extern void thread_estimation_step (FILE *out, double timestamp, bool realtime);
 extern int parse_packet (double timestamp, uint32_t reader_id, const void *data, int len);
+extern void parse_batch (double timestamp, int count, const uint32_t *reader_id,
+	const uint8_t *const *data, const int *len);
 
 #endif/*__MAIN_H__*/
\ No newline at end of file
@@ -0,0 +1,786 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "helper.h"
+#include "json.h"
+#include "snapshot.h"
+#include "crypto.h"
+#include "reorder.h"
+#include "bmMapHandleToItem.h"
+#include "metrics.h"
+
+typedef struct
+{
+	uint64_t counter[METRIC_COUNTERS];
+	TMetricsHistogram stage[METRIC_STAGES];
+} TMetricsTotals;
+
+typedef struct
+{
+	uint32_t ip;
+	uint64_t records, errors;
+} TMetricsReaderTotal;
+
+typedef struct
+{
+	int count, size;
+	TMetricsReaderTotal *reader;
+} TMetricsReaders;
+
+typedef struct
+{
+	const char *name;
+	bmMapHandleToItem *map;
+} TMetricsMap;
+
+static const char *g_metrics_outcome[METRIC_OUTCOMES] = {
+	"sighting", "status", "duplicate", "truncated", "invalid_protocol",
+	"invalid_size", "crc_error", "decrypt_error", "unknown_protocol",
+	"replayed"
+};
+
+static const char *g_metrics_stage[METRIC_STAGES] = {
+	"parse", "decrypt", "process", "publish", "latency"
+};
+
+__thread TMetricsThread *g_metrics_self;
+/* threads are registered once and never leave */
+static TMetricsThread *g_metrics_threads;
+static pthread_mutex_t g_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_metrics_maps;
+static TMetricsMap g_metrics_map[METRICS_MAPS];
+static int g_metrics_interval;
+
+TMetricsThread *
+metrics_register (void)
+{
+	TMetricsThread *t;
+
+	if ((t = (TMetricsThread *) calloc (1, sizeof (TMetricsThread))) == NULL)
+		diep ("metrics_register");
+
+	pthread_mutex_lock (&g_metrics_mutex);
+	t->next = g_metrics_threads;
+	__atomic_store_n (&g_metrics_threads, t, __ATOMIC_RELEASE);
+	pthread_mutex_unlock (&g_metrics_mutex);
+
+	return g_metrics_self = t;
+}
+
+static inline int
+metrics_bucket (uint64_t value)
+{
+	int k;
+
+	if (value < METRICS_HIST_SUB)
+		return value;
+	k = 63 - __builtin_clzll (value);
+	if (k >= METRICS_HIST_MAGNITUDE)
+		return METRICS_HIST_BUCKETS - 1;
+	return ((k - METRICS_HIST_SUB_BITS + 1) << METRICS_HIST_SUB_BITS) +
+		((value >> (k - METRICS_HIST_SUB_BITS)) & (METRICS_HIST_SUB - 1));
+}
+
+/* exclusive upper bound of a bucket */
+static uint64_t
+metrics_bucket_limit (int bucket)
+{
+	int k;
+
+	if (bucket < METRICS_HIST_SUB)
+		return bucket + 1;
+	k = (bucket >> METRICS_HIST_SUB_BITS) + METRICS_HIST_SUB_BITS - 1;
+	return ((uint64_t) (METRICS_HIST_SUB + (bucket & (METRICS_HIST_SUB - 1)))
+			+ 1) << (k - METRICS_HIST_SUB_BITS);
+}
+
+void
+metrics_record (int stage, uint64_t ns)
+{
+	TMetricsHistogram *hist = &metrics_self ()->stage[stage];
+
+	metrics_add (&hist->bucket[metrics_bucket (ns)], 1);
+	metrics_add (&hist->count, 1);
+	metrics_add (&hist->sum, ns);
+	if (ns > hist->max)
+		__atomic_store_n (&hist->max, ns, __ATOMIC_RELAXED);
+}
+
+void
+metrics_reader (uint32_t reader_ip, bool valid)
+{
+	int i;
+	uint32_t pos;
+	uint64_t key;
+	TMetricsReader *slot;
+	TMetricsThread *t = metrics_self ();
+
+	key = (uint64_t) reader_ip + 1;
+	pos = (reader_ip * 0x9E3779B1UL) & (METRICS_READERS - 1);
+	for (i = 0; i < METRICS_READERS; i++)
+	{
+		slot = &t->reader[pos];
+		if (slot->key != key)
+		{
+			if (slot->key)
+			{
+				pos = (pos + 1) & (METRICS_READERS - 1);
+				continue;
+			}
+			__atomic_store_n (&slot->key, key, __ATOMIC_RELEASE);
+		}
+		metrics_add (valid ? &slot->records : &slot->errors, 1);
+		return;
+	}
+}
+
+void
+metrics_received (uint64_t ns)
+{
+	uint64_t expected = 0;
+	TMetricsThread *t = metrics_self ();
+
+	/* the estimation thread may clear pending concurrently - only
+	 * set it while it is clear, never overwrite an older time */
+	__atomic_compare_exchange_n (&t->pending, &expected, ns, false,
+								 __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void
+metrics_published (void)
+{
+	uint64_t now, pending, oldest;
+	TMetricsThread *t;
+
+	now = metrics_clock ();
+	oldest = 0;
+	for (t = __atomic_load_n (&g_metrics_threads, __ATOMIC_ACQUIRE); t;
+		 t = t->next)
+		if (((pending = __atomic_exchange_n (&t->pending, 0,
+											 __ATOMIC_RELAXED)) != 0) &&
+			(!oldest || (pending < oldest)))
+			oldest = pending;
+
+	if (oldest && (now > oldest))
+		metrics_record (METRIC_STAGE_LATENCY, now - oldest);
+	metrics_count (METRIC_SNAPSHOTS, 1);
+}
+
+void
+metrics_map (const char *name, bmMapHandleToItem * map)
+{
+	if (g_metrics_maps < METRICS_MAPS)
+	{
+		g_metrics_map[g_metrics_maps].name = name;
+		g_metrics_map[g_metrics_maps].map = map;
+		g_metrics_maps++;
+	}
+}
+
+static void
+metrics_counters (uint64_t * counter)
+{
+	int i;
+	TMetricsThread *t;
+
+	memset (counter, 0, METRIC_COUNTERS * sizeof (uint64_t));
+	for (t = __atomic_load_n (&g_metrics_threads, __ATOMIC_ACQUIRE); t;
+		 t = t->next)
+		for (i = 0; i < METRIC_COUNTERS; i++)
+			counter[i] += __atomic_load_n (&t->counter[i], __ATOMIC_RELAXED);
+}
+
+static void
+metrics_sum (TMetricsTotals * totals)
+{
+	int i, j;
+	uint64_t max;
+	TMetricsThread *t;
+	TMetricsHistogram *hist;
+	const TMetricsHistogram *src;
+
+	memset (totals->stage, 0, sizeof (totals->stage));
+	metrics_counters (totals->counter);
+	for (t = __atomic_load_n (&g_metrics_threads, __ATOMIC_ACQUIRE); t;
+		 t = t->next)
+		for (i = 0; i < METRIC_STAGES; i++)
+		{
+			hist = &totals->stage[i];
+			src = &t->stage[i];
+			for (j = 0; j < METRICS_HIST_BUCKETS; j++)
+				hist->bucket[j] +=
+					__atomic_load_n (&src->bucket[j], __ATOMIC_RELAXED);
+			hist->count += __atomic_load_n (&src->count, __ATOMIC_RELAXED);
+			hist->sum += __atomic_load_n (&src->sum, __ATOMIC_RELAXED);
+			if ((max = __atomic_load_n (&src->max, __ATOMIC_RELAXED)) >
+				hist->max)
+				hist->max = max;
+		}
+}
+
+static int
+metrics_compare_reader (const void *a, const void *b)
+{
+	uint32_t x = ((const TMetricsReaderTotal *) a)->ip;
+	uint32_t y = ((const TMetricsReaderTotal *) b)->ip;
+
+	return (x > y) - (x < y);
+}
+
+/* per-reader totals of all threads, sorted by address */
+static void
+metrics_sum_readers (TMetricsReaders * readers)
+{
+	int i, n;
+	uint64_t key;
+	TMetricsThread *t;
+	TMetricsReaderTotal *r;
+
+	readers->count = 0;
+	for (t = __atomic_load_n (&g_metrics_threads, __ATOMIC_ACQUIRE); t;
+		 t = t->next)
+		for (i = 0; i < METRICS_READERS; i++)
+			if ((key = __atomic_load_n (&t->reader[i].key,
+										__ATOMIC_ACQUIRE)) != 0)
+			{
+				if (readers->count == readers->size)
+				{
+					readers->size = readers->size ? readers->size * 2 : 64;
+					if ((readers->reader = (TMetricsReaderTotal *)
+						 realloc (readers->reader, readers->size *
+								  sizeof (TMetricsReaderTotal))) == NULL)
+						diep ("metrics_sum_readers");
+				}
+				r = &readers->reader[readers->count++];
+				r->ip = key - 1;
+				r->records = __atomic_load_n (&t->reader[i].records,
+											  __ATOMIC_RELAXED);
+				r->errors = __atomic_load_n (&t->reader[i].errors,
+											 __ATOMIC_RELAXED);
+			}
+
+	/* merge readers served by several threads */
+	if (readers->count)
+		qsort (readers->reader, readers->count,
+			   sizeof (TMetricsReaderTotal), &metrics_compare_reader);
+	for (i = n = 0; i < readers->count; i++)
+		if (n && (readers->reader[n - 1].ip == readers->reader[i].ip))
+		{
+			readers->reader[n - 1].records += readers->reader[i].records;
+			readers->reader[n - 1].errors += readers->reader[i].errors;
+		}
+		else
+			readers->reader[n++] = readers->reader[i];
+	readers->count = n;
+}
+
+static void
+metrics_double (TJsonBuffer * buf, double value)
+{
+	char text[32];
+
+	snprintf (text, sizeof (text), "%.9g", value);
+	json_str (buf, text);
+}
+
+static void
+metrics_header (TJsonBuffer * buf, const char *name, const char *type,
+				const char *help)
+{
+	json_str (buf, "# HELP openbeacon_");
+	json_str (buf, name);
+	json_char (buf, ' ');
+	json_str (buf, help);
+	json_str (buf, "\n# TYPE openbeacon_");
+	json_str (buf, name);
+	json_char (buf, ' ');
+	json_str (buf, type);
+	json_char (buf, '\n');
+}
+
+static void
+metrics_value (TJsonBuffer * buf, const char *name, const char *label,
+			   const char *value, uint64_t count)
+{
+	json_str (buf, "openbeacon_");
+	json_str (buf, name);
+	if (label)
+	{
+		json_char (buf, '{');
+		json_str (buf, label);
+		json_str (buf, "=\"");
+		json_str (buf, value);
+		json_str (buf, "\"}");
+	}
+	json_char (buf, ' ');
+	json_int (buf, count);
+	json_char (buf, '\n');
+}
+
+static void
+metrics_format_histogram (TJsonBuffer * buf, const char *stage,
+						  const TMetricsHistogram * hist)
+{
+	int i, bucket;
+	uint64_t count;
+
+	/* fine buckets fold into power of two bounds from 1us to 64s */
+	count = 0;
+	bucket = 0;
+	for (i = 10; i <= 36; i++)
+	{
+		for (; (bucket < METRICS_HIST_BUCKETS) &&
+			 (metrics_bucket_limit (bucket) <= (1ULL << i)); bucket++)
+			count += hist->bucket[bucket];
+		json_str (buf, "openbeacon_stage_seconds_bucket{stage=\"");
+		json_str (buf, stage);
+		json_str (buf, "\",le=\"");
+		metrics_double (buf, (1ULL << i) * 1e-9);
+		json_str (buf, "\"} ");
+		json_int (buf, count);
+		json_char (buf, '\n');
+	}
+	json_str (buf, "openbeacon_stage_seconds_bucket{stage=\"");
+	json_str (buf, stage);
+	json_str (buf, "\",le=\"+Inf\"} ");
+	json_int (buf, hist->count);
+	json_str (buf, "\nopenbeacon_stage_seconds_sum{stage=\"");
+	json_str (buf, stage);
+	json_str (buf, "\"} ");
+	metrics_double (buf, hist->sum * 1e-9);
+	json_str (buf, "\nopenbeacon_stage_seconds_count{stage=\"");
+	json_str (buf, stage);
+	json_str (buf, "\"} ");
+	json_int (buf, hist->count);
+	json_char (buf, '\n');
+}
+
+static const char *
+metrics_ip (uint32_t ip, char *text, size_t size)
+{
+	snprintf (text, size, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 0xFF,
+			  (ip >> 8) & 0xFF, ip & 0xFF);
+	return text;
+}
+
+/* forwarder link health of the latest snapshot */
+#define METRICS_LINK_LOST 0
+#define METRICS_LINK_REORDERED 1
+#define METRICS_LINK_RESTARTS 2
+#define METRICS_LINK_RATE 3
+#define METRICS_LINK_OFFSET 4
+#define METRICS_LINK_FAMILIES 5
+
+static const char *g_metrics_link[METRICS_LINK_FAMILIES][3] = {
+	{"reader_lost_total", "counter",
+	 "Sequence numbers never received per forwarder link."},
+	{"reader_reordered_total", "counter",
+	 "Records received behind a later sequence number."},
+	{"reader_restarts_total", "counter",
+	 "Forwarder sequence restarts."},
+	{"reader_rate", "gauge", "Smoothed records per second."},
+	{"reader_clock_offset_seconds", "gauge",
+	 "Smoothed forwarder clock minus local clock."}
+};
+
+static void
+metrics_format_links (TJsonBuffer * buf, const TSnapshot * snap)
+{
+	int i, family;
+	char text[32];
+	double value;
+	const TReaderSnapshot *reader;
+
+	for (family = 0; family < METRICS_LINK_FAMILIES; family++)
+	{
+		metrics_header (buf, g_metrics_link[family][0],
+						g_metrics_link[family][1], g_metrics_link[family][2]);
+		for (i = 0, reader = snap->reader; i < snap->reader_count;
+			 i++, reader++)
+		{
+			switch (family)
+			{
+				case METRICS_LINK_LOST:
+					value = reader->lost;
+					break;
+				case METRICS_LINK_REORDERED:
+					value = reader->reordered;
+					break;
+				case METRICS_LINK_RESTARTS:
+					value = reader->restarts;
+					break;
+				case METRICS_LINK_RATE:
+					value = reader->rate;
+					break;
+				default:
+					value = reader->offset;
+			}
+			json_str (buf, "openbeacon_");
+			json_str (buf, g_metrics_link[family][0]);
+			json_str (buf, "{reader=\"");
+			json_str (buf, metrics_ip (reader->reader_ip, text,
+									   sizeof (text)));
+			json_str (buf, "\",id=\"");
+			json_int (buf, reader->reader_id);
+			json_str (buf, "\"} ");
+			metrics_double (buf, value);
+			json_char (buf, '\n');
+		}
+	}
+}
+
+void
+metrics_format (TJsonBuffer * buf)
+{
+	int i;
+	char text[32];
+	bmMapStatistics stats[METRICS_MAPS];
+	TMetricsTotals *totals;
+	TMetricsReaders readers;
+	const TSnapshot *snap;
+
+	/* histograms make the totals too large for the stack */
+	if ((totals = (TMetricsTotals *) malloc (sizeof (*totals))) == NULL)
+		return;
+	metrics_sum (totals);
+
+	metrics_header (buf, "records_total", "counter",
+					"Received records by parse outcome.");
+	for (i = 0; i < METRIC_OUTCOMES; i++)
+		metrics_value (buf, "records_total", "outcome",
+					   g_metrics_outcome[i], totals->counter[i]);
+
+	metrics_header (buf, "datagrams_total", "counter",
+					"Received datagrams.");
+	metrics_value (buf, "datagrams_total", NULL, NULL,
+				   totals->counter[METRIC_DATAGRAMS]);
+	metrics_header (buf, "key_trials_total", "counter",
+					"Records of unrouted readers tried against all keys.");
+	metrics_value (buf, "key_trials_total", NULL, NULL,
+				   totals->counter[METRIC_KEY_TRIAL]);
+	metrics_header (buf, "kernel_drops_total", "counter",
+					"Datagrams dropped by the kernel socket buffer.");
+	metrics_value (buf, "kernel_drops_total", NULL, NULL,
+				   totals->counter[METRIC_KERNEL_DROPS]);
+	metrics_header (buf, "late_records_total", "counter",
+					"Records processed after the watermark passed them.");
+	metrics_value (buf, "late_records_total", NULL, NULL,
+				   totals->counter[METRIC_LATE]);
+	metrics_header (buf, "pending_records", "gauge",
+					"Records waiting for the event time watermark.");
+	metrics_value (buf, "pending_records", NULL, NULL, reorder_pending ());
+	metrics_header (buf, "contacts_total", "counter",
+					"Contact intervals which ended.");
+	metrics_value (buf, "contacts_total", NULL, NULL,
+				   totals->counter[METRIC_CONTACT]);
+	metrics_header (buf, "snapshots_total", "counter",
+					"Published estimation snapshots.");
+	metrics_value (buf, "snapshots_total", NULL, NULL,
+				   totals->counter[METRIC_SNAPSHOTS]);
+
+	memset (&readers, 0, sizeof (readers));
+	metrics_sum_readers (&readers);
+	metrics_header (buf, "reader_records_total", "counter",
+					"Authentic records per reader.");
+	for (i = 0; i < readers.count; i++)
+		metrics_value (buf, "reader_records_total", "reader",
+					   metrics_ip (readers.reader[i].ip, text, sizeof (text)),
+					   readers.reader[i].records);
+	metrics_header (buf, "reader_errors_total", "counter",
+					"Rejected records per reader.");
+	for (i = 0; i < readers.count; i++)
+		metrics_value (buf, "reader_errors_total", "reader",
+					   metrics_ip (readers.reader[i].ip, text, sizeof (text)),
+					   readers.reader[i].errors);
+	free (readers.reader);
+
+	if ((snap = snapshot_acquire ()) != NULL)
+	{
+		metrics_format_links (buf, snap);
+		snapshot_release (snap);
+	}
+
+	/* samples of one family must not interleave with others */
+	for (i = 0; i < g_metrics_maps; i++)
+		g_metrics_map[i].map->GetStatistics (&stats[i]);
+	metrics_header (buf, "map_items", "gauge", "Live items per map.");
+	for (i = 0; i < g_metrics_maps; i++)
+		metrics_value (buf, "map_items", "map", g_metrics_map[i].name,
+					   stats[i].items);
+	metrics_header (buf, "map_index_slots", "gauge",
+					"Hash index slots per map.");
+	for (i = 0; i < g_metrics_maps; i++)
+		metrics_value (buf, "map_index_slots", "map", g_metrics_map[i].name,
+					   stats[i].slots);
+	metrics_header (buf, "map_probe_max", "gauge",
+					"Longest probe sequence per map.");
+	for (i = 0; i < g_metrics_maps; i++)
+		metrics_value (buf, "map_probe_max", "map", g_metrics_map[i].name,
+					   stats[i].probe_max);
+	metrics_header (buf, "map_probe_mean", "gauge",
+					"Mean probe sequence per map.");
+	for (i = 0; i < g_metrics_maps; i++)
+	{
+		json_str (buf, "openbeacon_map_probe_mean{map=\"");
+		json_str (buf, g_metrics_map[i].name);
+		json_str (buf, "\"} ");
+		metrics_double (buf, stats[i].probe_mean);
+		json_char (buf, '\n');
+	}
+
+	metrics_header (buf, "stage_seconds", "histogram",
+					"Processing time per batch and stage, latency from "
+					"receive to publish.");
+	for (i = 0; i < METRIC_STAGES; i++)
+		metrics_format_histogram (buf, g_metrics_stage[i], &totals->stage[i]);
+
+	free (totals);
+}
+
+/* bucket upper bound, never above the largest value seen */
+static uint64_t
+metrics_quantile (const TMetricsHistogram * hist, double q)
+{
+	int i;
+	uint64_t count, target, limit;
+
+	target = hist->count * q;
+	for (i = count = 0; i < METRICS_HIST_BUCKETS; i++)
+		if ((count += hist->bucket[i]) > target)
+		{
+			limit = metrics_bucket_limit (i);
+			return (limit < hist->max) ? limit : hist->max;
+		}
+	return hist->max;
+}
+
+/* values recorded since 'last', maximum as bucket bound */
+static void
+metrics_interval (TMetricsHistogram * delta, const TMetricsHistogram * hist,
+				  const TMetricsHistogram * last)
+{
+	int i;
+
+	delta->count = hist->count - last->count;
+	delta->sum = hist->sum - last->sum;
+	delta->max = 0;
+	for (i = 0; i < METRICS_HIST_BUCKETS; i++)
+		if ((delta->bucket[i] = hist->bucket[i] - last->bucket[i]) != 0)
+			delta->max = metrics_bucket_limit (i);
+	if (delta->max > hist->max)
+		delta->max = hist->max;
+}
+
+static const char *
+metrics_duration (uint64_t ns, char *text, size_t size)
+{
+	if (ns < 10000)
+		snprintf (text, size, "%.1fus", ns / 1e3);
+	else if (ns < 10000000)
+		snprintf (text, size, "%.0fus", ns / 1e3);
+	else
+		snprintf (text, size, "%.0fms", ns / 1e6);
+	return text;
+}
+
+/* link with the highest loss points at missing capacity */
+static void
+metrics_print_links (void)
+{
+	int i;
+	char text[32];
+	double loss, worst_loss;
+	uint64_t records, lost, reordered;
+	const TReaderSnapshot *reader, *worst;
+	const TSnapshot *snap;
+
+	if ((snap = snapshot_acquire ()) == NULL)
+		return;
+
+	records = lost = reordered = 0;
+	worst = NULL;
+	worst_loss = 0;
+	for (i = 0, reader = snap->reader; i < snap->reader_count; i++, reader++)
+	{
+		records += reader->records;
+		lost += reader->lost;
+		reordered += reader->reordered;
+		loss = (100.0 * reader->lost) / (reader->records + reader->lost);
+		if (!worst || (loss > worst_loss))
+		{
+			worst = reader;
+			worst_loss = loss;
+		}
+	}
+	if (worst)
+		fprintf (stderr, "metrics: %i links, %.2f%% lost, %llu reordered, "
+				 "worst %s/%u %.2f%% lost\n", snap->reader_count,
+				 (100.0 * lost) / (records + lost),
+				 (unsigned long long) reordered,
+				 metrics_ip (worst->reader_ip, text, sizeof (text)),
+				 worst->reader_id, worst_loss);
+	snapshot_release (snap);
+}
+
+static void
+metrics_print_summary (double elapsed)
+{
+	int i, j;
+	double rate, rmin, rmax;
+	uint64_t records, previous, *last;
+	char t1[16], t2[16], t3[16];
+	bmMapStatistics stats;
+	TMetricsTotals *totals;
+	TMetricsHistogram hist;
+	static TMetricsTotals *g_last;
+	static TMetricsReaders readers, last_readers;
+	TMetricsReaders swap;
+
+	if (!g_last &&
+		((g_last = (TMetricsTotals *) calloc (1, sizeof (*g_last))) == NULL))
+		return;
+	if ((totals = (TMetricsTotals *) malloc (sizeof (*totals))) == NULL)
+		return;
+	metrics_sum (totals);
+	last = g_last->counter;
+
+	records = (totals->counter[METRIC_SIGHTING] - last[METRIC_SIGHTING]) +
+		(totals->counter[METRIC_STATUS] - last[METRIC_STATUS]);
+	fprintf (stderr, "metrics: %.1f records/s (%.1f sighting, %.1f status, "
+			 "%.1f duplicate), %.1f snapshots/s\n", records / elapsed,
+			 (totals->counter[METRIC_SIGHTING] - last[METRIC_SIGHTING]) /
+			 elapsed,
+			 (totals->counter[METRIC_STATUS] - last[METRIC_STATUS]) / elapsed,
+			 (totals->counter[METRIC_DUPLICATE] - last[METRIC_DUPLICATE]) /
+			 elapsed,
+			 (totals->counter[METRIC_SNAPSHOTS] - last[METRIC_SNAPSHOTS]) /
+			 elapsed);
+
+	/* reader rates against the previous summary */
+	metrics_sum_readers (&readers);
+	rmin = rmax = 0;
+	for (i = j = 0; i < readers.count; i++)
+	{
+		for (previous = 0; (j < last_readers.count) &&
+			 (last_readers.reader[j].ip <= readers.reader[i].ip); j++)
+			if (last_readers.reader[j].ip == readers.reader[i].ip)
+				previous = last_readers.reader[j].records;
+		rate = (readers.reader[i].records - previous) / elapsed;
+		if (!i || (rate < rmin))
+			rmin = rate;
+		if (rate > rmax)
+			rmax = rate;
+	}
+	fprintf (stderr, "metrics: %i readers, %.1f-%.1f records/s each\n",
+			 readers.count, rmin, rmax);
+	metrics_print_links ();
+	swap = last_readers;
+	last_readers = readers;
+	readers = swap;
+
+	for (i = 0; i < g_metrics_maps; i++)
+	{
+		g_metrics_map[i].map->GetStatistics (&stats);
+		fprintf (stderr, "metrics: map %s %u items, %u/%u index slots, "
+				 "probe mean %.2f max %u\n", g_metrics_map[i].name,
+				 stats.items, stats.used, stats.slots, stats.probe_mean,
+				 stats.probe_max);
+	}
+
+	/* percentiles over this interval only */
+	for (i = 0; i < METRIC_STAGES; i++)
+	{
+		metrics_interval (&hist, &totals->stage[i], &g_last->stage[i]);
+		if (hist.count)
+			fprintf (stderr, "metrics: %s p50 %s p99 %s max %s\n",
+					 g_metrics_stage[i],
+					 metrics_duration (metrics_quantile (&hist, 0.5), t1,
+									   sizeof (t1)),
+					 metrics_duration (metrics_quantile (&hist, 0.99), t2,
+									   sizeof (t2)),
+					 metrics_duration (hist.max, t3, sizeof (t3)));
+	}
+
+	free (g_last);
+	g_last = totals;
+}
+
+void
+metrics_summary (int interval)
+{
+	g_metrics_interval = interval;
+}
+
+void
+metrics_report (void)
+{
+	int i;
+	bool found;
+	uint64_t now, delta, counter[METRIC_COUNTERS];
+	static uint64_t error_time, summary_time, last[METRIC_COUNTERS];
+
+	now = metrics_clock ();
+	if (!error_time)
+		error_time = summary_time = now;
+
+	/* one line for all rejected records instead of one per record */
+	if ((now - error_time) >= (METRICS_ERROR_REPORT * 1000000000ULL))
+	{
+		metrics_counters (counter);
+		found = false;
+		for (i = METRIC_TRUNCATED; i <= METRIC_KERNEL_DROPS; i++)
+		{
+			if ((i == METRIC_DATAGRAMS) || (i == METRIC_KEY_TRIAL) ||
+				!(delta = counter[i] - last[i]))
+				continue;
+			fprintf (stderr, "%s %llu %s", found ? "," :
+					 "metrics: rejected in last interval:",
+					 (unsigned long long) delta,
+					 (i < METRIC_OUTCOMES) ? g_metrics_outcome[i] :
+					 "kernel_drop");
+			found = true;
+		}
+		if (found)
+			fputc ('\n', stderr);
+		memcpy (last, counter, sizeof (last));
+		error_time = now;
+	}
+
+	if (g_metrics_interval &&
+		((now - summary_time) >= (g_metrics_interval * 1000000000ULL)))
+	{
+		metrics_print_summary ((now - summary_time) / 1e9);
+		summary_time = now;
+	}
+}
@@ -0,0 +1,148 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/* counters - record outcomes of parse_packet first */
+#define METRIC_SIGHTING 0
+#define METRIC_STATUS 1
+/* further copy of an already fused transmission */
+#define METRIC_DUPLICATE 2
+#define METRIC_TRUNCATED 3
+#define METRIC_INVALID_PROTOCOL 4
+#define METRIC_INVALID_SIZE 5
+#define METRIC_CRC_ERROR 6
+#define METRIC_DECRYPT_ERROR 7
+#define METRIC_UNKNOWN_PROTOCOL 8
+#define METRIC_REPLAYED 9
+#define METRIC_OUTCOMES 10
+/* other events */
+#define METRIC_DATAGRAMS 10
+#define METRIC_KEY_TRIAL 11
+#define METRIC_KERNEL_DROPS 12
+/* records arriving after the watermark closed their window */
+#define METRIC_LATE 13
+/* contact intervals reported as ended */
+#define METRIC_CONTACT 14
+#define METRIC_SNAPSHOTS 15
+#define METRIC_COUNTERS 16
+
+/* latency histograms in nanoseconds */
+#define METRIC_STAGE_PARSE 0
+#define METRIC_STAGE_DECRYPT 1
+#define METRIC_STAGE_PROCESS 2
+#define METRIC_STAGE_PUBLISH 3
+/* receive of the oldest record until the snapshot containing it */
+#define METRIC_STAGE_LATENCY 4
+#define METRIC_STAGES 5
+
+/* log-linear buckets - 16 per power of two, about 6% resolution */
+#define METRICS_HIST_SUB_BITS 4
+#define METRICS_HIST_SUB (1<<METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_MAGNITUDE 40
+#define METRICS_HIST_BUCKETS \
+	((METRICS_HIST_MAGNITUDE-METRICS_HIST_SUB_BITS+1)<<METRICS_HIST_SUB_BITS)
+
+/* readers tracked per thread, further readers are not broken down */
+#define METRICS_READERS 1024
+/* seconds between aggregated error reports */
+#define METRICS_ERROR_REPORT 1
+#define METRICS_MAPS 8
+
+typedef struct
+{
+	uint64_t bucket[METRICS_HIST_BUCKETS];
+	uint64_t count, sum, max;
+} TMetricsHistogram;
+
+typedef struct
+{
+	/* reader IPv4 address plus one, zero marks free slots */
+	uint64_t key;
+	uint64_t records, errors;
+} TMetricsReader;
+
+/* written by its owning thread only, read by anyone - except pending */
+typedef struct TMetricsThread
+{
+	uint64_t counter[METRIC_COUNTERS];
+	/* receive time of the oldest record not yet published, set by its
+	 * owner when clear, cleared by metrics_published */
+	uint64_t pending;
+	TMetricsHistogram stage[METRIC_STAGES];
+	TMetricsReader reader[METRICS_READERS];
+	struct TMetricsThread *next;
+} TMetricsThread;
+
+extern __thread TMetricsThread *g_metrics_self;
+extern TMetricsThread *metrics_register (void);
+
+static inline TMetricsThread *
+metrics_self (void)
+{
+	return g_metrics_self ? g_metrics_self : metrics_register ();
+}
+
+/* single writer - plain add published with relaxed stores */
+static inline void
+metrics_add (uint64_t * value, uint64_t n)
+{
+	__atomic_store_n (value, *value + n, __ATOMIC_RELAXED);
+}
+
+static inline void
+metrics_count (int counter, uint64_t n)
+{
+	metrics_add (&metrics_self ()->counter[counter], n);
+}
+
+/* monotonic nanoseconds */
+static inline uint64_t
+metrics_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+extern void metrics_record (int stage, uint64_t ns);
+extern void metrics_reader (uint32_t reader_ip, bool valid);
+/* records received at 'ns' are waiting for the next snapshot */
+extern void metrics_received (uint64_t ns);
+/* snapshot published - estimation thread */
+extern void metrics_published (void);
+
+extern void metrics_map (const char *name, bmMapHandleToItem * map);
+/* Prometheus text exposition format */
+extern void metrics_format (TJsonBuffer * buf);
+/* periodic stderr summary every 'interval' seconds, 0 disables */
+extern void metrics_summary (int interval);
+/* aggregated error and summary output, rate limited */
+extern void metrics_report (void);
+
+#endif/*__METRICS_H__*/
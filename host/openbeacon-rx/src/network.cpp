@@ -29,6 +29,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
@@ -40,8 +41,71 @@
 #include <pthread.h>
 
 #include "network.h"
-#include "main.h"
 #include "helper.h"
+#include "crypto.h"
+#include "main.h"
+#include "json.h"
+#include "bmMapHandleToItem.h"
+#include "metrics.h"
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+
+typedef struct
+{
+	int id, sock, cpu;
+	pthread_t thread;
+	/* kernel drop counter of this socket as last seen */
+	uint32_t dropped;
+	/* preallocated receive ring */
+	struct mmsghdr msg[NETWORK_BATCH];
+	struct iovec iov[NETWORK_BATCH];
+	struct sockaddr_in addr[NETWORK_BATCH];
+	uint8_t control[NETWORK_BATCH][CMSG_SPACE (sizeof (uint32_t))];
+	uint8_t buffer[NETWORK_BATCH][NETWORK_MTU];
+	/* datagrams handed to the batch parser */
+	uint32_t reader_id[NETWORK_BATCH];
+	const uint8_t *data[NETWORK_BATCH];
+	int len[NETWORK_BATCH];
+} TNetworkWorker;
+
+static int g_workers;
+static TNetworkWorker *g_worker;
+
+void
+network_config_init (TNetworkConfig *config)
+{
+	int i;
+
+	config->workers = 1;
+	config->rcvbuf = 0;
+	for (i = 0; i < NETWORK_MAX_WORKERS; i++)
+		config->cpu[i] = -1;
+}
+
+bool
+network_config_cpus (TNetworkConfig *config, const char *list)
+{
+	int i, cpu;
+	char *end;
+
+	/* comma separated CPU list, one entry per worker */
+	for (i = 0; *list && (i < NETWORK_MAX_WORKERS); i++)
+	{
+		cpu = strtol (list, &end, 10);
+		if ((end == list) || (cpu < 0))
+			return false;
+		config->cpu[i] = cpu;
+
+		list = end;
+		if (*list == ',')
+			list++;
+		else if (*list)
+			return false;
+	}
+	return true;
+}
 
 static void *
 thread_estimation (void *context)
@@ -51,52 +115,171 @@ thread_estimation (void *context)
 	return NULL;
 }
 
-int
-listen_packets (FILE* out)
+static int
+network_socket (const TNetworkConfig *config)
 {
-	int sock, size, res;
-	uint32_t reader_id;
-	double timestamp;
-	uint8_t buffer[1500], *pkt;
-	struct sockaddr_in si_me, si_other;
-	socklen_t slen = sizeof (si_other);
-	pthread_t thread_handle;
+	int sock, opt;
+	struct sockaddr_in si_me;
 
 	if ((sock = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
 		diep ("socket");
-	else
+
+	/* let the kernel spread readers across worker sockets - a single
+	 * socket keeps the port exclusive so a second instance fails */
+	opt = 1;
+	if ((config->workers > 1) &&
+		setsockopt (sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt)))
+		diep ("setsockopt(SO_REUSEPORT)");
+
+	/* report kernel drops with every datagram */
+	opt = 1;
+	if (setsockopt (sock, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof (opt)))
+		fprintf (stderr, "network: SO_RXQ_OVFL not supported\n");
+
+	if (config->rcvbuf &&
+		setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &config->rcvbuf,
+					sizeof (config->rcvbuf)))
+		fprintf (stderr, "network: failed to set receive buffer to %i\n",
+				 config->rcvbuf);
+
+	memset ((char *) &si_me, 0, sizeof (si_me));
+	si_me.sin_family = AF_INET;
+	si_me.sin_port = htons (UDP_PORT);
+	si_me.sin_addr.s_addr = htonl (INADDR_ANY);
+
+	if (bind (sock, (sockaddr *) & si_me, sizeof (si_me)) == -1)
+		diep ("bind");
+
+	return sock;
+}
+
+static uint32_t
+network_dropped (struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	uint32_t dropped;
+
+	for (cmsg = CMSG_FIRSTHDR (msg); cmsg; cmsg = CMSG_NXTHDR (msg, cmsg))
+		if ((cmsg->cmsg_level == SOL_SOCKET) &&
+			(cmsg->cmsg_type == SO_RXQ_OVFL))
+		{
+			memcpy (&dropped, CMSG_DATA (cmsg), sizeof (dropped));
+			return dropped;
+		}
+	return 0;
+}
+
+static void *
+thread_ingest (void *context)
+{
+	int i, n, count, size;
+	uint32_t dropped;
+	double timestamp;
+	cpu_set_t cpus;
+	TNetworkWorker *worker = (TNetworkWorker *) context;
+
+	/* optionally pin worker to its CPU */
+	if (worker->cpu >= 0)
 	{
-		memset ((char *) &si_me, 0, sizeof (si_me));
-		si_me.sin_family = AF_INET;
-		si_me.sin_port = htons (UDP_PORT);
-		si_me.sin_addr.s_addr = htonl (INADDR_ANY);
+		CPU_ZERO (&cpus);
+		CPU_SET (worker->cpu, &cpus);
+		if (pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus))
+			fprintf (stderr, "network: failed to pin worker %i to CPU %i\n",
+					 worker->id, worker->cpu);
+	}
+
+	/* set up receive ring once */
+	for (i = 0; i < NETWORK_BATCH; i++)
+	{
+		worker->iov[i].iov_base = worker->buffer[i];
+		worker->iov[i].iov_len = NETWORK_MTU;
+		worker->msg[i].msg_hdr.msg_iov = &worker->iov[i];
+		worker->msg[i].msg_hdr.msg_iovlen = 1;
+		worker->msg[i].msg_hdr.msg_name = &worker->addr[i];
+	}
 
-		if (bind (sock, (sockaddr *) & si_me, sizeof (si_me)) == -1)
-			diep ("bind");
+	while (1)
+	{
+		/* reset per-call fields */
+		for (i = 0; i < NETWORK_BATCH; i++)
+		{
+			worker->msg[i].msg_hdr.msg_namelen = sizeof (worker->addr[i]);
+			worker->msg[i].msg_hdr.msg_control = worker->control[i];
+			worker->msg[i].msg_hdr.msg_controllen =
+				sizeof (worker->control[i]);
+		}
+
+		/* block for first datagram, then drain what is queued */
+		if ((count = recvmmsg (worker->sock, worker->msg, NETWORK_BATCH,
+							   MSG_WAITFORONE, NULL)) == -1)
+			diep ("recvmmsg()");
+
+		timestamp = microtime ();
+		for (i = n = 0; i < count; i++)
+		{
+			/* skip empty datagrams - anyone can send them */
+			if ((size = worker->msg[i].msg_len) == 0)
+				continue;
+
+			worker->data[n] = worker->buffer[i];
+			worker->len[n] = size;
+			worker->reader_id[n] = ntohl (worker->addr[i].sin_addr.s_addr);
+			n++;
+		}
 
-		pthread_create (&thread_handle, NULL, &thread_estimation, out);
+		/* decrypt all records of this batch together */
+		if (n)
+			parse_batch (timestamp, n, worker->reader_id, worker->data,
+						 worker->len);
 
-		while (1)
+		/* counter is cumulative per socket, reported by metrics_report */
+		if (count &&
+			((dropped = network_dropped (&worker->msg[count - 1].msg_hdr)) !=
+			 worker->dropped))
 		{
-			if ((size = recvfrom (sock, &buffer, sizeof (buffer), 0,
-								  (sockaddr *) & si_other, &slen)) == -1)
-				diep ("recvfrom()");
-
-			/* orderly shutdown */
-			if (!size)
-				break;
-
-			pkt = buffer;
-			reader_id = ntohl (si_other.sin_addr.s_addr);
-
-			timestamp = microtime ();
-			while ((res =
-					parse_packet (timestamp, reader_id, pkt, size)) > 0)
-			{
-				size -= res;
-				pkt += res;
-			}
+			metrics_count (METRIC_KERNEL_DROPS, dropped - worker->dropped);
+			worker->dropped = dropped;
 		}
 	}
+	return NULL;
+}
+
+int
+listen_packets (FILE* out, const TNetworkConfig *config)
+{
+	int i;
+	TNetworkConfig defaults;
+	pthread_t thread_handle;
+
+	if (!config)
+	{
+		network_config_init (&defaults);
+		config = &defaults;
+	}
+
+	g_workers = config->workers;
+	if ((g_workers < 1) || (g_workers > NETWORK_MAX_WORKERS))
+		diep ("invalid number of network workers (%i)", g_workers);
+
+	if ((g_worker = (TNetworkWorker *)
+		 calloc (g_workers, sizeof (TNetworkWorker))) == NULL)
+		diep ("out of memory");
+
+	/* open all sockets before receiving to spread readers evenly */
+	for (i = 0; i < g_workers; i++)
+	{
+		g_worker[i].id = i;
+		g_worker[i].cpu = config->cpu[i];
+		g_worker[i].sock = network_socket (config);
+	}
+
+	pthread_create (&thread_handle, NULL, &thread_estimation, out);
+
+	/* calling thread serves as first worker */
+	for (i = 1; i < g_workers; i++)
+		pthread_create (&g_worker[i].thread, NULL, &thread_ingest,
+						&g_worker[i]);
+	thread_ingest (&g_worker[0]);
+
 	return 0;
 }
@@ -29,6 +29,23 @@
 
 #define UDP_PORT 2342
 
-extern int listen_packets (FILE* out);
+#define NETWORK_MTU 1500
+#define NETWORK_MAX_WORKERS 64
+/* datagrams fetched per recvmmsg call */
+#define NETWORK_BATCH 64
+
+typedef struct
+{
+	/* number of receive threads sharing the port via SO_REUSEPORT */
+	int workers;
+	/* socket receive buffer size in bytes, zero for system default */
+	int rcvbuf;
+	/* optional CPU for each worker, -1 to leave unpinned */
+	int cpu[NETWORK_MAX_WORKERS];
+} TNetworkConfig;
+
+extern void network_config_init (TNetworkConfig *config);
+extern bool network_config_cpus (TNetworkConfig *config, const char *list);
+extern int listen_packets (FILE* out, const TNetworkConfig *config);
 
 #endif/*__NETWORK_H__*/
\ No newline at end of file
@@ -0,0 +1,208 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "helper.h"
+#include "pool.h"
+
+/* chunk range of a worker - next chunk in the low, end in the high
+ * word, the owner advances next while thieves lower end */
+typedef struct
+{
+	uint64_t range;
+	pthread_t thread;
+} __attribute__ ((aligned (64))) TPoolWorker;
+
+static int g_pool_workers = 1;
+static TPoolWorker g_pool_worker[POOL_MAX_WORKERS];
+static pthread_mutex_t g_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_pool_done = PTHREAD_COND_INITIALIZER;
+/* current task - changed under g_pool_mutex only */
+static uint32_t g_pool_generation;
+static int g_pool_busy, g_pool_count;
+static TPoolTask g_pool_task;
+static void *g_pool_context;
+
+#define POOL_RANGE(next,end) ((((uint64_t)(end))<<32)|(uint32_t)(next))
+
+/* claim a chunk from the front of the own or the back of a foreign
+ * range, returns -1 once the range is empty */
+static int
+pool_claim (TPoolWorker * worker, bool steal)
+{
+	uint64_t range;
+	uint32_t next, end;
+
+	range = __atomic_load_n (&worker->range, __ATOMIC_ACQUIRE);
+	do
+	{
+		next = (uint32_t) range;
+		end = (uint32_t) (range >> 32);
+		if (next >= end)
+			return -1;
+	}
+	while (!__atomic_compare_exchange_n (&worker->range, &range, steal ?
+										 POOL_RANGE (next, end - 1) :
+										 POOL_RANGE (next + 1, end), false,
+										 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return steal ? (end - 1) : next;
+}
+
+static void
+pool_chunk (int worker, int chunk)
+{
+	int first, last;
+
+	first = chunk * POOL_CHUNK;
+	last = first + POOL_CHUNK;
+	if (last > g_pool_count)
+		last = g_pool_count;
+	g_pool_task (g_pool_context, worker, chunk, first, last);
+}
+
+static void
+pool_work (int worker)
+{
+	int i, chunk, victim;
+
+	while ((chunk = pool_claim (&g_pool_worker[worker], false)) >= 0)
+		pool_chunk (worker, chunk);
+
+	/* own chunks done - help the others */
+	for (i = 1; i < g_pool_workers; i++)
+	{
+		victim = (worker + i) % g_pool_workers;
+		while ((chunk = pool_claim (&g_pool_worker[victim], true)) >= 0)
+			pool_chunk (worker, chunk);
+	}
+}
+
+static void
+pool_finish (void)
+{
+	pthread_mutex_lock (&g_pool_mutex);
+	if (!--g_pool_busy)
+		pthread_cond_signal (&g_pool_done);
+	pthread_mutex_unlock (&g_pool_mutex);
+}
+
+static void *
+pool_thread (void *context)
+{
+	int worker;
+	uint32_t generation;
+
+	worker = (int) (intptr_t) context;
+	generation = 0;
+	while (true)
+	{
+		pthread_mutex_lock (&g_pool_mutex);
+		while (g_pool_generation == generation)
+			pthread_cond_wait (&g_pool_start, &g_pool_mutex);
+		generation = g_pool_generation;
+		pthread_mutex_unlock (&g_pool_mutex);
+
+		pool_work (worker);
+		pool_finish ();
+	}
+	return NULL;
+}
+
+bool
+pool_init (int workers)
+{
+	int i;
+
+	if ((workers < 1) || (workers > POOL_MAX_WORKERS) ||
+		(g_pool_workers > 1))
+		return false;
+
+	for (i = 1; i < workers; i++)
+		if (pthread_create (&g_pool_worker[i].thread, NULL, &pool_thread,
+							(void *) (intptr_t) i))
+			diep ("pool: pthread_create");
+	g_pool_workers = workers;
+	return true;
+}
+
+int
+pool_workers (void)
+{
+	return g_pool_workers;
+}
+
+int
+pool_chunks (int count)
+{
+	return (count + POOL_CHUNK - 1) / POOL_CHUNK;
+}
+
+void
+pool_run (TPoolTask task, void *context, int count)
+{
+	int i, chunks;
+
+	g_pool_task = task;
+	g_pool_context = context;
+	g_pool_count = count;
+	chunks = pool_chunks (count);
+
+	/* not worth waking anyone up */
+	if ((g_pool_workers == 1) || (chunks <= 1))
+	{
+		for (i = 0; i < chunks; i++)
+			pool_chunk (0, i);
+		return;
+	}
+
+	/* contiguous share of chunks per worker */
+	pthread_mutex_lock (&g_pool_mutex);
+	for (i = 0; i < g_pool_workers; i++)
+		__atomic_store_n (&g_pool_worker[i].range,
+						  POOL_RANGE ((chunks * i) / g_pool_workers,
+									  (chunks * (i + 1)) / g_pool_workers),
+						  __ATOMIC_RELEASE);
+	g_pool_busy = g_pool_workers;
+	g_pool_generation++;
+	pthread_cond_broadcast (&g_pool_start);
+	pthread_mutex_unlock (&g_pool_mutex);
+
+	pool_work (0);
+
+	/* wait for chunks still processed by other workers */
+	pthread_mutex_lock (&g_pool_mutex);
+	g_pool_busy--;
+	while (g_pool_busy)
+		pthread_cond_wait (&g_pool_done, &g_pool_mutex);
+	pthread_mutex_unlock (&g_pool_mutex);
+}
@@ -0,0 +1,48 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#define POOL_MAX_WORKERS 64
+/* items per chunk - the unit of work handed out and stolen */
+#define POOL_CHUNK 256
+
+/* processes items first..last-1 which form chunk 'chunk', 'worker'
+ * is zero for the calling thread and unique while the task runs */
+typedef void (*TPoolTask) (void *context, int worker, int chunk, int first,
+						   int last);
+
+/* start workers-1 threads, the caller of pool_run is worker zero */
+extern bool pool_init (int workers);
+extern int pool_workers (void);
+extern int pool_chunks (int count);
+/* runs task over all chunks of 'count' items and returns once all
+ * chunks are done - workers take their own chunks front to back and
+ * steal from the back of others once they run out */
+extern void pool_run (TPoolTask task, void *context, int count);
+
+#endif/*__POOL_H__*/
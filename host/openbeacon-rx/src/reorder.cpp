@@ -0,0 +1,273 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "helper.h"
+#include "crypto.h"
+#include "reorder.h"
+
+typedef struct
+{
+	pthread_mutex_t mutex;
+	/* absolute bucket number collected, lower ones were released */
+	int64_t index;
+	int count, size;
+	double *received;
+	uint32_t *reader_ip;
+	TBeaconLogSighting *record;
+} TReorderBucket;
+
+static double g_reorder_delay;
+static TReorderRelease g_reorder_release;
+static TReorderBucket g_reorder_bucket[REORDER_BUCKETS];
+/* buckets are released in order by one thread at a time */
+static pthread_mutex_t g_reorder_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool g_reorder_started;
+/* first bucket not released yet and last bucket with records */
+static int64_t g_reorder_next, g_reorder_last;
+static uint64_t g_reorder_pending;
+/* contents of the bucket being released */
+static TReorderBucket g_reorder_spare;
+
+bool
+reorder_init (double delay, TReorderRelease release)
+{
+	int i;
+
+	if (!(delay >= 0) || (delay > REORDER_MAX_DELAY))
+		return false;
+
+	for (i = 0; i < REORDER_BUCKETS; i++)
+		pthread_mutex_init (&g_reorder_bucket[i].mutex, NULL);
+	g_reorder_delay = delay;
+	g_reorder_release = release;
+	return true;
+}
+
+bool
+reorder_enabled (void)
+{
+	return g_reorder_release != NULL;
+}
+
+double
+reorder_watermark (double timestamp)
+{
+	return timestamp - g_reorder_delay;
+}
+
+static inline int64_t
+reorder_index (double timestamp)
+{
+	return (int64_t) floor (timestamp / REORDER_BUCKET);
+}
+
+static void
+reorder_start (double event)
+{
+	pthread_mutex_lock (&g_reorder_mutex);
+	if (!g_reorder_started)
+	{
+		g_reorder_next = g_reorder_last =
+			reorder_index (reorder_watermark (event));
+		__atomic_store_n (&g_reorder_started, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock (&g_reorder_mutex);
+}
+
+bool
+reorder_push (double event, double received, uint32_t reader_ip,
+			  const TBeaconLogSighting * pkt)
+{
+	bool due;
+	int64_t index, next, last;
+	TReorderBucket *bucket;
+
+	if (!__atomic_load_n (&g_reorder_started, __ATOMIC_ACQUIRE))
+		reorder_start (event);
+
+	/* late records join the next bucket, early ones the last */
+	index = reorder_index (event);
+	due = false;
+	while (true)
+	{
+		next = __atomic_load_n (&g_reorder_next, __ATOMIC_ACQUIRE);
+		if (index < next)
+		{
+			index = next;
+			due = true;
+		}
+		else if (index >= (next + REORDER_BUCKETS))
+			index = next + REORDER_BUCKETS - 1;
+
+		bucket = &g_reorder_bucket[index % REORDER_BUCKETS];
+		pthread_mutex_lock (&bucket->mutex);
+		if (bucket->index <= index)
+			break;
+		/* released meanwhile */
+		pthread_mutex_unlock (&bucket->mutex);
+	}
+
+	bucket->index = index;
+	if (bucket->count == bucket->size)
+	{
+		bucket->size = bucket->size ? bucket->size * 2 : 256;
+		if (((bucket->received = (double *)
+			  realloc (bucket->received,
+					   bucket->size * sizeof (double))) == NULL) ||
+			((bucket->reader_ip = (uint32_t *)
+			  realloc (bucket->reader_ip,
+					   bucket->size * sizeof (uint32_t))) == NULL) ||
+			((bucket->record = (TBeaconLogSighting *)
+			  realloc (bucket->record,
+					   bucket->size * sizeof (TBeaconLogSighting))) == NULL))
+			diep ("reorder_push");
+	}
+	bucket->received[bucket->count] = received;
+	bucket->reader_ip[bucket->count] = reader_ip;
+	memcpy (&bucket->record[bucket->count], pkt, sizeof (*pkt));
+	bucket->count++;
+	pthread_mutex_unlock (&bucket->mutex);
+	__atomic_add_fetch (&g_reorder_pending, 1, __ATOMIC_RELAXED);
+
+	last = __atomic_load_n (&g_reorder_last, __ATOMIC_RELAXED);
+	while ((index > last) &&
+		   !__atomic_compare_exchange_n (&g_reorder_last, &last, index, true,
+										 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return !due;
+}
+
+static void
+reorder_bucket_release (int64_t index)
+{
+	int i, j, n;
+	const uint8_t *data[REORDER_RELEASE];
+	int len[REORDER_RELEASE];
+	double *received;
+	uint32_t *reader_ip;
+	TBeaconLogSighting *record;
+	TReorderBucket *bucket;
+
+	/* swap contents out, later pushes for this bucket move on */
+	bucket = &g_reorder_bucket[index % REORDER_BUCKETS];
+	pthread_mutex_lock (&bucket->mutex);
+	if (bucket->count && (bucket->index <= index))
+	{
+		received = bucket->received;
+		reader_ip = bucket->reader_ip;
+		record = bucket->record;
+		n = bucket->size;
+		g_reorder_spare.count = bucket->count;
+		bucket->received = g_reorder_spare.received;
+		bucket->reader_ip = g_reorder_spare.reader_ip;
+		bucket->record = g_reorder_spare.record;
+		bucket->size = g_reorder_spare.size;
+		bucket->count = 0;
+		g_reorder_spare.received = received;
+		g_reorder_spare.reader_ip = reader_ip;
+		g_reorder_spare.record = record;
+		g_reorder_spare.size = n;
+	}
+	if (bucket->index <= index)
+		bucket->index = index + 1;
+	__atomic_store_n (&g_reorder_next, index + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock (&bucket->mutex);
+
+	/* process the window as a batch, stamped with its end - the
+	 * receive times go along for the journal */
+	for (i = 0; i < g_reorder_spare.count; i += n)
+	{
+		n = g_reorder_spare.count - i;
+		if (n > REORDER_RELEASE)
+			n = REORDER_RELEASE;
+		for (j = 0; j < n; j++)
+		{
+			data[j] = (const uint8_t *) &g_reorder_spare.record[i + j];
+			len[j] = sizeof (TBeaconLogSighting);
+		}
+		g_reorder_release ((index + 1) * REORDER_BUCKET, n,
+						   &g_reorder_spare.received[i],
+						   &g_reorder_spare.reader_ip[i], data, len);
+	}
+	__atomic_sub_fetch (&g_reorder_pending, g_reorder_spare.count,
+						__ATOMIC_RELAXED);
+	g_reorder_spare.count = 0;
+}
+
+static void
+reorder_release (int64_t limit, bool wait)
+{
+	int i;
+	int64_t next;
+
+	if (!__atomic_load_n (&g_reorder_started, __ATOMIC_ACQUIRE) ||
+		(__atomic_load_n (&g_reorder_next, __ATOMIC_ACQUIRE) >= limit))
+		return;
+
+	/* another thread is releasing already */
+	if (wait)
+		pthread_mutex_lock (&g_reorder_mutex);
+	else if (pthread_mutex_trylock (&g_reorder_mutex))
+		return;
+
+	/* every queued record lies within one turn of the ring */
+	next = g_reorder_next;
+	for (i = 0; (i < REORDER_BUCKETS) && (next < limit); i++, next++)
+		reorder_bucket_release (next);
+	if (next < limit)
+		__atomic_store_n (&g_reorder_next, limit, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock (&g_reorder_mutex);
+}
+
+void
+reorder_drain (double timestamp, bool wait)
+{
+	reorder_release (reorder_index (reorder_watermark (timestamp)), wait);
+}
+
+uint64_t
+reorder_pending (void)
+{
+	return __atomic_load_n (&g_reorder_pending, __ATOMIC_RELAXED);
+}
+
+double
+reorder_flush (void)
+{
+	int64_t limit;
+
+	limit = __atomic_load_n (&g_reorder_last, __ATOMIC_RELAXED) + 1;
+	reorder_release (limit, true);
+	return limit * REORDER_BUCKET + g_reorder_delay;
+}
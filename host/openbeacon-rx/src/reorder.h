@@ -0,0 +1,65 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __REORDER_H__
+#define __REORDER_H__
+
+/* requires crypto.h for the protocol structures */
+
+/* records are released in buckets of REORDER_BUCKET seconds */
+#define REORDER_BUCKET 0.1
+#define REORDER_BUCKETS 1024
+/* leaves room for records ahead of the watermark */
+#define REORDER_MAX_DELAY 60
+/* records per release call */
+#define REORDER_RELEASE 256
+
+/* receives due records, timestamp is the end of their bucket,
+ * 'received' their local receive times */
+typedef void (*TReorderRelease) (double timestamp, int count,
+								 const double *received,
+								 const uint32_t * reader_ip,
+								 const uint8_t * const *data,
+								 const int *len);
+
+/* watermark trails the receive clock by 'delay' seconds */
+extern bool reorder_init (double delay, TReorderRelease release);
+extern bool reorder_enabled (void);
+extern double reorder_watermark (double timestamp);
+/* queue a record by event time, false if its bucket was already due */
+extern bool reorder_push (double event, double received,
+						  uint32_t reader_ip,
+						  const TBeaconLogSighting * pkt);
+/* release all buckets closed by the watermark of 'timestamp', without
+ * 'wait' only if no other thread is releasing */
+extern void reorder_drain (double timestamp, bool wait);
+/* release everything queued, end of replay - returns the receive
+ * time whose watermark covers all released records */
+extern double reorder_flush (void);
+/* records waiting for the watermark */
+extern uint64_t reorder_pending (void);
+
+#endif/*__REORDER_H__*/
@@ -29,80 +29,714 @@
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <stdarg.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <netinet/ip.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
 #include <sys/types.h>
-#include <pcap.h>
 
-#include "main.h"
 #include "crypto.h"
+#include "main.h"
 #include "helper.h"
+#include "journal.h"
+#include "reorder.h"
+#include "json.h"
+#include "contact.h"
 #include "replay.h"
 
+/* capture file magic numbers */
+#define PCAP_MAGIC_USEC 0xA1B2C3D4UL
+#define PCAP_MAGIC_NSEC 0xA1B23C4DUL
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_SIZE 16
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4DUL
+
+/* pcapng block types */
+#define PCAPNG_SHB 0x0A0D0D0AUL
+#define PCAPNG_IDB 1
+#define PCAPNG_PB 2
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+
+/* pcapng options */
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_TSRESOL 9
+
+/* link layer types */
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW_BSD 12
+#define LINKTYPE_RAW_OPENBSD 14
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LOOP 108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88A8
+#define ETHERTYPE_QINQ_OLD 0x9100
+
+typedef struct
+{
+	int linktype;
+	/* timestamp units per second */
+	double resolution;
+} TReplayInterface;
+
+typedef struct
+{
+	const TReplayConfig *config;
+	const uint8_t *data, *end;
+	/* capture written with opposite byte order */
+	bool swap;
+	int interfaces;
+	TReplayInterface interface[REPLAY_MAX_INTERFACES];
+	/* capture time bounds, resolved at the first record */
+	bool started, done;
+	double start, stop, last;
+	/* capture time and monotonic clock at the first paced record */
+	bool paced;
+	double pace_time, pace_last;
+	struct timespec pace_clock;
+	/* capture second of last estimation step */
+	uint32_t step;
+	/* pending datagrams, all from the same capture time */
+	int count;
+	double batch_time;
+	uint32_t reader_id[REPLAY_BATCH];
+	const uint8_t *data_ptr[REPLAY_BATCH];
+	int len[REPLAY_BATCH];
+	/* statistics */
+	uint32_t records, datagrams, skipped;
+	bool truncated;
+} TReplay;
+
 void
-parse_pcap (const char *file, bool realtime)
+replay_config_init (TReplayConfig *config)
+{
+	memset (config, 0, sizeof (*config));
+}
+
+bool
+replay_config_speed (TReplayConfig *config, const char *speed)
+{
+	char *end;
+
+	if (!strcmp (speed, "max"))
+	{
+		config->speed = 0;
+		return true;
+	}
+
+	config->speed = strtod (speed, &end);
+	if ((*end == 'x') || (*end == 'X'))
+		end++;
+	return (end != speed) && !*end && (config->speed >= 0);
+}
+
+bool
+replay_config_time (const char *value, double *time, bool *relative)
+{
+	char *end;
+
+	if ((*relative = (*value == '+')))
+		value++;
+
+	*time = strtod (value, &end);
+	return (end != value) && !*end && (*time >= 0);
+}
+
+static inline uint16_t
+replay_u16 (const TReplay *r, const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy (&v, p, sizeof (v));
+	return r->swap ? __builtin_bswap16 (v) : v;
+}
+
+static inline uint32_t
+replay_u32 (const TReplay *r, const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy (&v, p, sizeof (v));
+	return r->swap ? __builtin_bswap32 (v) : v;
+}
+
+static inline uint16_t
+replay_be16 (const uint8_t *p)
+{
+	return (((uint16_t) p[0]) << 8) | p[1];
+}
+
+/* locate IPv4 header behind the link layer, NULL for other protocols */
+static const uint8_t *
+replay_link (int linktype, const uint8_t *p, const uint8_t *end)
+{
+	uint16_t type;
+	uint32_t family;
+
+	switch (linktype)
+	{
+		case LINKTYPE_ETHERNET:
+			if ((end - p) < 14)
+				return NULL;
+			type = replay_be16 (p + 12);
+			p += 14;
+			break;
+
+		case LINKTYPE_LINUX_SLL:
+			if ((end - p) < 16)
+				return NULL;
+			type = replay_be16 (p + 14);
+			p += 16;
+			break;
+
+		case LINKTYPE_LINUX_SLL2:
+			if ((end - p) < 20)
+				return NULL;
+			type = replay_be16 (p);
+			p += 20;
+			break;
+
+		case LINKTYPE_NULL:
+		case LINKTYPE_LOOP:
+			/* address family in host or network byte order */
+			if ((end - p) < 4)
+				return NULL;
+			memcpy (&family, p, sizeof (family));
+			if ((family != AF_INET) && (family != htonl (AF_INET)))
+				return NULL;
+			return p + 4;
+
+		case LINKTYPE_RAW:
+		case LINKTYPE_RAW_BSD:
+		case LINKTYPE_RAW_OPENBSD:
+		case LINKTYPE_IPV4:
+			return p;
+
+		default:
+			return NULL;
+	}
+
+	/* skip 802.1Q and 802.1ad tags */
+	while (((type == ETHERTYPE_VLAN) || (type == ETHERTYPE_QINQ) ||
+			(type == ETHERTYPE_QINQ_OLD)) && ((end - p) >= 4))
+	{
+		type = replay_be16 (p + 2);
+		p += 4;
+	}
+
+	return (type == ETHERTYPE_IPV4) ? p : NULL;
+}
+
+/* find UDP payload of an IPv4 packet */
+static bool
+replay_udp (const uint8_t *p, const uint8_t *end, uint32_t *reader_id,
+	const uint8_t **payload, int *len)
 {
-	int len, res;
-	pcap_t *h;
-	char error[PCAP_ERRBUF_SIZE];
-	pcap_pkthdr header;
+	int hl, total;
 	const ip *ip_hdr;
 	const udphdr *udp_hdr;
-	const uint8_t *packet;
-	uint32_t reader_id, timestamp_old, timestamp;
 
-	timestamp_old = 0;
+	if ((end - p) < (int) sizeof (ip))
+		return false;
 
-	if ((h = pcap_open_offline (file, error)) == NULL)
-		diep("Failed to open '%s'");
-	/* iterate over all IPv4 UDP packets */
-	while ((packet = (const uint8_t *) pcap_next (h, &header)) != NULL)
-	{
-		/* check for Ethernet protocol */
-		if ((((uint32_t) (packet[12]) << 8) | packet[13]) == 0x0800)
-		{
-			/* skip Ethernet header */
-			packet += 14;
-			ip_hdr = (const ip *) packet;
-
-			/* if IPv4 UDP protocol */
-			if ((ip_hdr->ip_v == 0x4) && (ip_hdr->ip_p == 17))
-			{
-				len = 4 * ip_hdr->ip_hl;
-				packet += len;
-				udp_hdr = (const udphdr *) packet;
-
-				/* get UDP packet payload size */
+	ip_hdr = (const ip *) p;
+	hl = 4 * ip_hdr->ip_hl;
+	if ((ip_hdr->ip_v != 0x4) || (ip_hdr->ip_p != IPPROTO_UDP) ||
+		(hl < (int) sizeof (ip)))
+		return false;
+
+	/* fragments can't be decoded */
+	if (ntohs (ip_hdr->ip_off) & (IP_MF | IP_OFFMASK))
+		return false;
+
+	/* ignore link layer padding, offloaded captures may lack length */
+	total = ntohs (ip_hdr->ip_len);
+	if ((total >= hl) && ((end - p) > total))
+		end = p + total;
+
+	p += hl;
+	if ((end - p) < (int) sizeof (udphdr))
+		return false;
+	udp_hdr = (const udphdr *) p;
+	p += sizeof (udphdr);
+
+	/* get UDP packet payload size */
 #ifdef __APPLE__
-				len = udp_hdr->uh_ulen;
+	*len = ntohs (udp_hdr->uh_ulen) - sizeof (udphdr);
 #else
-				len = udp_hdr->len;
+	*len = ntohs (udp_hdr->len) - sizeof (udphdr);
 #endif
-				len = ntohs (len) - sizeof (udphdr);
-				packet += sizeof (udphdr);
+	if (*len < 0)
+		return false;
 
-				/* run estimation every second */
-				timestamp = microtime_calc (&header.ts);
-				if ((timestamp - timestamp_old) >= 1)
-				{
-					timestamp_old = timestamp;
-					thread_estimation_step (stdout, timestamp, realtime);
-				}
+	/* truncated by capture snap length */
+	if (*len > (end - p))
+		*len = end - p;
+
+	*reader_id = ntohl (ip_hdr->ip_src.s_addr);
+	*payload = p;
+	return true;
+}
+
+static void
+replay_flush (TReplay *r)
+{
+	if (!r->count)
+		return;
+
+	parse_batch (r->batch_time, r->count, r->reader_id, r->data_ptr, r->len);
+	r->count = 0;
+}
+
+/* estimate the windows still held back by the watermark and end
+ * all open contacts */
+static void
+replay_finish (void)
+{
+	if (reorder_enabled ())
+		thread_estimation_step (stdout, reorder_flush (), false);
+	contact_flush ();
+}
+
+/* sleep until capture time is due at the configured speed */
+static void
+replay_pace (TReplay *r, double timestamp)
+{
+	double delay;
+	struct timespec now, due;
+
+	if (!r->paced)
+	{
+		r->paced = true;
+		r->pace_time = r->pace_last = timestamp;
+		clock_gettime (CLOCK_MONOTONIC, &r->pace_clock);
+		return;
+	}
+
+	/* records of the same instant are due together */
+	if (timestamp <= r->pace_last)
+		return;
+	r->pace_last = timestamp;
+
+	delay = (timestamp - r->pace_time) / r->config->speed;
+	due.tv_sec = r->pace_clock.tv_sec + (time_t) delay;
+	due.tv_nsec = r->pace_clock.tv_nsec +
+		(long) ((delay - floor (delay)) * 1000000000.0);
+	if (due.tv_nsec >= 1000000000L)
+	{
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000L;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec > due.tv_sec) ||
+		((now.tv_sec == due.tv_sec) && (now.tv_nsec >= due.tv_nsec)))
+		return;
+
+	/* hand pending datagrams over before waiting */
+	replay_flush (r);
+	while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL));
+}
+
+/* resolve relative bounds against the first record */
+static void
+replay_started (TReplay *r, double timestamp)
+{
+	const TReplayConfig *config = r->config;
+
+	r->started = true;
+	r->start = (config->start_relative ? timestamp : 0) + config->start;
+	r->stop = config->stop ?
+		(config->stop_relative ? timestamp : 0) + config->stop : 0;
+}
+
+/* false if record lies outside the configured bounds */
+static bool
+replay_bounds (TReplay *r, double timestamp)
+{
+	r->records++;
+	r->last = timestamp;
+
+	if (!r->started)
+		replay_started (r, timestamp);
+
+	if (timestamp < r->start)
+		return false;
+	if (r->stop && (timestamp >= r->stop))
+	{
+		r->done = true;
+		return false;
+	}
+	return true;
+}
+
+static void
+replay_datagram (TReplay *r, double timestamp, uint32_t reader_id,
+	const uint8_t *payload, int len)
+{
+	uint32_t second;
+	const TReplayConfig *config = r->config;
+
+	r->datagrams++;
 
-				/* process all packets in this packet */
-				reader_id = ntohl (ip_hdr->ip_src.s_addr);
+	if (config->speed > 0)
+		replay_pace (r, timestamp);
 
-				/* iterate over all packets */
-				while ((res = parse_packet (timestamp, reader_id, packet, len)) > 0)
+	/* run estimation every step interval of capture time, seconds
+	 * before the last step (capture clock stepping back) don't step */
+	second = (uint32_t) timestamp;
+	if (!r->step || ((int32_t) (second - r->step) >= REPLAY_STEP_INTERVAL))
+	{
+		replay_flush (r);
+		r->step = second;
+		thread_estimation_step (stdout, second, false);
+	}
+	else if (timestamp != r->batch_time)
+		replay_flush (r);
+
+	r->batch_time = timestamp;
+	r->reader_id[r->count] = reader_id;
+	r->data_ptr[r->count] = payload;
+	r->len[r->count] = len;
+	if (++r->count == REPLAY_BATCH)
+		replay_flush (r);
+}
+
+static void
+replay_record (TReplay *r, int linktype, double timestamp, const uint8_t *p,
+	uint32_t caplen)
+{
+	int len;
+	uint32_t reader_id;
+	const uint8_t *payload, *end;
+
+	if (!replay_bounds (r, timestamp))
+		return;
+
+	end = p + caplen;
+	if (((p = replay_link (linktype, p, end)) == NULL) ||
+		!replay_udp (p, end, &reader_id, &payload, &len))
+	{
+		r->skipped++;
+		return;
+	}
+	replay_datagram (r, timestamp, reader_id, payload, len);
+}
+
+static bool
+replay_pcap (TReplay *r)
+{
+	int linktype;
+	uint32_t magic, caplen;
+	double resolution;
+	const uint8_t *p;
+
+	if ((r->end - r->data) < PCAP_HEADER_SIZE)
+		return false;
+
+	memcpy (&magic, r->data, sizeof (magic));
+	if ((magic == PCAP_MAGIC_USEC) || (magic == PCAP_MAGIC_NSEC))
+		r->swap = false;
+	else
+	{
+		magic = __builtin_bswap32 (magic);
+		if ((magic != PCAP_MAGIC_USEC) && (magic != PCAP_MAGIC_NSEC))
+			return false;
+		r->swap = true;
+	}
+	resolution = (magic == PCAP_MAGIC_NSEC) ? 1000000000.0 : 1000000.0;
+
+	/* upper bits carry FCS information */
+	linktype = replay_u32 (r, r->data + 20) & 0xFFFF;
+
+	p = r->data + PCAP_HEADER_SIZE;
+	while (!r->done && ((r->end - p) >= PCAP_RECORD_SIZE))
+	{
+		caplen = replay_u32 (r, p + 8);
+		if (caplen > (uint32_t) (r->end - p - PCAP_RECORD_SIZE))
+		{
+			r->truncated = true;
+			break;
+		}
+
+		replay_record (r, linktype, replay_u32 (r, p) +
+			(replay_u32 (r, p + 4) / resolution), p + PCAP_RECORD_SIZE,
+			caplen);
+		p += PCAP_RECORD_SIZE + caplen;
+	}
+	return true;
+}
+
+static void
+replay_pcapng_interface (TReplay *r, const uint8_t *p, const uint8_t *end)
+{
+	int code, len, value;
+	TReplayInterface *interface;
+
+	if (((end - p) < 8) || (r->interfaces >= REPLAY_MAX_INTERFACES))
+		return;
+
+	interface = &r->interface[r->interfaces++];
+	interface->linktype = replay_u16 (r, p);
+	interface->resolution = 1000000.0;
+
+	/* options padded to 32 bits */
+	for (p += 8; (end - p) >= 4; p += 4 + ((len + 3) & ~3))
+	{
+		code = replay_u16 (r, p);
+		len = replay_u16 (r, p + 2);
+		if ((code == PCAPNG_OPT_END) || (len > (end - p - 4)))
+			break;
+
+		if ((code == PCAPNG_OPT_TSRESOL) && (len >= 1))
+		{
+			/* negative power of two or ten */
+			value = p[4];
+			interface->resolution = (value & 0x80) ?
+				ldexp (1.0, value & 0x7F) : pow (10.0, value);
+		}
+	}
+}
+
+static void
+replay_pcapng_packet (TReplay *r, uint32_t id, uint32_t high, uint32_t low,
+	const uint8_t *p, uint32_t caplen, uint32_t size)
+{
+	const TReplayInterface *interface;
+
+	if ((id >= (uint32_t) r->interfaces) || (caplen > size))
+	{
+		r->skipped++;
+		return;
+	}
+
+	interface = &r->interface[id];
+	replay_record (r, interface->linktype,
+		((((uint64_t) high) << 32) | low) / interface->resolution, p, caplen);
+}
+
+static bool
+replay_pcapng (TReplay *r)
+{
+	uint32_t type, len, magic, size;
+	const uint8_t *p, *body;
+
+	p = r->data;
+	while (!r->done && ((r->end - p) >= 12))
+	{
+		/* section header defines byte order of following blocks */
+		memcpy (&type, p, sizeof (type));
+		if (type == PCAPNG_SHB)
+		{
+			if ((r->end - p) < 28)
+				break;
+			memcpy (&magic, p + 8, sizeof (magic));
+			if (magic == PCAPNG_BYTE_ORDER)
+				r->swap = false;
+			else if (__builtin_bswap32 (magic) == PCAPNG_BYTE_ORDER)
+				r->swap = true;
+			else
+				return false;
+			r->interfaces = 0;
+		}
+		else if (p == r->data)
+			return false;
+
+		type = replay_u32 (r, p);
+		len = replay_u32 (r, p + 4);
+		if ((len < 12) || (len & 3) || (len > (uint32_t) (r->end - p)))
+		{
+			r->truncated = true;
+			break;
+		}
+
+		body = p + 8;
+		size = len - 12;
+		switch (type)
+		{
+			case PCAPNG_IDB:
+				replay_pcapng_interface (r, body, body + size);
+				break;
+
+			case PCAPNG_EPB:
+				if (size >= 20)
+					replay_pcapng_packet (r, replay_u32 (r, body),
+						replay_u32 (r, body + 4), replay_u32 (r, body + 8),
+						body + 20, replay_u32 (r, body + 12), size - 20);
+				break;
+
+			case PCAPNG_PB:
+				if (size >= 20)
+					replay_pcapng_packet (r, replay_u16 (r, body),
+						replay_u32 (r, body + 4), replay_u32 (r, body + 8),
+						body + 20, replay_u32 (r, body + 12), size - 20);
+				break;
+
+			case PCAPNG_SPB:
+				/* no timestamp - use the one of the previous record */
+				if ((size >= 4) && r->interfaces)
 				{
-					len -= res;
-					packet += res;
+					size -= 4;
+					replay_record (r, r->interface[0].linktype, r->last,
+						body + 4, (replay_u32 (r, body) < size) ?
+						replay_u32 (r, body) : size);
 				}
-			}
+				break;
+		}
+		p += len;
+	}
+	return true;
+}
+
+/* journal directory or single segment, seeks to the start bound */
+static void
+replay_journal (TReplay *r, const char *path)
+{
+	int i, first, lo, hi, count;
+	char **files;
+	uint64_t pos;
+	double timestamp;
+	struct stat st;
+	TJournalSegment segment;
+	const TJournalRecord *record;
+
+	if (!stat (path, &st) && S_ISDIR (st.st_mode))
+	{
+		if ((count = journal_list (path, &files)) < 0)
+			diep ("failed to list journal '%s'", path);
+	}
+	else
+	{
+		count = 1;
+		if (((files = (char **) malloc (sizeof (char *))) == NULL) ||
+			((files[0] = strdup (path)) == NULL))
+			diep ("out of memory");
+	}
+
+	/* last segment starting at or before an absolute start bound */
+	first = 0;
+	if ((count > 1) && r->config->start && !r->config->start_relative)
+	{
+		lo = 0;
+		hi = count;
+		while ((hi - lo) > 1)
+		{
+			i = lo + (hi - lo) / 2;
+			if ((journal_start (files[i]) / 1000000.0) <= r->config->start)
+				lo = i;
+			else
+				hi = i;
 		}
+		first = lo;
 	}
+
+	for (i = first; (i < count) && !r->done; i++)
+	{
+		if (!files[i] || !journal_map (files[i], &segment))
+		{
+			fprintf (stderr, "replay: skipping invalid journal segment '%s'\n",
+				files[i] ? files[i] : "?");
+			continue;
+		}
+
+		if (!r->started && segment.records)
+			replay_started (r, segment.record[0].time_us / 1000000.0);
+
+		/* jump to start bound, verify segments replayed in full */
+		pos = r->start ? journal_seek (&segment,
+			(uint64_t) (r->start * 1000000.0)) : 0;
+		if (!pos && !journal_verify (&segment))
+			fprintf (stderr, "replay: checksum mismatch in '%s'\n", files[i]);
+
+		for (record = &segment.record[pos]; (pos < segment.records) &&
+			!r->done; pos++, record++)
+		{
+			timestamp = record->time_us / 1000000.0;
+			if (replay_bounds (r, timestamp))
+				replay_datagram (r, timestamp, record->reader_ip,
+					(const uint8_t *) &record->sighting,
+					sizeof (record->sighting));
+		}
+
+		/* pending datagrams point into the mapping */
+		replay_flush (r);
+		journal_unmap (&segment);
+	}
+
+	for (i = 0; i < count; i++)
+		free (files[i]);
+	free (files);
+}
+
+void
+parse_pcap (const char *file, const TReplayConfig *config)
+{
+	int fd;
+	bool res;
+	void *map;
+	uint32_t type;
+	struct stat st;
+	double started;
+	TReplay *r;
+
+	if ((r = (TReplay *) calloc (1, sizeof (TReplay))) == NULL)
+		diep ("out of memory");
+	r->config = config;
+
+	/* native journal */
+	if (journal_check (file))
+	{
+		started = microtime ();
+		replay_journal (r, file);
+		replay_flush (r);
+		replay_finish ();
+		fprintf (stderr, "replay: %u journal records, %u replayed in %.1fs\n",
+			r->records, r->datagrams, microtime () - started);
+		free (r);
+		return;
+	}
+
+	if ((fd = open (file, O_RDONLY)) == -1)
+		diep ("failed to open '%s'", file);
+	if (fstat (fd, &st))
+		diep ("fstat");
+	if (st.st_size < 4)
+		diep ("'%s' is not a capture file", file);
+
+	/* records are parsed in place */
+	if ((map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+		MAP_FAILED)
+		diep ("mmap");
+	close (fd);
+	madvise (map, st.st_size, MADV_SEQUENTIAL);
+
+	r->data = (const uint8_t *) map;
+	r->end = r->data + st.st_size;
+
+	started = microtime ();
+	memcpy (&type, r->data, sizeof (type));
+	res = (type == PCAPNG_SHB) ? replay_pcapng (r) : replay_pcap (r);
+	if (!res)
+		diep ("unsupported capture format in '%s'", file);
+	replay_flush (r);
+	replay_finish ();
+
+	fprintf (stderr, "replay: %u records, %u datagrams, %u skipped in "
+		"%.1fs%s\n", r->records, r->datagrams, r->skipped,
+		microtime () - started, r->truncated ? " - capture truncated" : "");
+
+	free (r);
+	munmap (map, st.st_size);
 }
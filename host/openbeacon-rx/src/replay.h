@@ -27,6 +27,29 @@
 #ifndef __REPLAY_H__
 #define __REPLAY_H__
 
-extern void parse_pcap (const char *file, bool realtime);
+/* datagrams decrypted together, see parse_batch */
+#define REPLAY_BATCH 64
+/* seconds of capture time between estimation steps */
+#define REPLAY_STEP_INTERVAL 1
+/* pcapng interfaces tracked per section */
+#define REPLAY_MAX_INTERFACES 256
+
+typedef struct
+{
+	/* pacing relative to capture time, zero for maximum speed */
+	double speed;
+	/* capture time bounds, zero for unbounded, relative ones are
+	 * seconds after the first record */
+	double start, stop;
+	bool start_relative, stop_relative;
+} TReplayConfig;
+
+extern void replay_config_init (TReplayConfig *config);
+/* "60x", "0.5" or "max" */
+extern bool replay_config_speed (TReplayConfig *config, const char *speed);
+/* unix time or "+seconds" relative to the first record */
+extern bool replay_config_time (const char *value, double *time,
+	bool *relative);
+extern void parse_pcap (const char *file, const TReplayConfig *config);
 
 #endif/*__REPLAY_H__*/
\ No newline at end of file
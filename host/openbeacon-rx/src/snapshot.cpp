@@ -0,0 +1,417 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "helper.h"
+#include "json.h"
+#include "snapshot.h"
+
+static TSnapshot g_snapshot_buffer[SNAPSHOT_BUFFERS];
+/* most recently published snapshot */
+static TSnapshot *g_snapshot;
+
+static void *
+snapshot_grow (void *array, int *size, size_t item)
+{
+	*size = *size ? (*size * 2) : 1024;
+	if ((array = realloc (array, *size * item)) == NULL)
+		diep ("snapshot_grow");
+	return array;
+}
+
+TSnapshot *
+snapshot_begin (uint32_t sequence, double timestamp, int type)
+{
+	int i;
+	TSnapshot *snap, *published;
+
+	/* pick a buffer which is neither published nor still read */
+	while (1)
+	{
+		published = __atomic_load_n (&g_snapshot, __ATOMIC_ACQUIRE);
+		for (i = 0, snap = g_snapshot_buffer; i < SNAPSHOT_BUFFERS;
+			 i++, snap++)
+			if ((snap != published) &&
+				!__atomic_load_n (&snap->refs, __ATOMIC_ACQUIRE))
+				break;
+		if (i < SNAPSHOT_BUFFERS)
+			break;
+		/* all buffers held by slow readers */
+		usleep (1000);
+	}
+
+	snap->sequence = sequence;
+	snap->timestamp = timestamp;
+	snap->type = type;
+	snap->tag_count = snap->edge_count = snap->reader_count = 0;
+	return snap;
+}
+
+TTagSnapshot *
+snapshot_tag (TSnapshot * snap, int kind, uint32_t tag_id)
+{
+	TTagSnapshot *tag;
+
+	if (snap->tag_count == snap->tag_size)
+		snap->tag = (TTagSnapshot *) snapshot_grow (snap->tag,
+													&snap->tag_size,
+													sizeof (TTagSnapshot));
+	tag = &snap->tag[snap->tag_count++];
+	memset (tag, 0, sizeof (*tag));
+	tag->kind = kind;
+	tag->tag_id = tag_id;
+	return tag;
+}
+
+TEdgeSnapshot *
+snapshot_edge (TSnapshot * snap, int kind, uint32_t tag1, uint32_t tag2)
+{
+	TEdgeSnapshot *edge;
+
+	if (snap->edge_count == snap->edge_size)
+		snap->edge = (TEdgeSnapshot *) snapshot_grow (snap->edge,
+													  &snap->edge_size,
+													  sizeof
+													  (TEdgeSnapshot));
+	edge = &snap->edge[snap->edge_count++];
+	memset (edge, 0, sizeof (*edge));
+	edge->kind = kind;
+	edge->tag1 = tag1;
+	edge->tag2 = tag2;
+	return edge;
+}
+
+TReaderSnapshot *
+snapshot_reader (TSnapshot * snap, uint32_t reader_ip, uint16_t reader_id)
+{
+	TReaderSnapshot *reader;
+
+	if (snap->reader_count == snap->reader_size)
+		snap->reader = (TReaderSnapshot *) snapshot_grow (snap->reader,
+														  &snap->reader_size,
+														  sizeof
+														  (TReaderSnapshot));
+	reader = &snap->reader[snap->reader_count++];
+	memset (reader, 0, sizeof (*reader));
+	reader->reader_ip = reader_ip;
+	reader->reader_id = reader_id;
+	return reader;
+}
+
+void
+snapshot_append_tags (TSnapshot * snap, const TTagSnapshot * tag, int count)
+{
+	if (count <= 0)
+		return;
+	while ((snap->tag_count + count) > snap->tag_size)
+		snap->tag = (TTagSnapshot *) snapshot_grow (snap->tag,
+													&snap->tag_size,
+													sizeof (TTagSnapshot));
+	memcpy (&snap->tag[snap->tag_count], tag, count * sizeof (*tag));
+	snap->tag_count += count;
+}
+
+void
+snapshot_append_edges (TSnapshot * snap, const TEdgeSnapshot * edge,
+					   int count)
+{
+	if (count <= 0)
+		return;
+	while ((snap->edge_count + count) > snap->edge_size)
+		snap->edge = (TEdgeSnapshot *) snapshot_grow (snap->edge,
+													  &snap->edge_size,
+													  sizeof
+													  (TEdgeSnapshot));
+	memcpy (&snap->edge[snap->edge_count], edge, count * sizeof (*edge));
+	snap->edge_count += count;
+}
+
+void
+snapshot_publish (TSnapshot * snap)
+{
+	__atomic_store_n (&g_snapshot, snap, __ATOMIC_RELEASE);
+}
+
+const TSnapshot *
+snapshot_acquire (void)
+{
+	TSnapshot *snap;
+
+	while ((snap = __atomic_load_n (&g_snapshot, __ATOMIC_ACQUIRE)) != NULL)
+	{
+		__atomic_add_fetch (&snap->refs, 1, __ATOMIC_ACQ_REL);
+		/* still current - writer will not recycle it now */
+		if (__atomic_load_n (&g_snapshot, __ATOMIC_ACQUIRE) == snap)
+			break;
+		__atomic_sub_fetch (&snap->refs, 1, __ATOMIC_ACQ_REL);
+	}
+	return snap;
+}
+
+void
+snapshot_release (const TSnapshot * snap)
+{
+	if (snap)
+		__atomic_sub_fetch (&((TSnapshot *) snap)->refs, 1,
+							__ATOMIC_ACQ_REL);
+}
+
+/* inserts are only marked in delta output */
+static void
+snapshot_json_tag (TJsonBuffer * buf, const TTagSnapshot * tag, bool insert)
+{
+	json_str (buf, "{\"id\":");
+	json_int (buf, tag->tag_id);
+	json_str (buf, ",\"hex\":\"");
+	json_hex32 (buf, tag->tag_id);
+	json_str (buf, "\",\"age\":");
+	json_int (buf, tag->age);
+	json_str (buf, ",\"angle\":");
+	json_int (buf, tag->angle);
+	json_str (buf, ",\"voltage\":");
+	json_fixed (buf, tag->voltage, 1);
+	if (tag->button)
+		json_str (buf, ",\"button\":true");
+	if (tag->fixed)
+		json_str (buf, ",\"fixed\":true");
+	if (tag->visible)
+	{
+		json_str (buf, ",\"px\":");
+		json_int (buf, tag->px);
+		json_str (buf, ",\"py\":");
+		json_int (buf, tag->py);
+	}
+	if (tag->room || tag->floor || tag->group)
+	{
+		json_str (buf, ",\"room\":");
+		json_int (buf, tag->room);
+		json_str (buf, ",\"floor\":");
+		json_int (buf, tag->floor);
+		json_str (buf, ",\"group\":");
+		json_int (buf, tag->group);
+	}
+	if (insert)
+		json_str (buf, ",\"new\":true");
+	json_char (buf, '}');
+}
+
+static void
+snapshot_json_edge (TJsonBuffer * buf, const TEdgeSnapshot * edge,
+					bool insert)
+{
+	json_str (buf, "{\"tag\":[");
+	json_int (buf, edge->tag1);
+	json_char (buf, ',');
+	json_int (buf, edge->tag2);
+	json_str (buf, "],\"age\":");
+	json_int (buf, edge->age);
+	json_str (buf, ",\"count\":");
+	json_int (buf, edge->count);
+	json_str (buf, ",\"power\":");
+	json_fixed (buf, edge->power, 1);
+	if (edge->has_dist)
+	{
+		json_str (buf, ",\"dist\":");
+		json_fixed (buf, edge->dist, 1);
+	}
+	if (insert)
+		json_str (buf, ",\"new\":true");
+	json_char (buf, '}');
+}
+
+void
+snapshot_format_tag (TJsonBuffer * buf, const TTagSnapshot * tag)
+{
+	snapshot_json_tag (buf, tag, tag->kind == SNAPSHOT_INSERT);
+}
+
+void
+snapshot_format_edge (TJsonBuffer * buf, const TEdgeSnapshot * edge)
+{
+	snapshot_json_edge (buf, edge, edge->kind == SNAPSHOT_INSERT);
+}
+
+void
+snapshot_format_reader (TJsonBuffer * buf, const TReaderSnapshot * reader)
+{
+	int i;
+	double loss;
+
+	json_str (buf, "{\"ip\":\"");
+	for (i = 24; i >= 0; i -= 8)
+	{
+		json_int (buf, (reader->reader_ip >> i) & 0xFF);
+		if (i)
+			json_char (buf, '.');
+	}
+	json_str (buf, "\",\"id\":");
+	json_int (buf, reader->reader_id);
+	json_str (buf, ",\"interfaces\":");
+	json_int (buf, reader->interfaces);
+	json_str (buf, ",\"age\":");
+	json_int (buf, reader->age);
+	json_str (buf, ",\"records\":");
+	json_int (buf, reader->records);
+	json_str (buf, ",\"rate\":");
+	json_fixed (buf, reader->rate, 1);
+	/* percentage of sequence numbers never received */
+	loss = reader->records ? (100.0 * reader->lost) /
+		(reader->records + reader->lost) : 0;
+	json_str (buf, ",\"lost\":");
+	json_int (buf, reader->lost);
+	json_str (buf, ",\"loss\":");
+	json_fixed (buf, loss, 2);
+	json_str (buf, ",\"reordered\":");
+	json_int (buf, reader->reordered);
+	if (reader->restarts)
+	{
+		json_str (buf, ",\"restarts\":");
+		json_int (buf, reader->restarts);
+	}
+	json_str (buf, ",\"offset\":");
+	json_fixed (buf, reader->offset, 1);
+	json_char (buf, '}');
+}
+
+/* false for records a document of the given type leaves out */
+static inline bool
+snapshot_listed (int kind, bool changed, int type)
+{
+	if (kind == SNAPSHOT_REMOVE)
+		return false;
+	return (type != SNAPSHOT_DELTA) || changed || (kind == SNAPSHOT_INSERT);
+}
+
+void
+snapshot_format (TJsonBuffer * buf, const TSnapshot * snap, int type)
+{
+	bool delta;
+	int i, count;
+	const TEdgeSnapshot *edge;
+	const TTagSnapshot *tag;
+	const TReaderSnapshot *reader;
+
+	json_reset (buf);
+	/* snapshots hold all records, only delta snapshots know changes */
+	if ((type == SNAPSHOT_DELTA) && (snap->type != SNAPSHOT_DELTA))
+		type = snap->type;
+	delta = type == SNAPSHOT_DELTA;
+
+	/* tracking dump state in JSON format */
+	json_str (buf, "{\n  \"id\":");
+	json_int (buf, snap->sequence);
+	json_str (buf, ",\n  \"api\":{\"name\":\"" PROGRAM_NAME "\",\"ver\":\""
+			  PROGRAM_VERSION "\"},\n  \"time\":");
+	json_int (buf, (uint32_t) snap->timestamp);
+	if (delta)
+	{
+		/* changes relative to previous snapshot */
+		json_str (buf, ",\n  \"base\":");
+		json_int (buf, snap->sequence - 1);
+	}
+	else if (type == SNAPSHOT_KEYFRAME)
+		json_str (buf, ",\n  \"keyframe\":true");
+	json_str (buf, ",\n  \"edge\":[");
+
+	/* display all edges */
+	count = 0;
+	for (i = 0, edge = snap->edge; i < snap->edge_count; i++, edge++)
+	{
+		if (!snapshot_listed (edge->kind, edge->changed, type))
+			continue;
+
+		json_str (buf, count++ ? ",\n    " : "\n    ");
+		snapshot_json_edge (buf, edge, delta &&
+							(edge->kind == SNAPSHOT_INSERT));
+	}
+
+	/* display all tags - plain snapshots omit an empty tag list */
+	if (type != SNAPSHOT_FULL)
+		json_str (buf, "\n  ],\n  \"tag\":[");
+	count = 0;
+	for (i = 0, tag = snap->tag; i < snap->tag_count; i++, tag++)
+	{
+		if (!snapshot_listed (tag->kind, tag->changed, type))
+			continue;
+
+		if (!count && (type == SNAPSHOT_FULL))
+			json_str (buf, "\n  ],\n  \"tag\":[");
+
+		json_str (buf, count++ ? ",\n    " : "\n    ");
+		snapshot_json_tag (buf, tag, delta &&
+						   (tag->kind == SNAPSHOT_INSERT));
+	}
+
+	json_str (buf, "\n  ]");
+
+	/* health of all forwarder links */
+	if (snap->reader_count)
+	{
+		json_str (buf, ",\n  \"reader\":[");
+		for (i = 0, reader = snap->reader; i < snap->reader_count;
+			 i++, reader++)
+		{
+			json_str (buf, i ? ",\n    " : "\n    ");
+			snapshot_format_reader (buf, reader);
+		}
+		json_str (buf, "\n  ]");
+	}
+
+	/* edges and tags which left since the previous snapshot */
+	if (delta)
+	{
+		json_str (buf, ",\n  \"removed\":{\"edge\":[");
+		count = 0;
+		for (i = 0, edge = snap->edge; i < snap->edge_count; i++, edge++)
+			if (edge->kind == SNAPSHOT_REMOVE)
+			{
+				json_str (buf, count++ ? ",[" : "[");
+				json_int (buf, edge->tag1);
+				json_char (buf, ',');
+				json_int (buf, edge->tag2);
+				json_char (buf, ']');
+			}
+		json_str (buf, "],\"tag\":[");
+		count = 0;
+		for (i = 0, tag = snap->tag; i < snap->tag_count; i++, tag++)
+			if (tag->kind == SNAPSHOT_REMOVE)
+			{
+				if (count++)
+					json_char (buf, ',');
+				json_int (buf, tag->tag_id);
+			}
+		json_str (buf, "]}");
+	}
+
+	json_str (buf, "\n},");
+}
@@ -0,0 +1,130 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+/* snapshot types */
+#define SNAPSHOT_FULL 0
+#define SNAPSHOT_KEYFRAME 1
+#define SNAPSHOT_DELTA 2
+
+/* record kinds - only delta snapshots distinguish them, removals
+ * are recorded in every snapshot for change streams */
+#define SNAPSHOT_UPDATE 0
+#define SNAPSHOT_INSERT 1
+#define SNAPSHOT_REMOVE 2
+
+/* published snapshots are recycled once all readers released them */
+#define SNAPSHOT_BUFFERS 4
+#define SNAPSHOT_JSON_SIZE (256*1024)
+
+typedef struct
+{
+	int kind;
+	uint32_t tag_id;
+	int age, angle;
+	float voltage;
+	bool button, fixed, visible;
+	int px, py;
+	uint32_t room, floor, group;
+	/* differs from the previous snapshot */
+	bool changed;
+} TTagSnapshot;
+
+typedef struct
+{
+	int kind;
+	uint32_t tag1, tag2;
+	int age, count;
+	double power, dist;
+	bool has_dist;
+	/* differs from the previous snapshot */
+	bool changed;
+	/* groups of both tags, zero if unknown */
+	uint32_t group1, group2;
+} TEdgeSnapshot;
+
+/* forwarder link health, always complete */
+typedef struct
+{
+	uint32_t reader_ip;
+	uint16_t reader_id;
+	int interfaces, age;
+	/* records received, sequence numbers missing or late */
+	uint64_t records, lost, reordered, restarts;
+	/* records per second, reader clock minus local clock in seconds */
+	double rate, offset;
+} TReaderSnapshot;
+
+/* estimation result - immutable once published */
+typedef struct
+{
+	uint32_t sequence;
+	double timestamp;
+	int type;
+	int refs;
+	TTagSnapshot *tag;
+	int tag_count, tag_size;
+	TEdgeSnapshot *edge;
+	int edge_count, edge_size;
+	TReaderSnapshot *reader;
+	int reader_count, reader_size;
+} TSnapshot;
+
+/* writer side - estimation thread only */
+extern TSnapshot *snapshot_begin (uint32_t sequence, double timestamp,
+								  int type);
+extern TTagSnapshot *snapshot_tag (TSnapshot * snap, int kind,
+								   uint32_t tag_id);
+extern TEdgeSnapshot *snapshot_edge (TSnapshot * snap, int kind,
+									 uint32_t tag1, uint32_t tag2);
+extern TReaderSnapshot *snapshot_reader (TSnapshot * snap,
+										 uint32_t reader_ip,
+										 uint16_t reader_id);
+/* records built into a private TSnapshot, e.g. by a pool worker */
+extern void snapshot_append_tags (TSnapshot * snap,
+								  const TTagSnapshot * tag, int count);
+extern void snapshot_append_edges (TSnapshot * snap,
+								   const TEdgeSnapshot * edge, int count);
+extern void snapshot_publish (TSnapshot * snap);
+
+/* reader side - any thread */
+extern const TSnapshot *snapshot_acquire (void);
+extern void snapshot_release (const TSnapshot * snap);
+
+/* document of the given type - SNAPSHOT_FULL is always possible,
+ * SNAPSHOT_DELTA only from a delta snapshot */
+extern void snapshot_format (TJsonBuffer * buf, const TSnapshot * snap,
+							 int type);
+/* single record as JSON object */
+extern void snapshot_format_tag (TJsonBuffer * buf, const TTagSnapshot * tag);
+extern void snapshot_format_edge (TJsonBuffer * buf,
+								  const TEdgeSnapshot * edge);
+extern void snapshot_format_reader (TJsonBuffer * buf,
+									const TReaderSnapshot * reader);
+
+#endif/*__SNAPSHOT_H__*/
@@ -0,0 +1,610 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "helper.h"
+#include "json.h"
+#include "snapshot.h"
+#include "contact.h"
+#include "stream.h"
+
+/* event types, also used as filter bits */
+#define STREAM_TAG 1
+#define STREAM_EDGE 2
+#define STREAM_CONTACT 4
+
+#define STREAM_HASH_SIZE (STREAM_QUEUE_SIZE*2)
+/* initial slots of the set of shown tags and edges */
+#define STREAM_SHOWN_SIZE 1024
+
+typedef struct
+{
+	int type;
+	bool remove;
+	uint32_t sequence;
+	/* tag id or both tag ids of an edge */
+	uint64_t key;
+	union
+	{
+		TTagSnapshot tag;
+		TEdgeSnapshot edge;
+		TContactEvent contact;
+	};
+} TStreamEvent;
+
+/* tag or edge the client currently shows, zero type marks free slots */
+typedef struct
+{
+	int type;
+	uint64_t key;
+} TStreamShown;
+
+struct TStreamSubscriber
+{
+	/* filter - sorted lists, immutable once subscribed */
+	int types;
+	int tag_count, group_count;
+	uint32_t tag[STREAM_FILTER_SIZE], group[STREAM_FILTER_SIZE];
+	bool has_power;
+	double power;
+	/* pending events in arrival order, guarded by g_stream_mutex */
+	TStreamEvent *queue;
+	int count;
+	/* open addressing hash of queue index+1, zero marks free slots */
+	int *index;
+	/* events were dropped - client has to fetch snapshot 'sequence',
+	 * the one the shown set was seeded from */
+	bool overflow;
+	uint32_t sequence;
+	/* open addressing set of what the client shows, rebuilt from the
+	 * next snapshot once resync is requested */
+	TStreamShown *shown;
+	int shown_count, shown_size;
+	bool resync, seed;
+	/* drained events, owned by the draining thread */
+	TStreamEvent *spare;
+	TStreamSubscriber *next;
+};
+
+static pthread_mutex_t g_stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TStreamSubscriber *g_stream_list;
+static int g_stream_count;
+
+static int
+stream_compare (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+static inline bool
+stream_find (const uint32_t * list, int count, uint32_t value)
+{
+	return bsearch (&value, list, count, sizeof (uint32_t),
+					&stream_compare) != NULL;
+}
+
+/* comma separated list of decimal or 0x prefixed numbers */
+static bool
+stream_parse_list (const char *p, uint32_t * list, int *count)
+{
+	char *end;
+	unsigned long value;
+
+	while (true)
+	{
+		if (*count >= STREAM_FILTER_SIZE)
+			return false;
+		value = strtoul (p, &end, strncasecmp (p, "0x", 2) ? 10 : 16);
+		if ((end == p) || (value > 0xFFFFFFFFUL))
+			return false;
+		list[(*count)++] = value;
+		if (*end != ',')
+			return !*end || (*end == '&');
+		p = end + 1;
+	}
+}
+
+static bool
+stream_parse_types (const char *p, int *types)
+{
+	int len;
+
+	*types = 0;
+	while (true)
+	{
+		len = strcspn (p, ",&");
+		if ((len == 3) && !strncmp (p, "tag", 3))
+			*types |= STREAM_TAG;
+		else if ((len == 4) && !strncmp (p, "edge", 4))
+			*types |= STREAM_EDGE;
+		else if ((len == 7) && !strncmp (p, "contact", 7))
+			*types |= STREAM_CONTACT;
+		else
+			return false;
+		if (p[len] != ',')
+			return true;
+		p += len + 1;
+	}
+}
+
+static bool
+stream_parse (TStreamSubscriber * sub, const char *query)
+{
+	const char *p;
+	char *end;
+
+	sub->types = STREAM_TAG | STREAM_EDGE;
+	for (p = query; p && *p; p = (p = strchr (p, '&')) ? p + 1 : NULL)
+	{
+		if (!strncmp (p, "tag=", 4))
+		{
+			if (!stream_parse_list (p + 4, sub->tag, &sub->tag_count))
+				return false;
+		}
+		else if (!strncmp (p, "group=", 6))
+		{
+			if (!stream_parse_list (p + 6, sub->group, &sub->group_count))
+				return false;
+		}
+		else if (!strncmp (p, "power=", 6))
+		{
+			sub->power = strtod (p + 6, &end);
+			if ((end == p + 6) || (*end && (*end != '&')))
+				return false;
+			sub->has_power = true;
+		}
+		else if (!strncmp (p, "type=", 5))
+		{
+			if (!stream_parse_types (p + 5, &sub->types))
+				return false;
+		}
+		else if (*p != '&')
+			return false;
+	}
+
+	qsort (sub->tag, sub->tag_count, sizeof (uint32_t), &stream_compare);
+	qsort (sub->group, sub->group_count, sizeof (uint32_t), &stream_compare);
+	return true;
+}
+
+TStreamSubscriber *
+stream_subscribe (const char *query)
+{
+	TStreamSubscriber *sub;
+
+	if ((sub = (TStreamSubscriber *) calloc (1, sizeof (*sub))) == NULL)
+		diep ("stream_subscribe");
+	if (!stream_parse (sub, query))
+	{
+		free (sub);
+		return NULL;
+	}
+
+	if (((sub->queue = (TStreamEvent *)
+		  malloc (STREAM_QUEUE_SIZE * sizeof (TStreamEvent))) == NULL) ||
+		((sub->spare = (TStreamEvent *)
+		  malloc (STREAM_QUEUE_SIZE * sizeof (TStreamEvent))) == NULL) ||
+		((sub->index = (int *) calloc (STREAM_HASH_SIZE, sizeof (int))) ==
+		 NULL) ||
+		((sub->shown = (TStreamShown *)
+		  calloc (STREAM_SHOWN_SIZE, sizeof (TStreamShown))) == NULL))
+		diep ("stream_subscribe");
+	sub->shown_size = STREAM_SHOWN_SIZE;
+
+	/* starts with a resync - client fetches the next snapshot */
+	sub->resync = true;
+
+	pthread_mutex_lock (&g_stream_mutex);
+	sub->next = g_stream_list;
+	g_stream_list = sub;
+	__atomic_add_fetch (&g_stream_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock (&g_stream_mutex);
+
+	return sub;
+}
+
+void
+stream_unsubscribe (TStreamSubscriber * sub)
+{
+	TStreamSubscriber **p;
+
+	if (!sub)
+		return;
+
+	pthread_mutex_lock (&g_stream_mutex);
+	for (p = &g_stream_list; *p; p = &(*p)->next)
+		if (*p == sub)
+		{
+			*p = sub->next;
+			__atomic_sub_fetch (&g_stream_count, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	pthread_mutex_unlock (&g_stream_mutex);
+
+	free (sub->queue);
+	free (sub->spare);
+	free (sub->index);
+	free (sub->shown);
+	free (sub);
+}
+
+static inline uint32_t
+stream_hash (int type, uint64_t key)
+{
+	key = (key + type) * 0x9E3779B97F4A7C15ULL;
+	return (uint32_t) (key >> 32);
+}
+
+/* latest state of a tag or edge replaces its pending event,
+ * contact events are all kept */
+static void
+stream_push (TStreamSubscriber * sub, const TStreamEvent * ev)
+{
+	int i;
+	uint32_t slot;
+	TStreamEvent *pending;
+
+	/* nothing to add until the next snapshot seeds the client */
+	if (sub->resync)
+		return;
+
+	if (ev->type == STREAM_CONTACT)
+	{
+		if (sub->count == STREAM_QUEUE_SIZE)
+			sub->resync = true;
+		else
+			sub->queue[sub->count++] = *ev;
+		return;
+	}
+
+	for (slot = stream_hash (ev->type, ev->key) & (STREAM_HASH_SIZE - 1);
+		 (i = sub->index[slot]) != 0; slot = (slot + 1) & (STREAM_HASH_SIZE - 1))
+	{
+		pending = &sub->queue[i - 1];
+		if ((pending->type == ev->type) && (pending->key == ev->key))
+		{
+			*pending = *ev;
+			return;
+		}
+	}
+
+	if (sub->count == STREAM_QUEUE_SIZE)
+	{
+		sub->resync = true;
+		return;
+	}
+	sub->queue[sub->count] = *ev;
+	sub->index[slot] = ++sub->count;
+}
+
+/* slot of a shown tag or edge, or the free slot ending its probe */
+static int
+stream_shown_slot (const TStreamSubscriber * sub, int type, uint64_t key)
+{
+	int slot;
+	const TStreamShown *shown;
+
+	for (slot = stream_hash (type, key) & (sub->shown_size - 1);;
+		 slot = (slot + 1) & (sub->shown_size - 1))
+	{
+		shown = &sub->shown[slot];
+		if (!shown->type || ((shown->type == type) && (shown->key == key)))
+			return slot;
+	}
+}
+
+static void
+stream_shown_add (TStreamSubscriber * sub, int type, uint64_t key)
+{
+	int i, size;
+	TStreamShown *old;
+
+	/* keep the set at most half full */
+	if ((sub->shown_count + 1) * 2 > sub->shown_size)
+	{
+		old = sub->shown;
+		size = sub->shown_size;
+		sub->shown_size = size * 2;
+		if ((sub->shown = (TStreamShown *)
+			 calloc (sub->shown_size, sizeof (TStreamShown))) == NULL)
+			diep ("stream_shown_add");
+		for (i = 0; i < size; i++)
+			if (old[i].type)
+				sub->shown[stream_shown_slot (sub, old[i].type,
+											  old[i].key)] = old[i];
+		free (old);
+	}
+
+	sub->shown[stream_shown_slot (sub, type, key)] =
+		(TStreamShown) {type, key};
+	sub->shown_count++;
+}
+
+/* backward shift keeps probe sequences intact without tombstones */
+static void
+stream_shown_remove (TStreamSubscriber * sub, int slot)
+{
+	int next, home, mask;
+
+	mask = sub->shown_size - 1;
+	for (next = (slot + 1) & mask; sub->shown[next].type;
+		 next = (next + 1) & mask)
+	{
+		home = stream_hash (sub->shown[next].type,
+							sub->shown[next].key) & mask;
+		/* entry may only move back if its home lies outside (slot,next] */
+		if (((next - home) & mask) >= ((next - slot) & mask))
+		{
+			sub->shown[slot] = sub->shown[next];
+			slot = next;
+		}
+	}
+	sub->shown[slot].type = 0;
+	sub->shown_count--;
+}
+
+/* filter match, ignoring removals */
+static bool
+stream_match (const TStreamSubscriber * sub, const TStreamEvent * ev)
+{
+	if (!(sub->types & ev->type))
+		return false;
+
+	if (ev->type == STREAM_TAG)
+		return !((sub->tag_count &&
+				  !stream_find (sub->tag, sub->tag_count, ev->tag.tag_id)) ||
+				 (sub->group_count &&
+				  !stream_find (sub->group, sub->group_count,
+								ev->tag.group)));
+
+	if (ev->type == STREAM_CONTACT)
+		return !((sub->tag_count &&
+				  !stream_find (sub->tag, sub->tag_count, ev->contact.tag1) &&
+				  !stream_find (sub->tag, sub->tag_count, ev->contact.tag2)) ||
+				 (sub->group_count &&
+				  !stream_find (sub->group, sub->group_count,
+								ev->contact.group1) &&
+				  !stream_find (sub->group, sub->group_count,
+								ev->contact.group2)));
+
+	/* edges match if either of their tags does and if strong enough */
+	return !((sub->tag_count &&
+			  !stream_find (sub->tag, sub->tag_count, ev->edge.tag1) &&
+			  !stream_find (sub->tag, sub->tag_count, ev->edge.tag2)) ||
+			 (sub->group_count &&
+			  !stream_find (sub->group, sub->group_count, ev->edge.group1) &&
+			  !stream_find (sub->group, sub->group_count, ev->edge.group2)) ||
+			 (sub->has_power && (ev->edge.power < sub->power)));
+}
+
+/* tags and edges entering the filter are sent, changes while inside,
+ * and a single remove once they leave it */
+static void
+stream_offer (TStreamSubscriber * sub, TStreamEvent * ev, bool changed)
+{
+	int slot;
+	bool match, shown, remove;
+
+	match = !ev->remove && stream_match (sub, ev);
+	slot = stream_shown_slot (sub, ev->type, ev->key);
+	shown = sub->shown[slot].type != 0;
+
+	if (match)
+	{
+		if (!shown)
+			stream_shown_add (sub, ev->type, ev->key);
+		if ((changed || !shown) && !sub->seed)
+			stream_push (sub, ev);
+	}
+	else if (shown)
+	{
+		stream_shown_remove (sub, slot);
+		if (!sub->seed)
+		{
+			remove = ev->remove;
+			ev->remove = true;
+			stream_push (sub, ev);
+			ev->remove = remove;
+		}
+	}
+}
+
+bool
+stream_active (void)
+{
+	return __atomic_load_n (&g_stream_count, __ATOMIC_RELAXED) > 0;
+}
+
+void
+stream_publish (const TSnapshot * snap)
+{
+	int i;
+	TStreamEvent ev;
+	TStreamSubscriber *sub;
+	const TTagSnapshot *tag;
+	const TEdgeSnapshot *edge;
+
+	if (!stream_active ())
+		return;
+
+	memset (&ev, 0, sizeof (ev));
+	ev.sequence = snap->sequence;
+
+	pthread_mutex_lock (&g_stream_mutex);
+	for (sub = g_stream_list; sub; sub = sub->next)
+	{
+		/* after a resync the client fetches this snapshot - drop what
+		 * is queued, record what it contains without sending events
+		 * and name it in the resync event */
+		sub->seed = sub->resync;
+		sub->resync = false;
+		if (!sub->seed)
+			continue;
+		sub->count = 0;
+		memset (sub->index, 0, STREAM_HASH_SIZE * sizeof (int));
+		memset (sub->shown, 0, sub->shown_size * sizeof (TStreamShown));
+		sub->shown_count = 0;
+		sub->overflow = true;
+		sub->sequence = snap->sequence;
+	}
+
+	/* snapshots hold every record, unchanged ones may still enter or
+	 * leave a group filter */
+	ev.type = STREAM_TAG;
+	for (i = 0, tag = snap->tag; i < snap->tag_count; i++, tag++)
+	{
+		ev.remove = tag->kind == SNAPSHOT_REMOVE;
+		ev.key = tag->tag_id;
+		ev.tag = *tag;
+		for (sub = g_stream_list; sub; sub = sub->next)
+			stream_offer (sub, &ev, tag->changed);
+	}
+
+	ev.type = STREAM_EDGE;
+	for (i = 0, edge = snap->edge; i < snap->edge_count; i++, edge++)
+	{
+		ev.remove = edge->kind == SNAPSHOT_REMOVE;
+		ev.key = (((uint64_t) edge->tag1) << 32) | edge->tag2;
+		ev.edge = *edge;
+		for (sub = g_stream_list; sub; sub = sub->next)
+			stream_offer (sub, &ev, edge->changed);
+	}
+
+	for (sub = g_stream_list; sub; sub = sub->next)
+		sub->seed = false;
+	pthread_mutex_unlock (&g_stream_mutex);
+}
+
+void
+stream_contact (uint32_t sequence, const TContactEvent * contact, int count)
+{
+	int i;
+	TStreamEvent ev;
+	TStreamSubscriber *sub;
+
+	if (!stream_active ())
+		return;
+
+	memset (&ev, 0, sizeof (ev));
+	ev.type = STREAM_CONTACT;
+	ev.sequence = sequence;
+
+	pthread_mutex_lock (&g_stream_mutex);
+	for (i = 0; i < count; i++, contact++)
+	{
+		ev.contact = *contact;
+		for (sub = g_stream_list; sub; sub = sub->next)
+			if (stream_match (sub, &ev))
+				stream_push (sub, &ev);
+	}
+	pthread_mutex_unlock (&g_stream_mutex);
+}
+
+bool
+stream_drain (TStreamSubscriber * sub, TJsonBuffer * buf)
+{
+	int i, count;
+	bool overflow;
+	uint32_t sequence;
+	TStreamEvent *ev;
+
+	/* swap queues, format outside the lock */
+	pthread_mutex_lock (&g_stream_mutex);
+	count = sub->count;
+	overflow = sub->overflow;
+	sequence = sub->sequence;
+	if (count)
+	{
+		ev = sub->queue;
+		sub->queue = sub->spare;
+		sub->spare = ev;
+		sub->count = 0;
+		memset (sub->index, 0, STREAM_HASH_SIZE * sizeof (int));
+	}
+	sub->overflow = false;
+	pthread_mutex_unlock (&g_stream_mutex);
+
+	if (overflow)
+	{
+		json_str (buf, "event: resync\nid: ");
+		json_int (buf, sequence);
+		json_str (buf, "\ndata: {\"id\":");
+		json_int (buf, sequence);
+		json_str (buf, "}\n\n");
+	}
+
+	for (i = 0, ev = sub->spare; i < count; i++, ev++)
+	{
+		if (ev->type == STREAM_CONTACT)
+		{
+			json_str (buf, "event: contact\nid: ");
+			json_int (buf, ev->sequence);
+			json_str (buf, "\ndata: ");
+			contact_format (buf, &ev->contact);
+			json_str (buf, "\n\n");
+			continue;
+		}
+
+		json_str (buf, ev->remove ? "event: remove\nid: " :
+				  (ev->type == STREAM_TAG) ? "event: tag\nid: " :
+				  "event: edge\nid: ");
+		json_int (buf, ev->sequence);
+		json_str (buf, "\ndata: ");
+		if (!ev->remove)
+		{
+			if (ev->type == STREAM_TAG)
+				snapshot_format_tag (buf, &ev->tag);
+			else
+				snapshot_format_edge (buf, &ev->edge);
+		}
+		else if (ev->type == STREAM_TAG)
+		{
+			json_str (buf, "{\"id\":");
+			json_int (buf, ev->tag.tag_id);
+			json_char (buf, '}');
+		}
+		else
+		{
+			json_str (buf, "{\"tag\":[");
+			json_int (buf, ev->edge.tag1);
+			json_char (buf, ',');
+			json_int (buf, ev->edge.tag2);
+			json_str (buf, "]}");
+		}
+		json_str (buf, "\n\n");
+	}
+
+	return overflow || count;
+}
@@ -0,0 +1,54 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - OnAir protocol position tracker
+ *
+ * uses a physical model and statistical analysis to calculate
+ * positions of tags
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published
+ by the Free Software Foundation; version 3.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program; if not, write to the Free Software Foundation,
+ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+/* pending events per subscriber, updates of the same tag or edge
+ * coalesce into one event */
+#define STREAM_QUEUE_SIZE 4096
+/* tag ids or groups per filter */
+#define STREAM_FILTER_SIZE 256
+/* seconds of silence before a keep-alive comment */
+#define STREAM_KEEPALIVE 15
+
+typedef struct TStreamSubscriber TStreamSubscriber;
+
+/* "tag=id,..&group=g,..&power=dBm&type=tag|edge|contact" - NULL
+ * if invalid, contact events are only sent when asked for */
+extern TStreamSubscriber *stream_subscribe (const char *query);
+extern void stream_unsubscribe (TStreamSubscriber * sub);
+/* append queued events as server-sent events, false if none */
+extern bool stream_drain (TStreamSubscriber * sub, TJsonBuffer * buf);
+
+/* estimation thread */
+extern bool stream_active (void);
+extern void stream_publish (const TSnapshot * snap);
+/* requires contact.h */
+extern void stream_contact (uint32_t sequence, const TContactEvent * ev,
+							int count);
+
+#endif/*__STREAM_H__*/
@@ -0,0 +1,261 @@
+/***************************************************************
+ *
+ * OpenBeacon.org - allocation free JSON output buffer
+ *
+ * shared by openbeacon-rx, openbeacon-power and openbeacon-sniffer
+ *
+ * Copyright 2009-2015 Milosch Meriac <milosch@meriac.com>
+ *
+ ***************************************************************/
+
+/*
+ This program is free software; you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation; version 2.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License along
+ with this program; if not, write to the Free Software Foundation, Inc.,
+ 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+ */
+
+#ifndef __JSON_H__
+#define __JSON_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* reusable output buffer - grows on demand and is kept across
+ * snapshots, so steady state formatting does not allocate */
+typedef struct
+{
+	char *data;
+	size_t len, size;
+} TJsonBuffer;
+
+static inline void
+json_init (TJsonBuffer * buf, size_t size)
+{
+	buf->len = 0;
+	buf->size = size;
+	if ((buf->data = (char *) malloc (size)) == NULL)
+	{
+		fprintf (stderr, "json: out of memory (%u bytes)\n", (unsigned) size);
+		exit (EXIT_FAILURE);
+	}
+}
+
+static inline void
+json_free (TJsonBuffer * buf)
+{
+	free (buf->data);
+	buf->data = NULL;
+	buf->len = buf->size = 0;
+}
+
+static inline void
+json_reset (TJsonBuffer * buf)
+{
+	buf->len = 0;
+}
+
+static inline char *
+json_reserve (TJsonBuffer * buf, size_t len)
+{
+	size_t size;
+
+	if ((buf->len + len) > buf->size)
+	{
+		for (size = buf->size ? buf->size : 256; size < (buf->len + len);
+			 size *= 2);
+		if ((buf->data = (char *) realloc (buf->data, size)) == NULL)
+		{
+			fprintf (stderr, "json: out of memory (%u bytes)\n",
+					 (unsigned) size);
+			exit (EXIT_FAILURE);
+		}
+		buf->size = size;
+	}
+	return &buf->data[buf->len];
+}
+
+static inline void
+json_raw (TJsonBuffer * buf, const char *data, size_t len)
+{
+	memcpy (json_reserve (buf, len), data, len);
+	buf->len += len;
+}
+
+static inline void
+json_str (TJsonBuffer * buf, const char *str)
+{
+	json_raw (buf, str, strlen (str));
+}
+
+static inline void
+json_char (TJsonBuffer * buf, char c)
+{
+	*json_reserve (buf, 1) = c;
+	buf->len++;
+}
+
+/* integer in printf "%i" or "%0Ni"/"%Ni" style */
+static inline void
+json_int_pad (TJsonBuffer * buf, int64_t value, int width, char pad)
+{
+	char tmp[24], *p, *out;
+	uint64_t v;
+	int len, sign;
+
+	sign = value < 0;
+	v = sign ? (0 - (uint64_t) value) : (uint64_t) value;
+
+	p = &tmp[sizeof (tmp)];
+	do
+	{
+		*--p = '0' + (v % 10);
+		v /= 10;
+	}
+	while (v);
+	len = (int) (&tmp[sizeof (tmp)] - p);
+
+	width -= len + sign;
+	out = json_reserve (buf, len + sign + ((width > 0) ? width : 0));
+	if (pad != '0')
+		for (; width > 0; width--)
+			*out++ = pad;
+	if (sign)
+		*out++ = '-';
+	for (; width > 0; width--)
+		*out++ = '0';
+	memcpy (out, p, len);
+	buf->len = (out + len) - buf->data;
+}
+
+static inline void
+json_int (TJsonBuffer * buf, int64_t value)
+{
+	json_int_pad (buf, value, 0, ' ');
+}
+
+/* "0x%08X" */
+static inline void
+json_hex32 (TJsonBuffer * buf, uint32_t value)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char *out;
+	int i;
+
+	out = json_reserve (buf, 10);
+	out[0] = '0';
+	out[1] = 'x';
+	for (i = 9; i >= 2; i--, value >>= 4)
+		out[i] = hex[value & 0xF];
+	buf->len += 10;
+}
+
+/* fixed point in printf "%N.Df" style - scaled in extended precision
+ * and rounded half to even, matching glibc for practical values */
+static inline void
+json_fixed_pad (TJsonBuffer * buf, double value, int decimals, int width,
+				char pad)
+{
+	static const long double scale[] =
+		{ 1, 10, 100, 1000, 10000, 100000, 1000000 };
+	char tmp[32], *p, *out;
+	long double v, frac;
+	uint64_t i, div;
+	int len, sign, d;
+
+	if ((decimals < 0) || (decimals > 6) || !(value == value) ||
+		(value > 1e12) || (value < -1e12))
+	{
+		/* rare - out of fixed point range */
+		len = snprintf (tmp, sizeof (tmp), "%*.*f", width, decimals, value);
+		json_raw (buf, tmp, (len < (int) sizeof (tmp)) ? len : 0);
+		return;
+	}
+
+	sign = (value < 0);
+	v = (long double) (sign ? -value : value) * scale[decimals];
+	i = (uint64_t) v;
+	frac = v - (long double) i;
+	if ((frac > 0.5) || ((frac == 0.5) && (i & 1)))
+		i++;
+	/* no negative zero */
+	if (!i)
+		sign = 0;
+
+	p = &tmp[sizeof (tmp)];
+	div = i;
+	for (d = 0; d < decimals; d++)
+	{
+		*--p = '0' + (div % 10);
+		div /= 10;
+	}
+	if (decimals)
+		*--p = '.';
+	do
+	{
+		*--p = '0' + (div % 10);
+		div /= 10;
+	}
+	while (div);
+	if (sign)
+		*--p = '-';
+	len = (int) (&tmp[sizeof (tmp)] - p);
+
+	width -= len;
+	out = json_reserve (buf, len + ((width > 0) ? width : 0));
+	if ((pad == '0') && sign && (width > 0))
+	{
+		*out++ = *p++;
+		len--;
+	}
+	for (; width > 0; width--)
+		*out++ = pad;
+	memcpy (out, p, len);
+	buf->len = (out + len) - buf->data;
+}
+
+static inline void
+json_fixed (TJsonBuffer * buf, double value, int decimals)
+{
+	json_fixed_pad (buf, value, decimals, 0, ' ');
+}
+
+/* send complete buffer with as few syscalls as possible */
+static inline bool
+json_write (TJsonBuffer * buf, int fd)
+{
+	const char *p;
+	size_t len;
+	ssize_t res;
+
+	p = buf->data;
+	len = buf->len;
+	while (len)
+	{
+		if ((res = write (fd, p, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += res;
+		len -= res;
+	}
+	return true;
+}
+
+#endif/*__JSON_H__*/
@@ -39,6 +39,7 @@
 #define PACKED __attribute__((packed))
 #include "openbeacon-proto.h"
 #include "crypto.h"
+#include "json.h"
 
 
 #ifndef TAG_UART_BAUD_RATE
@@ -57,6 +58,7 @@ static void port_rx(const TBeaconNgTracker* pkt_encrypted, int rssi)
 	int status;
 	TBeaconNgTracker pkt;
 	time_t tloc;
+	static TJsonBuffer json;
 
 	/* decrypt valid packet */
 	if((status = aes_decr(pkt_encrypted, &pkt, sizeof(pkt), CONFIG_SIGNATURE_SIZE))!=0)
@@ -74,39 +76,51 @@ static void port_rx(const TBeaconNgTracker* pkt_encrypted, int rssi)
 	}
 
 	time(&tloc);
-	fprintf(stdout,
-		"{ \"uid\":\"0x%08X\", \"time_local_s\":%8u, \"time_remote_s\":%8u, \"rssi\":%3i, \"angle\":%3i, \"voltage\":%3.1f, \"tx_power\":%i",
-		pkt.uid,
-		(int)tloc,
-		pkt.epoch,
-		rssi,
-		pkt.angle,
-		pkt.voltage / 10.0,
-		pkt.tx_power);
+
+	if(!json.data)
+		json_init(&json, 512);
+	json_reset(&json);
+
+	json_str(&json, "{ \"uid\":\"");
+	json_hex32(&json, pkt.uid);
+	json_str(&json, "\", \"time_local_s\":");
+	json_int_pad(&json, (int)tloc, 8, ' ');
+	json_str(&json, ", \"time_remote_s\":");
+	json_int_pad(&json, pkt.epoch, 8, ' ');
+	json_str(&json, ", \"rssi\":");
+	json_int_pad(&json, rssi, 3, ' ');
+	json_str(&json, ", \"angle\":");
+	json_int_pad(&json, pkt.angle, 3, ' ');
+	json_str(&json, ", \"voltage\":");
+	json_fixed_pad(&json, pkt.voltage / 10.0, 1, 3, ' ');
+	json_str(&json, ", \"tx_power\":");
+	json_int(&json, pkt.tx_power);
 
 	/* optionally decode button */
 	if(pkt.proto & RFBPROTO_PROTO_BUTTON)
-		fprintf(stdout,", \"button\": 1");
+		json_str(&json, ", \"button\": 1");
 
 	switch(proto)
 	{
 		case 30:
 			if(pkt.p.sighting[0].uid)
 			{
-				fprintf(stdout,", \"sighting\": ");
+				json_str(&json, ", \"sighting\": ");
 				for(i=0; i<CONFIG_SIGHTING_SLOTS; i++)
 					if(pkt.p.sighting[i].uid)
-						fprintf(stdout, "%c{\"uid\":\"0x%08X\",\"rssi\":%i}",
-							i ? ',':'[',
-							pkt.p.sighting[i].uid,
-							pkt.p.sighting[i].rx_power
-						);
-				fprintf(stdout,"]");
+					{
+						json_str(&json, i ? ",{\"uid\":\"" : "[{\"uid\":\"");
+						json_hex32(&json, pkt.p.sighting[i].uid);
+						json_str(&json, "\",\"rssi\":");
+						json_int(&json, pkt.p.sighting[i].rx_power);
+						json_char(&json, '}');
+					}
+				json_char(&json, ']');
 			}
 			break;
 	}
-	fprintf(stdout, "}\n\r");
-	fflush(stdout);
+	json_str(&json, "}\n\r");
+	json_write(&json, STDOUT_FILENO);
 }
 
 static int port_open(const char *device, int baud_rate)